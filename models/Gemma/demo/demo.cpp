@@ -16,6 +16,7 @@
 #include "memory.h"
 #include "sentencepiece/sentencepiece_processor.h"
 #include "bmruntime_interface.h"
+#include "attention_mask.h"
 #include <getopt.h>
 #include <stdio.h>
 #include <inttypes.h>
@@ -174,19 +175,14 @@ void Gemma::d2d(bm_device_mem_t &dst, bm_device_mem_t &src) {
 int Gemma::forward_first() {
   std::vector<int> input_ids(SEQLEN, 0);
   std::vector<int> position_id(SEQLEN, 0);
-  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN, ATTENTION_MASK);
+  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN);
   std::copy(history_tokens.begin(), history_tokens.end(), input_ids.data());
 
   for (size_t i = 0; i < history_tokens.size(); i++) {
     position_id[i] = i;
   }
-  for (size_t i = 0; i < history_tokens.size(); i++) {
-    for (size_t j = 0; j < SEQLEN; j++) {
-      if (j <= i) {
-        attention_mask[i * SEQLEN + j] = 0;
-      }
-    }
-  }
+  build_prefill_mask(attention_mask.data(),
+                     (int)history_tokens.size(), SEQLEN, ATTENTION_MASK);
 
   // forward embeding
   auto &in_mem = net_embed->stages[0].input_mems[0];
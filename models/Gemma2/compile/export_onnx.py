@@ -20,6 +20,8 @@ torch.set_grad_enabled(False)
 parser = argparse.ArgumentParser(description='export onnx.')
 parser.add_argument('--model_path', required=True,
                     type=str, help='path to the torch model.')
+parser.add_argument('--seq_length', type=int, default=0,
+                    help='sequence length, max_position_embeddings of the config if not set.')
 
 args = parser.parse_args()
 
@@ -37,14 +39,23 @@ config = causal_model.config
 gemma_model = causal_model.model
 layers = gemma_model.layers
 
-SEQ_LENGTH = config.max_position_embeddings
+SEQ_LENGTH = args.seq_length or config.max_position_embeddings
 NUM_LAYERS = config.num_hidden_layers
 HIDDEN_SIZE = config.hidden_size
 NUM_ATTENTION_HEADS = config.num_attention_heads
 HEAD_DIM = config.head_dim
 KV_HEAD = config.num_key_value_heads
+# even layers attend to the last WINDOW tokens only, their block_cache keeps
+# a WINDOW row kv; global layers keep SEQ_LENGTH rows
+WINDOW = min(config.sliding_window, SEQ_LENGTH)
 
-print(f'Layers: {NUM_LAYERS}\nHidden size: {HIDDEN_SIZE}\n')
+
+def is_local(layer_id):
+    return layer_id % 2 == 0 and WINDOW < SEQ_LENGTH
+
+
+print(f'Layers: {NUM_LAYERS}\nHidden size: {HIDDEN_SIZE}\n'
+      f'Seq length: {SEQ_LENGTH}\nLocal window: {WINDOW}\n')
 
 tokenizer = AutoTokenizer.from_pretrained(model_path, trust_remote_code=True)
 
@@ -116,13 +127,21 @@ class GemmaBlock(torch.nn.Module):
     def forward(self, hidden_states, position_ids, attention_mask):
         cos_pos = self.cos_emb[position_ids]
         sin_pos = self.sin_emb[position_ids]
+        if is_local(self.layer_id):
+            # keys WINDOW or more rows back are out of the window
+            seq_len = hidden_states.shape[1]
+            rows = torch.arange(seq_len, device=hidden_states.device).view(seq_len, 1)
+            cols = torch.arange(seq_len, device=hidden_states.device).view(1, seq_len)
+            band = torch.where(rows - cols >= WINDOW, -10000., 0.)
+            attention_mask = attention_mask + band.to(attention_mask.dtype)
         outputs = self.layer(
             hidden_states,
             attention_mask=attention_mask,
             position_ids=position_ids,
             output_attentions=False,
             use_cache=True,
-            rotary_pos_emb_list=(cos_pos, sin_pos)
+            rotary_pos_emb_list=(cos_pos, sin_pos),
+            history_rotary_pos_emb=(cos_pos, sin_pos)
         )
         hidden_states = outputs[0]
         present_k, present_v = outputs[1]
@@ -143,7 +162,9 @@ class GemmaBlockCache(torch.nn.Module):
             SEQ_LENGTH, HEAD_DIM).bfloat16().to("cuda")
 
     def forward(self, hidden_states, position_ids, attention_mask, past_k,
-                past_v):
+                past_v, history_pos):
+        # the kv cache holds keys before RoPE, row i is rotated by
+        # history_pos[i], which the runtime renumbers when it overwrites rows
         cos_pos = self.cos_emb[position_ids]
         sin_pos = self.sin_emb[position_ids]
         hidden_states, past_kv = self.layer(
@@ -153,7 +174,9 @@ class GemmaBlockCache(torch.nn.Module):
             output_attentions=False,
             use_cache=True,
             layer_past=(past_k, past_v),
-            rotary_pos_emb_list=(cos_pos, sin_pos)
+            rotary_pos_emb_list=(cos_pos, sin_pos),
+            history_rotary_pos_emb=(self.cos_emb[history_pos],
+                                    self.sin_emb[history_pos])
         )
         present_k, present_v = past_kv
         return hidden_states.float(), present_k.float(), present_v.float()
@@ -192,22 +215,25 @@ def convert_block(layer_id):
 
 def convert_block_cache(layer_id):
     model = GemmaBlockCache(layer_id)
+    rows = WINDOW if is_local(layer_id) else SEQ_LENGTH
     hidden_states = torch.randn((1, 1, HIDDEN_SIZE)).bfloat16().to("cuda")
     position_ids = torch.tensor([range(1)], dtype=torch.long).to("cuda")
     attention_mask = torch.ones(
-        (1, 1, 1, SEQ_LENGTH + 1)).bfloat16().to("cuda")
+        (1, 1, 1, rows + 1)).bfloat16().to("cuda")
     past_k = torch.randn(
-        (1, SEQ_LENGTH, KV_HEAD, HEAD_DIM)).bfloat16().to("cuda")
+        (1, rows, KV_HEAD, HEAD_DIM)).bfloat16().to("cuda")
     past_v = torch.randn(
-        (1, SEQ_LENGTH, KV_HEAD, HEAD_DIM)).bfloat16().to("cuda")
+        (1, rows, KV_HEAD, HEAD_DIM)).bfloat16().to("cuda")
+    history_pos = torch.tensor([range(rows)], dtype=torch.long).to("cuda")
 
     torch.onnx.export(
-        model, (hidden_states, position_ids, attention_mask, past_k, past_v),
+        model, (hidden_states, position_ids, attention_mask, past_k, past_v,
+                history_pos),
         f'{folder}/block_cache_{layer_id}.onnx',
         verbose=False,
         input_names=[
             'input_states', 'position_ids', 'attention_mask', 'history_k',
-            'history_v'
+            'history_v', 'history_pos'
         ],
         output_names=['hidden_states', 'past_k', 'past_v'],
         do_constant_folding=True,
@@ -283,6 +309,7 @@ def test_net_with_mask():
     out_ids = [int(token)]
     word = tokenizer.decode([int(token)])
     print(word, end="")
+    history_pos = torch.tensor([range(SEQ_LENGTH)]).to("cuda")
     while int(token) != tokenizer.eos_token_id and token_len < SEQ_LENGTH:
         token_len += 1
         input_ids = torch.tensor([token]).to("cuda")
@@ -294,7 +321,8 @@ def test_net_with_mask():
         for i in range(NUM_LAYERS):
             out, k, v = block_kvs[i](out.bfloat16(), position_ids,
                                      attention_mask.bfloat16(),
-                                     k_cache[i].bfloat16(), v_cache[i].bfloat16())
+                                     k_cache[i].bfloat16(), v_cache[i].bfloat16(),
+                                     history_pos)
             k_cache[i][:,token_len-1:token_len,:,:] = k[:,:,:,:]
             v_cache[i][:,token_len-1:token_len,:,:] = v[:,:,:,:]
         token = lm(out.bfloat16()).view(1)
@@ -284,6 +284,7 @@ class Gemma2Attention(nn.Module):
             cos, sin = kwargs['rotary_pos_emb_list']
         else:
             cos, sin = self.rotary_emb(value_states, position_ids, seq_len=None)
+        key_before_rope = key_states
         query_states, key_states = apply_rotary_pos_emb(query_states, key_states, cos, sin, unsqueeze_dim=2)
 
         if past_key_value is not None:
@@ -298,8 +299,18 @@ class Gemma2Attention(nn.Module):
         else:
             past_key_value = (key_states, value_states)
 
+        # with history_rotary_pos_emb the cache keeps keys before RoPE and each
+        # history row is rotated by the position it has now, so the runtime
+        # can overwrite rows in place and renumber the others
+        if 'history_rotary_pos_emb' in kwargs:
+            past_key_value = (key_before_rope, value_states)
+
         if 'layer_past' in kwargs:
             key_past, value_past = kwargs['layer_past']
+            if 'history_rotary_pos_emb' in kwargs:
+                cos_past, sin_past = kwargs['history_rotary_pos_emb']
+                cos_past, sin_past = cos_past.unsqueeze(2), sin_past.unsqueeze(2)
+                key_past = (key_past * cos_past) + (rotate_half(key_past) * sin_past)
             key_states = torch.cat([key_past, key_states], dim = 1)
             value_states = torch.cat([value_past, value_states], dim = 1)
 
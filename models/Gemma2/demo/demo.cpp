@@ -16,6 +16,7 @@
 #include "memory.h"
 #include "sentencepiece/sentencepiece_processor.h"
 #include "bmruntime_interface.h"
+#include "attention_mask.h"
 #include <getopt.h>
 #include <stdio.h>
 #include <inttypes.h>
@@ -24,18 +25,20 @@ static const uint16_t ATTENTION_MASK = 0xC61C; // -9984 by bfloat16
 
 class Gemma {
 public:
-  void init(int devid, std::string model_path, std::string tokenizer_path);
+  void init(int devid, std::string model_path, std::string tokenizer_path,
+            int sink);
   void chat();
   void deinit();
 
 private:
   void answer(const std::string &input_str);
-  int forward_first();
+  int forward_first(const std::vector<int> &tokens);
   int forward_next(int cur_token);
+  void reset();
   void load_sentencepiece(std::string tokenizer_path);
   void net_launch(const bm_net_info_t *net, int stage_idx = 0);
   inline void d2d(bm_device_mem_t &dst, bm_device_mem_t &src);
-  void clear_half_history();
+  void copy_window(bm_device_mem_t &dst, bm_device_mem_t &src);
 
 private:
   bm_handle_t bm_handle = 0;
@@ -48,8 +51,20 @@ private:
   std::vector<const bm_net_info_t *> net_blocks_cache;
   std::vector<bm_device_mem_t> past_key;
   std::vector<bm_device_mem_t> past_value;
-  std::vector<int> history_tokens;
-  size_t clear_idx = 0; // if history is full, remove half history
+  // The KV is a ring: once SEQLEN rows are used, each new token overwrites
+  // the oldest row after the first SINK ones, the attention sinks. Keys are
+  // cached before RoPE and block_cache rotates row i by history_pos[i], the
+  // rank of the row in the cache, so positions stay below SEQLEN forever.
+  int SINK;
+  int token_length = 0;          // rows of the KV in use
+  uint64_t evicted = 0;          // rows overwritten since the ring wrapped
+  std::vector<int> history_pos;  // position of every KV row
+  std::vector<int> pending;      // last reply token, not in the KV yet
+  // Local layers attend to the last WINDOW tokens only, their KV is a ring of
+  // WINDOW rows with token t in row t % WINDOW; 0 if every layer is global
+  int WINDOW = 0;
+  std::vector<bool> local;       // of every layer
+  std::vector<int> local_pos;    // position of every local KV row
   int BOS;
   int EOS;
   size_t SEQLEN;
@@ -57,18 +72,6 @@ private:
   bool io_alone;
 };
 
-void Gemma::clear_half_history() {
-  if (history_tokens.size() < SEQLEN / 2) {
-    return;
-  }
-  if (clear_idx == 0) {
-    history_tokens.clear();
-  }
-  history_tokens.erase(history_tokens.begin(),
-                       history_tokens.begin() + clear_idx);
-  clear_idx = history_tokens.size();
-}
-
 void Gemma::net_launch(const bm_net_info_t *net, int stage_idx) {
   std::vector<bm_tensor_t> in_tensors(net->input_num);
   std::vector<bm_tensor_t> out_tensors(net->output_num);
@@ -103,7 +106,7 @@ void Gemma::load_sentencepiece(std::string tokenizer_path) {
 }
 
 void Gemma::init(int device, std::string model_path,
-                 std::string tokenizer_path) {
+                 std::string tokenizer_path, int sink) {
   load_sentencepiece(tokenizer_path);
 
   // request bm_handle
@@ -140,7 +143,29 @@ void Gemma::init(int device, std::string model_path,
 
   // set SEQLEN
   SEQLEN = net_embed->stages[0].input_shapes[0].dims[1];
-  history_tokens.reserve(SEQLEN + 128);
+  if (net_blocks_cache[0]->input_num != 6) {
+    printf("Error: block_cache has no history_pos input, please export the "
+           "onnx again\n");
+    exit(-1);
+  }
+  SINK = std::max(0, std::min(sink, (int)SEQLEN - 2));
+  history_pos.resize(SEQLEN);
+  reset();
+  local.resize(NUM_LAYERS);
+  for (int i = 0; i < NUM_LAYERS; i++) {
+    int rows = net_blocks_cache[i]->stages[0].input_shapes[3].dims[1];
+    local[i] = rows < (int)SEQLEN;
+    if (local[i]) {
+      assert(WINDOW == 0 || WINDOW == rows);
+      WINDOW = rows;
+    }
+  }
+  local_pos.resize(WINDOW);
+  if (WINDOW) {
+    printf("Local layers: %d of %d, KV of %d instead of %d tokens\n",
+           (int)std::count(local.begin(), local.end(), true), NUM_LAYERS,
+           WINDOW, (int)SEQLEN);
+  }
 
   // resize
   past_key.resize(NUM_LAYERS);
@@ -171,22 +196,41 @@ void Gemma::d2d(bm_device_mem_t &dst, bm_device_mem_t &src) {
   bm_memcpy_d2d_byte(bm_handle, dst, 0, src, 0, bm_mem_get_device_size(src));
 }
 
-int Gemma::forward_first() {
+// the last WINDOW of the prefilled rows of src into the ring dst
+void Gemma::copy_window(bm_device_mem_t &dst, bm_device_mem_t &src) {
+  int bytes = bm_mem_get_device_size(dst) / WINDOW;
+  for (int t = std::max(0, token_length - WINDOW); t < token_length;) {
+    int row = t % WINDOW;
+    int rows = std::min(token_length - t, WINDOW - row);
+    bm_memcpy_d2d_byte(bm_handle, dst, row * bytes, src, t * bytes,
+                       rows * bytes);
+    t += rows;
+  }
+}
+
+void Gemma::reset() {
+  token_length = 0;
+  evicted = 0;
+  pending.clear();
+  for (size_t i = 0; i < SEQLEN; i++) {
+    history_pos[i] = i;
+  }
+}
+
+// prefill the empty KV with up to SEQLEN tokens
+int Gemma::forward_first(const std::vector<int> &tokens) {
   std::vector<int> input_ids(SEQLEN, 0);
   std::vector<int> position_id(SEQLEN, 0);
-  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN, ATTENTION_MASK);
-  std::copy(history_tokens.begin(), history_tokens.end(), input_ids.data());
+  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN);
+  std::copy(tokens.begin(), tokens.end(), input_ids.data());
 
-  for (size_t i = 0; i < history_tokens.size(); i++) {
+  reset();
+  token_length = tokens.size();
+  for (int i = 0; i < token_length; i++) {
     position_id[i] = i;
   }
-  for (size_t i = 0; i < history_tokens.size(); i++) {
-    for (size_t j = 0; j < SEQLEN; j++) {
-      if (j <= i) {
-        attention_mask[i * SEQLEN + j] = 0;
-      }
-    }
-  }
+  build_prefill_mask(attention_mask.data(),
+                     token_length, SEQLEN, ATTENTION_MASK);
 
   // forward embeding
   auto &in_mem = net_embed->stages[0].input_mems[0];
@@ -207,61 +251,98 @@ int Gemma::forward_first() {
     }
     net_launch(net_blocks[idx]);
     out_mem = net_blocks[idx]->stages[0].output_mems[0];
-    d2d(past_key[idx], net_blocks[idx]->stages[0].output_mems[1]);
-    d2d(past_value[idx], net_blocks[idx]->stages[0].output_mems[2]);
+    if (local[idx]) {
+      copy_window(past_key[idx], net_blocks[idx]->stages[0].output_mems[1]);
+      copy_window(past_value[idx], net_blocks[idx]->stages[0].output_mems[2]);
+    } else {
+      d2d(past_key[idx], net_blocks[idx]->stages[0].output_mems[1]);
+      d2d(past_value[idx], net_blocks[idx]->stages[0].output_mems[2]);
+    }
   }
 
   int bytes = out_mem.size / SEQLEN;
   auto &lm_in_mem = net_lm->stages[0].input_mems[0];
   auto &lm_out_mem = net_lm->stages[0].output_mems[0];
   bm_memcpy_d2d_byte(bm_handle, lm_in_mem, 0, out_mem,
-                     (history_tokens.size() - 1) * bytes, bytes);
+                     (token_length - 1) * bytes, bytes);
   net_launch(net_lm);
   int token = 0;
   bm_memcpy_d2s(bm_handle, (void *)&token, lm_out_mem);
   return token;
 }
 
+// append one token to the KV, once it is full the token overwrites the
+// oldest row after the sinks and gets the last position
 int Gemma::forward_next(int cur_token) {
   std::vector<uint16_t> attention_mask(SEQLEN + 1, 0);
-  for (size_t i = history_tokens.size() - 1; i < SEQLEN; i++) {
-    attention_mask[i] = ATTENTION_MASK;
+  uint64_t count = token_length + evicted; // tokens before this one
+  int row, position_id;
+  if (token_length < (int)SEQLEN) {
+    row = position_id = token_length++;
+    for (size_t i = row; i < SEQLEN; i++) {
+      attention_mask[i] = ATTENTION_MASK;
+    }
+  } else {
+    // the window rows after the overwritten one move one position down
+    int window = SEQLEN - SINK;
+    row = SINK + evicted++ % window;
+    position_id = SEQLEN - 1;
+    attention_mask[row] = ATTENTION_MASK;
+    for (int i = SINK; i < (int)SEQLEN; i++) {
+      history_pos[i] = SINK + (i - row - 1 + window) % window;
+    }
+  }
+  // a local row holds the token age steps back, the oldest one is
+  // overwritten by this token and out of the window
+  std::vector<uint16_t> local_mask(WINDOW + 1, 0);
+  int local_row = WINDOW ? count % WINDOW : 0;
+  for (int r = 0; r < WINDOW; r++) {
+    int age = (count + WINDOW - 1 - r) % WINDOW + 1;
+    if (age == WINDOW || (uint64_t)age > count) {
+      local_mask[r] = ATTENTION_MASK;
+    }
+    local_pos[r] = std::max(0, position_id - age);
   }
-  size_t position_id = history_tokens.size() - 1;
   // embedding
   auto &lm_in_mem = net_lm->stages[0].input_mems[0];
   auto &lm_out_mem = net_lm->stages[0].output_mems[0];
   auto &in_mem = net_embed_cache->stages[0].input_mems[0];
   auto &out_mem = net_embed_cache->stages[0].output_mems[0];
-  d2d(in_mem, lm_out_mem);
+  bm_memcpy_s2d(bm_handle, in_mem, (void *)&cur_token);
   net_launch(net_embed_cache);
   // blocks
   int bytes =
       bm_mem_get_device_size(net_blocks_cache[0]->stages[0].output_mems[1]);
-  int token_offset = (history_tokens.size() - 1) * bytes;
   for (int idx = 0; idx < NUM_LAYERS; idx++) {
+    // inputs are uploaded to the first layer of each kind, io_alone layers
+    // copy them from there, shared io mems are uploaded when the kind changes
+    auto &mask = local[idx] ? local_mask : attention_mask;
+    auto &pos = local[idx] ? local_pos : history_pos;
+    int first = std::find(local.begin(), local.end(), local[idx]) -
+                local.begin();
+    bool upload = io_alone ? idx == first
+                           : idx == 0 || local[idx] != local[idx - 1];
+    int token_offset = (local[idx] ? local_row : row) * bytes;
     auto &in0_mem = net_blocks_cache[idx]->stages[0].input_mems[0];
     auto &in1_mem = net_blocks_cache[idx]->stages[0].input_mems[1];
     auto &in2_mem = net_blocks_cache[idx]->stages[0].input_mems[2];
     auto &in3_mem = net_blocks_cache[idx]->stages[0].input_mems[3];
     auto &in4_mem = net_blocks_cache[idx]->stages[0].input_mems[4];
+    auto &in5_mem = net_blocks_cache[idx]->stages[0].input_mems[5];
     auto &out0_mem = net_blocks_cache[idx]->stages[0].output_mems[0];
     auto &out1_mem = net_blocks_cache[idx]->stages[0].output_mems[1];
     auto &out2_mem = net_blocks_cache[idx]->stages[0].output_mems[2];
     d2d(in0_mem, out_mem);
-    if (io_alone) {
-      if (idx == 0) {
-        bm_memcpy_s2d(bm_handle, in1_mem, (void *)&position_id);
-        bm_memcpy_s2d(bm_handle, in2_mem, (void *)attention_mask.data());
-      } else {
-        d2d(in1_mem, net_blocks_cache[0]->stages[0].input_mems[1]);
-        d2d(in2_mem, net_blocks_cache[0]->stages[0].input_mems[2]);
-      }
-    } else {
-      if (idx == 0) {
-        bm_memcpy_s2d(bm_handle, in1_mem, (void *)&position_id);
-        bm_memcpy_s2d(bm_handle, in2_mem, (void *)attention_mask.data());
-      }
+    if (upload) {
+      bm_memcpy_s2d(bm_handle, in1_mem, (void *)&position_id);
+      bm_memcpy_s2d(bm_handle, in2_mem, (void *)mask.data());
+      bm_memcpy_s2d(bm_handle, in5_mem, (void *)pos.data());
+    } else if (io_alone) {
+      d2d(in1_mem, net_blocks_cache[first]->stages[0].input_mems[1]);
+      d2d(in2_mem, net_blocks_cache[first]->stages[0].input_mems[2]);
+      d2d(in5_mem, net_blocks_cache[first]->stages[0].input_mems[5]);
+    }
+    if (!io_alone) {
       d2d(in3_mem, past_key[idx]);
       d2d(in4_mem, past_value[idx]);
     }
@@ -291,7 +372,7 @@ void Gemma::chat() {
       break;
     }
     if (input_str == "clear") {
-      history_tokens.clear();
+      reset();
       continue;
     }
     std::cout << "\nAnswer: " << std::flush;
@@ -309,22 +390,27 @@ void Gemma::answer(const std::string &input_str) {
     printf("Sorry: your question is too wierd!!\n");
     return;
   }
-  if (history_tokens.size() + tokens.size() > SEQLEN - 128) {
-    clear_half_history();
-  }
-  if (history_tokens.size() + tokens.size() > SEQLEN - 128) {
-    printf("Sorry: history is full!!\n");
-    clear_half_history();
-    return;
-  }
-  history_tokens.push_back(BOS);
-  history_tokens.insert(history_tokens.end(), tokens.begin(), tokens.end());
+  // the question follows the last token of the previous reply; a new
+  // conversation is prefilled as far as it fits, anything else goes into the
+  // KV ring token by token, so a long chat never stalls to rebuild it
+  std::vector<int> input = pending;
+  input.push_back(BOS);
+  input.insert(input.end(), tokens.begin(), tokens.end());
+  pending.clear();
   int pre_token = 0;
   auto t0 = std::chrono::system_clock::now();
-  int token = forward_first();
+  size_t first = 0;
+  int token = 0;
+  if (token_length == 0) {
+    first = std::min(input.size(), SEQLEN);
+    token = forward_first(
+        std::vector<int>(input.begin(), input.begin() + first));
+  }
+  for (size_t i = first; i < input.size(); i++) {
+    token = forward_next(input[i]);
+  }
   auto t1 = std::chrono::system_clock::now();
-  std::vector<int> response;
-  while (token != EOS && history_tokens.size() < SEQLEN) {
+  while (token != EOS && tok_num < (int)SEQLEN) {
     std::string pre_word;
     std::string word;
     std::vector<int> pre_ids = {pre_token};
@@ -332,7 +418,6 @@ void Gemma::answer(const std::string &input_str) {
     sentencepiece.Decode(pre_ids, &pre_word);
     sentencepiece.Decode(ids, &word);
     std::string diff = word.substr(pre_word.size());
-    history_tokens.emplace_back(token);
     std::cout << diff << std::flush;
     tok_num++;
     token = forward_next(token);
@@ -342,20 +427,7 @@ void Gemma::answer(const std::string &input_str) {
   auto use1 = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
   printf("\n\nfirst token latency: %f s", (use0.count() * 1e-6));
   printf("\nspeed: %f token/s\n", tok_num / (use1.count() * 1e-6));
-  if (history_tokens.size() >= SEQLEN) {
-    history_tokens.clear();
-    printf("Sorry: history is full!!\n");
-    clear_idx = 0;
-    return;
-  }
-  history_tokens.push_back(EOS);
-  if (history_tokens.size() > SEQLEN - 128) {
-    clear_half_history();
-  } else {
-    if (clear_idx < SEQLEN / 2) {
-      clear_idx = history_tokens.size();
-    }
-  }
+  pending.push_back(token);
 }
 
 void Usage() {
@@ -363,21 +435,23 @@ void Usage() {
          "  --help         : Show help info.\n"
          "  --model        : Set model path \n"
          "  --tokenizer    : Set tokenizer path \n"
-         "  --devid        : Set device to run for model, if not set, use 0\n");
+         "  --devid        : Set device to run for model, if not set, use 0\n"
+         "  --sink         : Set rows kept when the KV wraps, if not set, use 4\n");
 }
 
 void processArguments(int argc, char *argv[], std::string &model_path,
-                      std::string &tokenizer_path, int &device) {
+                      std::string &tokenizer_path, int &device, int &sink) {
   struct option longOptions[] = {{"model", required_argument, nullptr, 'm'},
                                  {"tokenizer", required_argument, nullptr, 't'},
                                  {"devid", required_argument, nullptr, 'd'},
+                                 {"sink", required_argument, nullptr, 's'},
                                  {"help", no_argument, nullptr, 'h'},
                                  {nullptr, 0, nullptr, 0}};
 
   int optionIndex = 0;
   int option;
 
-  while ((option = getopt_long(argc, argv, "m:t:d:h:", longOptions,
+  while ((option = getopt_long(argc, argv, "m:t:d:s:h:", longOptions,
                                &optionIndex)) != -1) {
     switch (option) {
     case 'm':
@@ -389,6 +463,9 @@ void processArguments(int argc, char *argv[], std::string &model_path,
     case 'd':
       device = std::atoi(optarg);
       break;
+    case 's':
+      sink = std::atoi(optarg);
+      break;
     case 'h':
       Usage();
       exit(EXIT_FAILURE);
@@ -407,7 +484,8 @@ int main(int argc, char **argv) {
   std::string model_path;
   std::string tokenizer_path;
   int device = 0;
-  processArguments(argc, argv, model_path, tokenizer_path, device);
+  int sink = 4;
+  processArguments(argc, argv, model_path, tokenizer_path, device, sink);
   if (model_path.empty()) {
     Usage();
     exit(EXIT_FAILURE);
@@ -415,7 +493,7 @@ int main(int argc, char **argv) {
 
   Gemma gm;
   printf("Init Environment ...\n");
-  gm.init(device, model_path, tokenizer_path);
+  gm.init(device, model_path, tokenizer_path, sink);
   printf("==========================\n");
   gm.chat();
   gm.deinit();
@@ -19,6 +19,7 @@ parser = argparse.ArgumentParser(description='export onnx.')
 parser.add_argument('--model_path', type=str, help='path to the torch model.')
 parser.add_argument('--seq_length', type=int,
                     default=512, help="sequence length")
+parser.add_argument('--verify_length', type=int, default=0, help="also export block_verify & lm_head_verify that score this many tokens in one pass, used by the demo's --prompt_lookup")
 
 args = parser.parse_args()
 
@@ -122,13 +123,14 @@ def convert_block(layer_id):
         opset_version=15)
 
 
-def convert_block_cache(layer_id):
+def convert_block_cache(layer_id, length=1, name='block_cache'):
+    # block_verify is block_cache with length new tokens
     model = BlockCache(layer_id)
     hidden_states = torch.randn(
-        (1, 1, HIDDEN_SIZE), dtype=torch.float16).to("cuda")
-    position_ids = torch.tensor([range(1)], dtype=torch.long).to("cuda")
+        (1, length, HIDDEN_SIZE), dtype=torch.float16).to("cuda")
+    position_ids = torch.tensor([range(length)], dtype=torch.long).to("cuda")
     attention_mask = -1000 * \
-        torch.ones((1, 1, 1, SEQ_LENGTH + 1),
+        torch.ones((1, 1, length, SEQ_LENGTH + length),
                    dtype=torch.float16).triu(diagonal=1).to("cuda")
     past_k = torch.randn((1, SEQ_LENGTH, NUM_ATTENTION_HEADS,
                          HEAD_DIM), dtype=torch.float16).to("cuda")
@@ -137,7 +139,7 @@ def convert_block_cache(layer_id):
 
     torch.onnx.export(
         model, (hidden_states, position_ids, attention_mask, past_k, past_v),
-        f'{folder}/block_cache_{layer_id}.onnx',
+        f'{folder}/{name}_{layer_id}.onnx',
         verbose=False,
         input_names=[
             'input_states', 'position_ids', 'attention_mask', 'history_k',
@@ -161,12 +163,12 @@ def convert_embedding():
                       opset_version=15)
 
 
-def convert_lm_head():
+def convert_lm_head(length=1, name='lm_head'):
     model = LmHead()
-    input = torch.randn((1, HIDDEN_SIZE), dtype=torch.float16).to("cuda")
+    input = torch.randn((length, HIDDEN_SIZE), dtype=torch.float16).to("cuda")
 
     torch.onnx.export(model, (input),
-                      f'{folder}/lm_head.onnx',
+                      f'{folder}/{name}.onnx',
                       verbose=False,
                       input_names=['hidden_states'],
                       output_names=['token'],
@@ -182,6 +184,8 @@ if not os.path.exists(folder):
 print(f'Convert block & block_cache')
 for i in tqdm(range(NUM_LAYERS)):
     convert_block_cache(i)
+    if args.verify_length:
+        convert_block_cache(i, args.verify_length, 'block_verify')
     convert_block(i)
 
 print(f'Convert embedding')
@@ -189,3 +193,5 @@ convert_embedding()
 
 print(f'Convert lm_head')
 convert_lm_head()
+if args.verify_length:
+    convert_lm_head(args.verify_length, 'lm_head_verify')
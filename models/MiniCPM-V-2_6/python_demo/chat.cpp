@@ -17,6 +17,7 @@
 #include <pybind11/stl.h>
 #include "memory.h"
 #include "bmruntime_interface.h"
+#include "attention_mask.h"
 #include <getopt.h>
 #include <stdio.h>
 #include <inttypes.h>
@@ -145,7 +146,7 @@ int MiniCPMV::forward_first(std::vector<int> &tokens,
                              std::vector<float> &pixel_values, int img_offset) {
   std::vector<int> input_ids(SEQLEN, 0);
   std::vector<int> position_id(SEQLEN, 0);
-  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN, ATTENTION_MASK);
+  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN);
   std::copy(tokens.begin(), tokens.end(), input_ids.data());
 
   token_length = tokens.size();
@@ -153,13 +154,8 @@ int MiniCPMV::forward_first(std::vector<int> &tokens,
   for (int i = 0; i < token_length; i++) {
     position_id[i] = i;
   }
-  for (int i = 0; i < token_length; i++) {
-    for (int j = 0; j < SEQLEN; j++) {
-      if (j <= i) {
-        attention_mask[i * SEQLEN + j] = 0;
-      }
-    }
-  }
+  build_prefill_mask(attention_mask.data(),
+                     token_length, SEQLEN, ATTENTION_MASK);
 
   // forward embeding
   auto &in_mem = net_embed->stages[0].input_mems[0];
@@ -17,6 +17,8 @@
 #include <pybind11/stl.h>
 #include "memory.h"
 #include "bmruntime_interface.h"
+#include "device_arena.h"
+#include "attention_mask.h"
 #include <getopt.h>
 #include <stdio.h>
 #include <inttypes.h>
@@ -61,6 +63,7 @@ private:
   const bm_net_info_t *net_lm;
   std::vector<bm_device_mem_t> past_key;
   std::vector<bm_device_mem_t> past_value;
+  DeviceArena arena; // KV of all layers when the nets don't own it
 };
 
 void Molmo::net_launch(const bm_net_info_t *net, int stage_idx) {
@@ -153,23 +156,19 @@ void Molmo::init(const std::vector<int> &devices, std::string model_path) {
       past_key[i] = net_blocks_cache[i]->stages[0].input_mems[3];
       past_value[i] = net_blocks_cache[i]->stages[0].input_mems[4];
     } else {
-      auto ret = bm_malloc_device_byte(bm_handle, &past_key[i],
-                                      net_blocks_cache[i]->max_input_bytes[3]);
-      assert(BM_SUCCESS == ret);
-      ret = bm_malloc_device_byte(bm_handle, &past_value[i],
-                                  net_blocks_cache[i]->max_input_bytes[4]);
-      assert(BM_SUCCESS == ret);
+      arena.add(&past_key[i], net_blocks_cache[i]->max_input_bytes[3], "kv");
+      arena.add(&past_value[i], net_blocks_cache[i]->max_input_bytes[4], "kv");
     }
   }
+  if (!io_alone) {
+    ret = arena.alloc(bm_handle);
+    assert(true == ret);
+    arena.report("Molmo");
+  }
 }
 
 void Molmo::deinit() {
-  if (false == io_alone) {
-    for (int i = 0; i < NUM_LAYERS; i++) {
-      bm_free_device(bm_handle, past_key[i]);
-      bm_free_device(bm_handle, past_value[i]);
-    }
-  }
+  arena.free();
   bmrt_destroy(p_bmrt);
   for (auto h : handles) {
     bm_dev_free(h);
@@ -180,20 +179,14 @@ int Molmo::forward_first(std::vector<int> &tokens,
                         std::vector<float> &images,
                         std::vector<float> &image_masks) {
   std::vector<int> position_id(SEQLEN, 0);
-  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN, mask_value);
+  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN);
   std::copy(tokens.begin(), tokens.end(), visited_tokens.data());
   token_length = tokens.size();
 
   for (int i = 0; i < token_length; i++) {
     position_id[i] = i; 
   }
-  for (int i = 0; i < token_length; i++) {
-    for (int j = 0; j < SEQLEN; j++) {
-      if (j <= i) {
-        attention_mask[i * SEQLEN + j] = 0;
-      }
-    }
-  }
+  build_prefill_mask(attention_mask.data(), token_length, SEQLEN, mask_value);
 
   // forward embeding
   auto &in_mem = net_embed->stages[0].input_mems[0];
@@ -7,6 +7,7 @@ mode_args=""
 quantize_args="--quantize W4BF16"
 name=""
 num_layers=
+verify_length=0
 out_model=$name.bmodel
 num_core=""
 
@@ -22,6 +23,10 @@ while [[ $# -gt 0 ]]; do
             name="$2"
             shift 2
             ;;
+        --verify_length)
+            verify_length="$2"
+            shift 2
+            ;;
         --num_core)
             num_core="$2"
             shift 2
@@ -93,9 +98,32 @@ model_deploy.py \
     --num_core $num_core \
     --model embedding_cache.bmodel
 
+# embedding_verify, block_verify_i & lm_head_verify score verify_length
+# tokens in one pass for the demo's --prompt_lookup, e.g. --verify_length 4,
+# needs onnx exported by export_onnx.py --verify_length 4
+if [ $verify_length -gt 0 ]; then
+    model_transform.py \
+        --model_name embedding_verify \
+        --model_def ../onnx/embedding.onnx \
+        --input_shapes "[[1,$verify_length]]" \
+        --mlir embedding_verify.mlir
+
+    model_deploy.py \
+        --mlir embedding_verify.mlir \
+        --quantize BF16 \
+        --quant_input \
+        --quant_output \
+        --chip bm1688 \
+        --num_core $num_core \
+        --model embedding_verify.bmodel
+fi
+
 rm *.npz *.onnx -f
 
 models=$models' '$outdir'/embedding.bmodel '$outdir'/embedding_cache.bmodel '
+if [ $verify_length -gt 0 ]; then
+    models=$models$outdir'/embedding_verify.bmodel '
+fi
 
 popd
 
@@ -119,9 +147,28 @@ model_deploy.py \
     --num_core $num_core \
     --model lm_head.bmodel
 
+if [ $verify_length -gt 0 ]; then
+    model_transform.py \
+        --model_name lm_head_verify \
+        --model_def ../../onnx/lm_head_verify.onnx \
+        --mlir lm_head_verify.mlir
+
+    model_deploy.py \
+        --mlir lm_head_verify.mlir \
+        $quantize_args \
+        --quant_input \
+        --quant_output \
+        --chip bm1688 \
+        --num_core $num_core \
+        --model lm_head_verify.bmodel
+fi
+
 rm *.npz *.onnx -f
 
 models=${models}${outdir}'/lm_head.bmodel '
+if [ $verify_length -gt 0 ]; then
+    models=${models}${outdir}'/lm_head_verify.bmodel '
+fi
 popd
 
 echo $models
@@ -163,9 +210,29 @@ for ((i=0; i<$num_layers; i++)); do
         --addr_mode io_alone \
         --model block_cache_$i.bmodel
 
+    if [ $verify_length -gt 0 ]; then
+        model_transform.py \
+            --model_name block_verify_$i \
+            --model_def ../../onnx/block_verify_$i.onnx \
+            --mlir block_verify_$i.mlir
+
+        model_deploy.py \
+            --mlir block_verify_$i.mlir \
+            $quantize_args \
+            --quant_input \
+            --quant_output \
+            --chip bm1688 \
+            --num_core $num_core \
+            --addr_mode io_alone \
+            --model block_verify_$i.bmodel
+    fi
+
     rm *.npz *.onnx -f
 
     models=${models}${outdir}'/block_'$i'.bmodel '$outdir'/block_cache_'$i'.bmodel '
+    if [ $verify_length -gt 0 ]; then
+        models=${models}${outdir}'/block_verify_'$i'.bmodel '
+    fi
 
 done
 popd
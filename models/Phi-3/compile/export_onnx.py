@@ -17,6 +17,7 @@ from transformers import AutoModelForCausalLM, AutoTokenizer
 parser = argparse.ArgumentParser(description='export onnx.')
 parser.add_argument('--model_path', type=str, help='path to the torch model.')
 parser.add_argument('--seq_length', type=int, default=512, help="sequence length")
+parser.add_argument('--verify_length', type=int, default=0, help="also export block_verify & lm_head_verify that score this many tokens in one pass, used by the demo's --prompt_lookup")
 
 args = parser.parse_args()
 
@@ -116,17 +117,18 @@ def convert_block(layer_id):
         opset_version=15)
 
 
-def convert_block_cache(layer_id):
+def convert_block_cache(layer_id, length=1, name='block_cache'):
+    # block_verify is block_cache with length new tokens
     model = BlockCache(layer_id)
-    hidden_states = torch.randn((1, 1, HIDDEN_SIZE)).bfloat16()
-    position_ids = torch.tensor([range(1)], dtype=torch.long)
-    attention_mask = torch.ones((1, 1, 1, SEQ_LENGTH + 1)).triu(diagonal=1).bfloat16()
+    hidden_states = torch.randn((1, length, HIDDEN_SIZE)).bfloat16()
+    position_ids = torch.tensor([range(length)], dtype=torch.long)
+    attention_mask = torch.ones((1, 1, length, SEQ_LENGTH + length)).triu(diagonal=1).bfloat16()
     past_k = torch.randn((1, SEQ_LENGTH, NUM_ATTENTION_HEADS, HEAD_DIM)).bfloat16()
     past_v = torch.randn((1, SEQ_LENGTH, NUM_ATTENTION_HEADS, HEAD_DIM)).bfloat16()
 
     torch.onnx.export(
         model, (hidden_states, position_ids, attention_mask, past_k, past_v),
-        f'{folder}/block_cache_{layer_id}.onnx',
+        f'{folder}/{name}_{layer_id}.onnx',
         verbose=False,
         input_names=[
             'input_states', 'position_ids', 'attention_mask', 'history_k',
@@ -150,12 +152,12 @@ def convert_embedding():
                       opset_version=15)
 
 
-def convert_lm_head():
+def convert_lm_head(length=1, name='lm_head'):
     model = LmHead()
-    input = torch.randn((1, HIDDEN_SIZE)).bfloat16()
+    input = torch.randn((length, HIDDEN_SIZE)).bfloat16()
     
     torch.onnx.export(model, (input),
-                      f'{folder}/lm_head.onnx',
+                      f'{folder}/{name}.onnx',
                       verbose=False,
                       input_names=['hidden_states'],
                       output_names=['token'],
@@ -234,9 +236,13 @@ print(f'Convert block & block_cache')
 for i in tqdm(range(NUM_LAYERS)):
     convert_block(i)
     convert_block_cache(i)
+    if args.verify_length:
+        convert_block_cache(i, args.verify_length, 'block_verify')
 
 print(f'Convert embedding')
 convert_embedding()
 
 print(f'Convert lm_head')
 convert_lm_head()
+if args.verify_length:
+    convert_lm_head(args.verify_length, 'lm_head_verify')
@@ -16,7 +16,10 @@
 #include "memory.h"
 #include "sentencepiece/sentencepiece_processor.h"
 #include "bmruntime_interface.h"
+#include "prompt_lookup.h"
+#include "attention_mask.h"
 #include <getopt.h>
+#include <inttypes.h>
 
 static const uint16_t ATTENTION_MASK = 0xC61C;
 
@@ -26,13 +29,18 @@ public:
   void chat();
   void deinit();
 
+  int prompt_lookup = 0; // longest n-gram of prompt lookup decoding, 0 off
+
 private:
   void answer(const std::string &input_str);
   int forward_first(std::vector<int> &tokens);
   int forward_next(int cur_token);
+  std::vector<int> forward_verify(std::vector<int> &tokens);
+  std::vector<int> forward_lookup(int cur_token);
   void load_sentencepiece(std::string tokenizer_path);
   void build_system_prompt();
   void net_launch(const bm_net_info_t *net, int stage_idx = 0);
+  void net_launch_verify(int idx);
   inline void d2d(bm_device_mem_t &dst, bm_device_mem_t &src);
 
 private:
@@ -44,6 +52,12 @@ private:
   const bm_net_info_t *net_lm;
   std::vector<const bm_net_info_t *> net_blocks;
   std::vector<const bm_net_info_t *> net_blocks_cache;
+  const bm_net_info_t *net_embed_verify = NULL;
+  const bm_net_info_t *net_lm_verify = NULL;
+  std::vector<const bm_net_info_t *> net_blocks_verify;
+  NgramIndex lookup;
+  uint64_t lookup_proposed = 0; // drafts of this answer
+  uint64_t lookup_accepted = 0;
   std::vector<bm_device_mem_t> past_key, past_value;
   std::string system_string = "";
   std::vector<int> history_tokens;
@@ -55,6 +69,7 @@ private:
   int EOS;
   int SEQLEN;
   int NUM_LAYERS;
+  int VERIFY_LENGTH = 0; // rows of block_verify_i, 0 if absent
   bool io_alone;
 };
 
@@ -79,6 +94,34 @@ void Phi3::net_launch(const bm_net_info_t *net, int stage_idx) {
   bm_thread_sync(bm_handle);
 }
 
+// block_verify_i reads the KV cache of block_cache_i in place
+void Phi3::net_launch_verify(int idx) {
+  auto net = net_blocks_verify[idx];
+  std::vector<bm_tensor_t> in_tensors(net->input_num);
+  std::vector<bm_tensor_t> out_tensors(net->output_num);
+
+  for (int i = 0; i < net->input_num; i++) {
+    auto mem = net->stages[0].input_mems[i];
+    if (i == 3) {
+      mem = past_key[idx];
+    } else if (i == 4) {
+      mem = past_value[idx];
+    }
+    bmrt_tensor_with_device(&in_tensors[i], mem, net->input_dtypes[i],
+                            net->stages[0].input_shapes[i]);
+  }
+  for (int i = 0; i < net->output_num; i++) {
+    bmrt_tensor_with_device(&out_tensors[i], net->stages[0].output_mems[i],
+                            net->output_dtypes[i],
+                            net->stages[0].output_shapes[i]);
+  }
+  auto ret = bmrt_launch_tensor_ex(p_bmrt, net->name, in_tensors.data(),
+                                   net->input_num, out_tensors.data(),
+                                   net->output_num, true, false);
+  assert(ret);
+  bm_thread_sync(bm_handle);
+}
+
 void Phi3::load_sentencepiece(std::string tokenizer_path) {
   printf("Load %s ... ", tokenizer_path.c_str());
   auto status = sentencepiece.Load(tokenizer_path);
@@ -111,9 +154,15 @@ void Phi3::init(std::string model_path, std::string tokenizer_path) {
   assert(true == ret);
   printf("\nDone!\n");
 
-  // set NUM_LAYERS
+  // set NUM_LAYERS, a bmodel compiled with --verify_length also has
+  // embedding_verify, lm_head_verify & block_verify_i
   auto num_nets = bmrt_get_network_number(p_bmrt);
-  NUM_LAYERS = (num_nets - 3) / 2;
+  net_lm_verify = bmrt_get_network_info(p_bmrt, "lm_head_verify");
+  if (net_lm_verify) {
+    NUM_LAYERS = (num_nets - 5) / 3;
+  } else {
+    NUM_LAYERS = (num_nets - 3) / 2;
+  }
 
   // net infos
   net_embed = bmrt_get_network_info(p_bmrt, "embedding");
@@ -125,6 +174,23 @@ void Phi3::init(std::string model_path, std::string tokenizer_path) {
     net_blocks.emplace_back(bmrt_get_network_info(p_bmrt, block_name.c_str()));
     net_blocks_cache.emplace_back(
         bmrt_get_network_info(p_bmrt, cache_name.c_str()));
+    if (net_lm_verify) {
+      auto verify_name = "block_verify_" + std::to_string(i);
+      net_blocks_verify.emplace_back(
+          bmrt_get_network_info(p_bmrt, verify_name.c_str()));
+    }
+  }
+  if (net_lm_verify) {
+    net_embed_verify = bmrt_get_network_info(p_bmrt, "embedding_verify");
+    VERIFY_LENGTH = net_embed_verify->stages[0].input_shapes[0].dims[1];
+  }
+  if (prompt_lookup > 0) {
+    if (VERIFY_LENGTH < 2) {
+      printf("Error: --prompt_lookup needs a bmodel compiled with "
+             "--verify_length\n");
+      exit(-1);
+    }
+    lookup = NgramIndex(1, prompt_lookup);
   }
 
   // set SEQLEN
@@ -157,7 +223,7 @@ void Phi3::d2d(bm_device_mem_t &dst, bm_device_mem_t &src) {
 int Phi3::forward_first(std::vector<int> &tokens) {
   std::vector<int> input_ids(SEQLEN, 0);
   std::vector<int> position_id(SEQLEN, 0);
-  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN, ATTENTION_MASK);
+  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN);
 
   std::copy(tokens.begin(), tokens.end(), input_ids.data());
 
@@ -165,13 +231,8 @@ int Phi3::forward_first(std::vector<int> &tokens) {
   for (int i = 0; i < token_length; i++) {
     position_id[i] = i;
   }
-  for (int i = 0; i < token_length; i++) {
-    for (int j = 0; j < SEQLEN; j++) {
-      if (j <= i) {
-        attention_mask[i * SEQLEN + j] = 0;
-      }
-    }
-  }
+  build_prefill_mask(attention_mask.data(),
+                     token_length, SEQLEN, ATTENTION_MASK);
 
   // forward embeding
   auto &in_mem = net_embed->stages[0].input_mems[0];
@@ -219,7 +280,8 @@ int Phi3::forward_next(int cur_token) {
   auto &lm_out_mem = net_lm->stages[0].output_mems[0];
   auto &in_mem = net_embed_cache->stages[0].input_mems[0];
   auto &out_mem = net_embed_cache->stages[0].output_mems[0];
-  d2d(in_mem, lm_out_mem);
+  // cur_token may come from lm_head_verify rather than lm_head
+  bm_memcpy_s2d(bm_handle, in_mem, (void *)&cur_token);
   net_launch(net_embed_cache);
 
   // forward blocks
@@ -262,6 +324,96 @@ int Phi3::forward_next(int cur_token) {
   return token;
 }
 
+// Run tokens (at most VERIFY_LENGTH) through block_verify_i at once, tokens[0]
+// at position token_length - 1 like forward_next, and return the token
+// predicted after each of them. The KV of all VERIFY_LENGTH rows is written,
+// rows after the accepted tokens stay masked until overwritten.
+std::vector<int> Phi3::forward_verify(std::vector<int> &tokens) {
+  int num = tokens.size();
+  int rows = VERIFY_LENGTH;
+  int start = token_length - 1;
+  assert(num > 0 && num <= rows && start + rows <= SEQLEN);
+  std::vector<int> input_ids(rows, 0);
+  std::vector<int> position_id(rows, 0);
+  std::vector<uint16_t> attention_mask(rows * (SEQLEN + rows), ATTENTION_MASK);
+  std::copy(tokens.begin(), tokens.end(), input_ids.data());
+  for (int i = 0; i < rows; i++) {
+    position_id[i] = start + i;
+    auto mask = attention_mask.data() + i * (SEQLEN + rows);
+    std::fill(mask, mask + start, 0);
+    std::fill(mask + SEQLEN, mask + SEQLEN + i + 1, 0);
+  }
+
+  // forward embedding
+  auto &in_mem = net_embed_verify->stages[0].input_mems[0];
+  bm_device_mem_t out_mem = net_embed_verify->stages[0].output_mems[0];
+  bm_memcpy_s2d(bm_handle, in_mem, (void *)input_ids.data());
+  net_launch(net_embed_verify);
+
+  // forward blocks
+  int bytes =
+      bm_mem_get_device_size(net_blocks_cache[0]->stages[0].output_mems[1]);
+  int token_offset = start * bytes;
+  for (int idx = 0; idx < NUM_LAYERS; idx++) {
+    auto &in0_mem = net_blocks_verify[idx]->stages[0].input_mems[0];
+    auto &in1_mem = net_blocks_verify[idx]->stages[0].input_mems[1];
+    auto &in2_mem = net_blocks_verify[idx]->stages[0].input_mems[2];
+    auto &out1_mem = net_blocks_verify[idx]->stages[0].output_mems[1];
+    auto &out2_mem = net_blocks_verify[idx]->stages[0].output_mems[2];
+    d2d(in0_mem, out_mem);
+    if (idx == 0) {
+      bm_memcpy_s2d(bm_handle, in1_mem, (void *)position_id.data());
+      bm_memcpy_s2d(bm_handle, in2_mem, (void *)attention_mask.data());
+    } else {
+      d2d(in1_mem, net_blocks_verify[0]->stages[0].input_mems[1]);
+      d2d(in2_mem, net_blocks_verify[0]->stages[0].input_mems[2]);
+    }
+    net_launch_verify(idx);
+    out_mem = net_blocks_verify[idx]->stages[0].output_mems[0];
+    bm_memcpy_d2d_byte(bm_handle, past_key[idx], token_offset, out1_mem, 0,
+                       rows * bytes);
+    bm_memcpy_d2d_byte(bm_handle, past_value[idx], token_offset, out2_mem, 0,
+                       rows * bytes);
+  }
+
+  // forward lmhead
+  d2d(net_lm_verify->stages[0].input_mems[0], out_mem);
+  net_launch(net_lm_verify);
+
+  std::vector<int> next(rows);
+  bm_memcpy_d2s(bm_handle, (void *)next.data(),
+                net_lm_verify->stages[0].output_mems[0]);
+  next.resize(num);
+  return next;
+}
+
+// Tokens after cur_token for --prompt_lookup: the tokens that followed the
+// latest n-gram earlier in the conversation are drafts, block_verify_i checks
+// them in one pass. Returns the accepted drafts and the token after them, or
+// the token of forward_next if nothing matched.
+std::vector<int> Phi3::forward_lookup(int cur_token) {
+  std::vector<int> drafts;
+  if (token_length - 1 + VERIFY_LENGTH <= SEQLEN) {
+    drafts = lookup.propose(VERIFY_LENGTH - 1);
+  }
+  if (drafts.empty()) {
+    return {forward_next(cur_token)};
+  }
+  std::vector<int> input = {cur_token};
+  input.insert(input.end(), drafts.begin(), drafts.end());
+  auto next = forward_verify(input);
+  int accepted = 0;
+  while (accepted < (int)drafts.size() && drafts[accepted] == next[accepted] &&
+         drafts[accepted] != EOS) {
+    accepted++;
+  }
+  lookup_proposed += drafts.size();
+  lookup_accepted += accepted;
+  std::vector<int> out(drafts.begin(), drafts.begin() + accepted);
+  out.push_back(next[accepted]);
+  return out;
+}
+
 void Phi3::build_system_prompt() {
   history_tokens.clear();
   history_tokens.insert(history_tokens.end(), head_prompt.begin(),
@@ -319,6 +471,12 @@ void Phi3::answer(const std::string &input_str) {
   int pre_token = 0;
   auto t0 = std::chrono::system_clock::now();
   int token = forward_first(history_tokens);
+  std::vector<int> pending; // accepted drafts of --prompt_lookup
+  lookup_proposed = lookup_accepted = 0;
+  if (prompt_lookup) {
+    lookup.clear();
+    lookup.append(history_tokens);
+  }
   auto t1 = std::chrono::system_clock::now();
   while (token != EOS && token_length < SEQLEN) {
     std::string pre_word;
@@ -334,13 +492,27 @@ void Phi3::answer(const std::string &input_str) {
       token_length++;
     }
     tok_num++;
-    token = forward_next(token);
+    if (prompt_lookup) {
+      lookup.append(token);
+      if (pending.empty()) {
+        pending = forward_lookup(token);
+      }
+      token = pending.front();
+      pending.erase(pending.begin());
+    } else {
+      token = forward_next(token);
+    }
   }
   auto t2 = std::chrono::system_clock::now();
   auto use0 = std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0);
   auto use1 = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
   printf("\n\nfirst token latency: %f s", (use0.count() * 1e-6));
   printf("\nspeed: %f token/s\n", tok_num / (use1.count() * 1e-6));
+  if (prompt_lookup) {
+    printf("prompt lookup: %" PRIu64 " of %" PRIu64 " drafts accepted (%.2f)\n",
+           lookup_accepted, lookup_proposed,
+           lookup_proposed ? (double)lookup_accepted / lookup_proposed : 0.0);
+  }
   if (token_length >= SEQLEN) {
     history_tokens.clear();
     round = 0;
@@ -353,20 +525,24 @@ void Usage() {
   printf("Usage:\n"
          "  --help         : Show help info.\n"
          "  --model        : Set model path \n"
-         "  --tokenizer    : Set tokenizer path \n");
+         "  --tokenizer    : Set tokenizer path \n"
+         "  --prompt_lookup: Longest n-gram of prompt lookup decoding, needs "
+         "a bmodel compiled with --verify_length \n");
 }
 
 void processArguments(int argc, char *argv[], std::string &model_path,
-                      std::string &tokenizer_path) {
+                      std::string &tokenizer_path, int &prompt_lookup) {
   struct option longOptions[] = {{"model", required_argument, nullptr, 'm'},
                                  {"tokenizer", required_argument, nullptr, 't'},
+                                 {"prompt_lookup", required_argument, nullptr,
+                                  'l'},
                                  {"help", no_argument, nullptr, 'h'},
                                  {nullptr, 0, nullptr, 0}};
 
   int optionIndex = 0;
   int option;
 
-  while ((option = getopt_long(argc, argv, "m:t:h:", longOptions,
+  while ((option = getopt_long(argc, argv, "m:t:l:h:", longOptions,
                                &optionIndex)) != -1) {
     switch (option) {
     case 'm':
@@ -375,6 +551,9 @@ void processArguments(int argc, char *argv[], std::string &model_path,
     case 't':
       tokenizer_path = optarg;
       break;
+    case 'l':
+      prompt_lookup = atoi(optarg);
+      break;
     case 'h':
       Usage();
       exit(EXIT_FAILURE);
@@ -391,8 +570,9 @@ int main(int argc, char **argv) {
   // set your bmodel path here
   printf("Demo for Phi3 in BM1688\n");
   std::string model_path;
+  int prompt_lookup = 0;
   std::string tokenizer_path;
-  processArguments(argc, argv, model_path, tokenizer_path);
+  processArguments(argc, argv, model_path, tokenizer_path, prompt_lookup);
   if (model_path.empty()) {
     Usage();
     exit(EXIT_FAILURE);
@@ -400,6 +580,7 @@ int main(int argc, char **argv) {
 
   Phi3 Phi3;
   printf("Init Environment ...\n");
+  Phi3.prompt_lookup = prompt_lookup;
   Phi3.init(model_path, tokenizer_path);
   printf("==========================\n");
   Phi3.chat();
@@ -17,6 +17,7 @@
 #include <pybind11/stl.h>
 #include "memory.h"
 #include "bmruntime_interface.h"
+#include "attention_mask.h"
 #include <getopt.h>
 #include <stdio.h>
 #include <inttypes.h>
@@ -275,7 +276,7 @@ int Qwen::sample(const std::vector<float>& probs, const std::vector<int>& tokens
 int Qwen::forward_first(std::vector<int> &tokens) {
   std::vector<int> input_ids(SEQLEN, 0);
   std::vector<int> position_id(SEQLEN, 0);
-  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN, ATTENTION_MASK);
+  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN);
   std::copy(tokens.begin(), tokens.end(), input_ids.data());
 
   token_length = tokens.size();
@@ -283,13 +284,8 @@ int Qwen::forward_first(std::vector<int> &tokens) {
   for (int i = 0; i < token_length; i++) {
     position_id[i] = i;
   }
-  for (int i = 0; i < token_length; i++) {
-    for (int j = 0; j < SEQLEN; j++) {
-      if (j <= i) {
-        attention_mask[i * SEQLEN + j] = 0;
-      }
-    }
-  }
+  build_prefill_mask(attention_mask.data(),
+                     token_length, SEQLEN, ATTENTION_MASK);
 
   // forward embeding
   std::vector<int> input_nums(device_num, 1);
@@ -436,7 +432,7 @@ int Qwen::forward_next(int cur_token) {
 int Qwen::forward_first_with_topk(std::vector<int> &tokens, std::string mode) {
   std::vector<int> input_ids(SEQLEN, 0);
   std::vector<int> position_id(SEQLEN, 0);
-  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN, ATTENTION_MASK);
+  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN);
   std::copy(tokens.begin(), tokens.end(), input_ids.data());
 
   token_length = tokens.size();
@@ -444,13 +440,8 @@ int Qwen::forward_first_with_topk(std::vector<int> &tokens, std::string mode) {
   for (int i = 0; i < token_length; i++) {
     position_id[i] = i;
   }
-  for (int i = 0; i < token_length; i++) {
-    for (int j = 0; j < SEQLEN; j++) {
-      if (j <= i) {
-        attention_mask[i * SEQLEN + j] = 0;
-      }
-    }
-  }
+  build_prefill_mask(attention_mask.data(),
+                     token_length, SEQLEN, ATTENTION_MASK);
 
   // forward embeding
   std::vector<int> input_nums(device_num, 1);
@@ -14,6 +14,14 @@ hidden_size=
 seq_length=
 out_model=$name.bmodel
 dynamic=0
+prefill_stages=""
+mask_in_graph=0
+chunk_length=0
+verify_length=0
+multi_lengths=""
+fuse_decode=0
+fuse_prefill=0
+page_size=0
 
 while [[ $# -gt 0 ]]; do
     key="$1"
@@ -35,6 +43,38 @@ while [[ $# -gt 0 ]]; do
             seq_length="$2"
             shift 2
             ;;
+        --prefill_stages)
+            prefill_stages="$2"
+            shift 2
+            ;;
+        --mask_in_graph)
+            mask_in_graph=1
+            shift 1
+            ;;
+        --chunk_length)
+            chunk_length="$2"
+            shift 2
+            ;;
+        --verify_length)
+            verify_length="$2"
+            shift 2
+            ;;
+        --multi_lengths)
+            multi_lengths="$2"
+            shift 2
+            ;;
+        --fuse_decode)
+            fuse_decode=1
+            shift 1
+            ;;
+        --fuse_prefill)
+            fuse_prefill="$2"
+            shift 2
+            ;;
+        --page_size)
+            page_size="$2"
+            shift 2
+            ;;
         *)
             echo "Invalid option: $key" >&2
             exit 1
@@ -55,8 +95,12 @@ if [ "$name" = "qwen2.5-1.5b" ]; then
   num_layers=28
   hidden_size=1536
   echo "Compile Qwen2.5-1.5B"
+elif [ "$name" = "qwen2.5-0.5b" ]; then
+  num_layers=24
+  hidden_size=896
+  echo "Compile Qwen2.5-0.5B"
 else
-  >&2 echo -e "Error: Invalid name $name, the input name must be \033[31mqwen2.5-1.5b\033[0m"
+  >&2 echo -e "Error: Invalid name $name, the input name must be \033[31mqwen2.5-1.5b|qwen2.5-0.5b\033[0m"
   exit 1
 fi
 
@@ -82,6 +126,52 @@ fi
 
 out_model=$name'_'$mode'_seq'$seq_length'_1688_2core.bmodel'
 
+# extra prefill stages, e.g. --prefill_stages 64,128,256
+# needs onnx exported by export_onnx.py --dynamic_prefill 1
+stages=
+for stage in ${prefill_stages//,/ }; do
+    if [ $stage -lt $seq_length ]; then
+        stages=$stages' '$stage
+    fi
+done
+
+# block_chunk_i appends chunk_length tokens to the kv cache at once, e.g.
+# --chunk_length 32, needs onnx exported by export_onnx.py --chunk_length 32;
+# embedding gets a stage of that length too if no prefill stage has it
+embed_stages=$stages
+if [ $chunk_length -gt 0 ] && [ $chunk_length -lt $seq_length ] && [[ " $stages " != *" $chunk_length "* ]]; then
+    embed_stages=$embed_stages' '$chunk_length
+fi
+
+# block_verify_i & lm_head_verify score verify_length draft tokens in one pass
+# for speculative decoding, e.g. --verify_length 4, needs onnx exported by
+# export_onnx.py --verify_length 4; embedding gets a stage of that length too
+if [ $verify_length -gt 0 ] && [[ " $embed_stages " != *" $verify_length "* ]]; then
+    embed_stages=$embed_stages' '$verify_length
+fi
+
+# block_multi_K_i & lm_head_multi_K append K tokens in one pass for each K,
+# e.g. --multi_lengths 2,4,8, needs onnx exported by export_onnx.py
+# --multi_lengths 2,4,8; embedding gets a stage of each length too
+multis=${multi_lengths//,/ }
+for k in $multis; do
+    if [[ " $embed_stages " != *" $k "* ]]; then
+        embed_stages=$embed_stages' '$k
+    fi
+done
+
+# block_paged_i replaces block_cache_i: the kv cache of all sessions is one
+# pool of pages of page_size tokens, e.g. --page_size 32, needs onnx exported
+# by export_onnx.py --page_size 32 --num_pages N; it has no chunk version
+cache_name=block_cache_
+if [ $page_size -gt 0 ]; then
+    cache_name=block_paged_
+    chunk_length=0
+    verify_length=0
+    multis=
+    fuse_decode=0
+    embed_stages=$stages
+fi
 
 outdir=${folder}/embedding
 mkdir -p $outdir
@@ -120,9 +210,30 @@ model_deploy.py \
     $device_args \
     --model embedding_cache.bmodel
 
+for stage in $embed_stages; do
+    model_transform.py \
+        --model_name embedding \
+        --model_def ../onnx/embedding.pt \
+        --input_shapes "[[1,$stage]]" \
+        --input_types "int32" \
+        --mlir embedding_$stage.mlir
+
+    model_deploy.py \
+        --mlir embedding_$stage.mlir \
+        --quantize F16 \
+        --quant_output \
+        --chip bm1688 \
+        --num_core 2 \
+        $device_args \
+        --model embedding_$stage.bmodel
+done
+
 rm *.npz
 
 models=$models' '$outdir'/embedding.bmodel '$outdir'/embedding_cache.bmodel '
+for stage in $embed_stages; do
+    models=$models$outdir'/embedding_'$stage'.bmodel '
+done
 
 popd
 
@@ -148,6 +259,41 @@ model_deploy.py \
 
 models=${models}${outdir}'/lm_head_with_topk.bmodel '
 
+if [ $verify_length -gt 0 ]; then
+    model_transform.py \
+        --model_name lm_head_verify \
+        --model_def ../../onnx/lm_head_with_topk.pt \
+        --input_shapes "[[1,${verify_length},${hidden_size}]]" \
+        --mlir lm_head_verify.mlir
+
+    model_deploy.py \
+        --mlir lm_head_verify.mlir \
+        ${quantize_args} \
+        --quant_input \
+        --chip bm1688 \
+        --num_core 2 \
+        --model lm_head_verify.bmodel
+
+    models=${models}${outdir}'/lm_head_verify.bmodel '
+fi
+
+for k in $multis; do
+    model_transform.py \
+        --model_name lm_head_multi_$k \
+        --model_def ../../onnx/lm_head_with_topk.pt \
+        --input_shapes "[[1,${k},${hidden_size}]]" \
+        --mlir lm_head_multi_$k.mlir
+
+    model_deploy.py \
+        --mlir lm_head_multi_$k.mlir \
+        ${quantize_args} \
+        --quant_input \
+        --chip bm1688 \
+        --num_core 2 \
+        --model lm_head_multi_$k.bmodel
+
+    models=${models}${outdir}'/lm_head_multi_'$k'.bmodel '
+done
 
 popd
 echo $models
@@ -156,6 +302,81 @@ outdir=${folder}/$mode/block
 mkdir -p $outdir
 pushd $outdir
 
+# decode_step runs embedding, all blocks & lm_head of a decode token as one
+# net, e.g. --fuse_decode, needs onnx exported by export_onnx.py
+# --fuse_decode 1; it writes the KV rows in place like block_cache_i
+if [ $fuse_decode == 1 ]; then
+    model_transform.py \
+        --model_name decode_step \
+        --model_def ../../onnx/decode_step.onnx \
+        --mlir decode_step.mlir
+
+    model_deploy.py \
+        --mlir decode_step.mlir \
+        $quantize_args \
+        --quant_input \
+        --chip bm1688 \
+        --num_core 2 \
+        $addr_args \
+        --model decode_step.bmodel
+
+    models=${models}${outdir}'/decode_step.bmodel '
+fi
+
+# block_group_g prefills fuse_prefill layers in one net, e.g. --fuse_prefill 4,
+# needs onnx exported by export_onnx.py --fuse_prefill 4
+process_group() {
+    g=$1
+
+    model_transform.py \
+        --model_name block_group_$g \
+        --model_def ../../onnx/block_group_$g.onnx \
+        --mlir block_group_$g.mlir
+
+    model_deploy.py \
+        --mlir block_group_$g.mlir \
+        $quantize_args \
+        --quant_input \
+        --quant_output \
+        --chip bm1688 \
+        --num_core 2 \
+        $dyn_args \
+        --model block_group_$g.bmodel
+
+    for stage in $stages; do
+        mask_shape="[1,1,$stage,$stage]"
+        if [ $mask_in_graph == 1 ]; then
+            mask_shape="[1]"
+        fi
+        model_transform.py \
+            --model_name block_group_$g \
+            --model_def ../../onnx/block_group_$g.onnx \
+            --input_shapes "[[1,$stage,$hidden_size],[1,$stage],$mask_shape]" \
+            --mlir block_group_${g}_$stage.mlir
+
+        model_deploy.py \
+            --mlir block_group_${g}_$stage.mlir \
+            $quantize_args \
+            --quant_input \
+            --quant_output \
+            --chip bm1688 \
+            --num_core 2 \
+            --model block_group_${g}_$stage.bmodel
+    done
+}
+if [ $fuse_prefill -gt 0 ]; then
+    num_groups=$(( (num_layers + fuse_prefill - 1) / fuse_prefill ))
+    for ((g=0; g<$num_groups; g++)); do
+        process_group $g &
+        models=${models}${outdir}'/block_group_'$g'.bmodel '
+        for stage in $stages; do
+            models=${models}${outdir}'/block_group_'$g'_'$stage'.bmodel '
+        done
+        sleep 45
+    done
+    wait
+fi
+
 # Function to process each block in parallel
 process_block() {
     i=$1
@@ -176,24 +397,108 @@ process_block() {
         --model block_$i.bmodel
 
     model_transform.py \
-        --model_name block_cache_$i \
-        --model_def ../../onnx/block_cache_${i}.onnx \
-        --mlir block_cache_$i.mlir
+        --model_name $cache_name$i \
+        --model_def ../../onnx/$cache_name${i}.onnx \
+        --mlir $cache_name$i.mlir
 
     model_deploy.py \
-        --mlir block_cache_$i.mlir \
+        --mlir $cache_name$i.mlir \
         $quantize_args \
         --quant_input \
         --quant_output \
         --chip bm1688 \
         --num_core 2 \
         $addr_args \
-        --model block_cache_$i.bmodel
+        --model $cache_name$i.bmodel
+
+    for stage in $stages; do
+        mask_shape="[1,1,$stage,$stage]"
+        if [ $mask_in_graph == 1 ]; then
+            mask_shape="[1]"
+        fi
+        model_transform.py \
+            --model_name block_$i \
+            --model_def ../../onnx/block_$i.onnx \
+            --input_shapes "[[1,$stage,$hidden_size],[1,$stage],$mask_shape]" \
+            --mlir block_${i}_$stage.mlir
+
+        model_deploy.py \
+            --mlir block_${i}_$stage.mlir \
+            $quantize_args \
+            --quant_input \
+            --quant_output \
+            --chip bm1688 \
+            --num_core 2 \
+            --model block_${i}_$stage.bmodel
+    done
+
+    if [ $chunk_length -gt 0 ]; then
+        model_transform.py \
+            --model_name block_chunk_$i \
+            --model_def ../../onnx/block_chunk_${i}.onnx \
+            --mlir block_chunk_$i.mlir
+
+        model_deploy.py \
+            --mlir block_chunk_$i.mlir \
+            $quantize_args \
+            --quant_input \
+            --quant_output \
+            --chip bm1688 \
+            --num_core 2 \
+            $addr_args \
+            --model block_chunk_$i.bmodel
+    fi
+
+    if [ $verify_length -gt 0 ]; then
+        model_transform.py \
+            --model_name block_verify_$i \
+            --model_def ../../onnx/block_verify_${i}.onnx \
+            --mlir block_verify_$i.mlir
+
+        model_deploy.py \
+            --mlir block_verify_$i.mlir \
+            $quantize_args \
+            --quant_input \
+            --quant_output \
+            --chip bm1688 \
+            --num_core 2 \
+            $addr_args \
+            --model block_verify_$i.bmodel
+    fi
+
+    for k in $multis; do
+        model_transform.py \
+            --model_name block_multi_${k}_$i \
+            --model_def ../../onnx/block_multi_${k}_${i}.onnx \
+            --mlir block_multi_${k}_$i.mlir
+
+        model_deploy.py \
+            --mlir block_multi_${k}_$i.mlir \
+            $quantize_args \
+            --quant_input \
+            --quant_output \
+            --chip bm1688 \
+            --num_core 2 \
+            $addr_args \
+            --model block_multi_${k}_$i.bmodel
+    done
 }
 # Process each block in parallel
 for ((i=0; i<$num_layers; i++)); do
     process_block $i &
-    models=${models}${outdir}'/block_'$i'.bmodel '$outdir'/block_cache_'$i'.bmodel '
+    models=${models}${outdir}'/block_'$i'.bmodel '$outdir'/'$cache_name$i'.bmodel '
+    for stage in $stages; do
+        models=${models}${outdir}'/block_'$i'_'$stage'.bmodel '
+    done
+    if [ $chunk_length -gt 0 ]; then
+        models=${models}${outdir}'/block_chunk_'$i'.bmodel '
+    fi
+    if [ $verify_length -gt 0 ]; then
+        models=${models}${outdir}'/block_verify_'$i'.bmodel '
+    fi
+    for k in $multis; do
+        models=${models}${outdir}'/block_multi_'$k'_'$i'.bmodel '
+    done
     sleep 45
 done
 
@@ -20,6 +20,17 @@ parser.add_argument('-m', '--model_path', type=str, help='path to the torch mode
 parser.add_argument('-s', '--seq_length', type=int, default=512, help="sequence length")
 parser.add_argument('-d', '--device', type=str, choices=["cpu", "cuda"], default="cpu")
 parser.add_argument('--lmhead_with_topk', type=int, default=0, help="only trace the LmHeadWithTopK")
+parser.add_argument('--dynamic_prefill', type=int, default=0, help="export block with dynamic sequence length, required by compile.sh --prefill_stages")
+parser.add_argument('--mask_in_graph', type=int, default=0, help="block & block_cache take a valid length and build the attention mask inside")
+parser.add_argument('--chunk_length', type=int, default=0, help="also export block_chunk that appends this many tokens to the kv cache, used by forward_append")
+parser.add_argument('--verify_length', type=int, default=0, help="also export block_verify that scores this many draft tokens in one pass, used by speculative decoding")
+parser.add_argument('--multi_lengths', type=str, default="", help="also export block_multi that append each of these many tokens in one pass, e.g. 2,4,8, used by forward_multi")
+parser.add_argument('--fuse_decode', type=int, default=0, help="also export decode_step that runs embedding, all blocks & lm_head of one decode token in one net")
+parser.add_argument('--fuse_prefill', type=int, default=0, help="also export block_group that prefill this many layers in one net")
+parser.add_argument('--page_size', type=int, default=0, help="also export block_paged that reads the kv cache from pages of this many tokens, by a page table")
+parser.add_argument('--num_pages', type=int, default=0, help="pages in the kv pool of block_paged, shared by all sessions")
+parser.add_argument('--kv_int8', type=int, default=0, help="keep the kv cache in int8, each head of a row carries its own scale")
+parser.add_argument('--test_kv_int8', type=int, default=0, help="only compare greedy decoding of one prompt with the float & the int8 kv cache in torch")
 
 args = parser.parse_args()
 
@@ -53,6 +64,8 @@ NUM_ATTENTION_HEADS = config.num_attention_heads
 NUM_KEY_VALUE_HEADS = config.num_key_value_heads
 HEAD_DIM = HIDDEN_SIZE // NUM_ATTENTION_HEADS
 VOCAB_SIZE = config.vocab_size
+# last dim of a kv row, int8 kv has one more byte per head for its scale
+KV_DIM = HEAD_DIM + 1 if args.kv_int8 else HEAD_DIM
 
 print(f'\
 Layers: {NUM_LAYERS}\n\
@@ -60,7 +73,32 @@ Hidden size: {HIDDEN_SIZE}\n\
 Head dim: {HEAD_DIM}\n\
 Q Heads: {NUM_ATTENTION_HEADS}\n\
 KV Heads: {NUM_KEY_VALUE_HEADS}\n\
-Seq length: {SEQ_LENGTH}\n')
+Seq length: {SEQ_LENGTH}\n\
+KV: {"int8" if args.kv_int8 else "float"}\n')
+
+
+def quant_kv(x):
+    # [.., HEAD_DIM] -> int8 [.., HEAD_DIM + 1]: the head is scaled by 2^e so
+    # its largest value fits 127, e is stored in the last byte. A power of two
+    # scale keeps the kv one int8 tensor the runtime copies like any other.
+    x = x.float()
+    amax = x.abs().amax(dim=-1, keepdim=True).clamp(min=1e-6)
+    e = torch.ceil(torch.log2(amax / 127.)).clamp(-127, 127)
+    q = torch.clamp(torch.floor(x / torch.pow(2., e) + 0.5), -127, 127)
+    return torch.cat([q, e], dim=-1).to(torch.int8)
+
+
+def dequant_kv(q):
+    q = q.float()
+    return (q[..., :HEAD_DIM] * torch.pow(2., q[..., HEAD_DIM:])).to(dtype)
+
+
+def kv_input(*shape):
+    # dummy kv of shape [.., HEAD_DIM] for tracing
+    if args.kv_int8:
+        return quant_kv(torch.randn(shape)).to(device)
+    return torch.randn(shape).to(dtype).to(device)
+
 
 class Embedding(torch.nn.Module):
 
@@ -94,6 +132,8 @@ class Block(torch.nn.Module):
             use_cache=True,
             position_embeddings=(self.cos, self.sin))
         present_k, present_v = past_kv
+        if args.kv_int8:
+            return hidden_states.float(), quant_kv(present_k), quant_kv(present_v)
         return hidden_states.float(), present_k.float(), present_v.float()
 
 
@@ -113,6 +153,8 @@ class BlockCache(torch.nn.Module):
                 position_ids,
                 attention_mask,
                 past_k, past_v):
+        if args.kv_int8:
+            past_k, past_v = dequant_kv(past_k), dequant_kv(past_v)
         hidden_states, past_kv = self.layer(
             hidden_states,
             past_key_value=(past_k, past_v),
@@ -121,9 +163,120 @@ class BlockCache(torch.nn.Module):
             use_cache=True,
             position_embeddings=(self.cos, self.sin))
         present_k, present_v = past_kv
+        if args.kv_int8:
+            return hidden_states.float(), quant_kv(present_k), quant_kv(present_v)
         return hidden_states.float(), present_k.float(), present_v.float()
 
 
+def causal_mask(valid_length, seq_len, start=0):
+    # query i sits at column start + i, it sees the columns before it that
+    # are inside the first start + valid_length ones
+    ids = torch.arange(seq_len, dtype=torch.int32, device=device)
+    rows = ids.view(seq_len, 1) + start
+    cols = ids.view(1, seq_len)
+    visible = (cols <= rows) & (cols < start + valid_length)
+    mask = torch.where(visible, 0., -10000.)
+    return mask.view(1, 1, seq_len, seq_len).to(dtype)
+
+
+class BlockWithLength(Block):
+
+    def forward(self, hidden_states, position_ids, valid_length):
+        attention_mask = causal_mask(valid_length, hidden_states.shape[1])
+        return super().forward(hidden_states, position_ids, attention_mask)
+
+
+class BlockCacheWithLength(BlockCache):
+
+    def forward(self, hidden_states, position_ids, valid_length, past_k,
+                past_v):
+        # the first valid_length history rows and the new token are visible
+        ids = torch.arange(SEQ_LENGTH + 1, dtype=torch.int32, device=device)
+        visible = (ids < valid_length) | (ids == SEQ_LENGTH)
+        attention_mask = torch.where(visible, 0., -10000.)
+        attention_mask = attention_mask.view(1, 1, 1, SEQ_LENGTH + 1).to(dtype)
+        return super().forward(hidden_states, position_ids, attention_mask,
+                               past_k, past_v)
+
+
+class BlockChunkWithLength(BlockCache):
+
+    def forward(self, hidden_states, position_ids, valid_length, past_k,
+                past_v):
+        # the first valid_length history rows and the chunk rows up to the
+        # query itself are visible
+        chunk = hidden_states.shape[1]
+        rows = torch.arange(chunk, dtype=torch.int32, device=device).view(chunk, 1)
+        cols = torch.arange(SEQ_LENGTH + chunk, dtype=torch.int32, device=device).view(1, -1)
+        visible = (cols < valid_length) | ((cols >= SEQ_LENGTH) & (cols - SEQ_LENGTH <= rows))
+        attention_mask = torch.where(visible, 0., -10000.)
+        attention_mask = attention_mask.view(1, 1, chunk, SEQ_LENGTH + chunk).to(dtype)
+        return super().forward(hidden_states, position_ids, attention_mask,
+                               past_k, past_v)
+
+
+class BlockPaged(BlockCache):
+
+    def forward(self, hidden_states, position_ids, attention_mask, pool_k,
+                pool_v, page_table):
+        # gather the pages of the session in order, row r of the history is
+        # row r % PAGE of page page_table[r // PAGE]
+        past_k = pool_k[page_table].view(1, SEQ_LENGTH, NUM_KEY_VALUE_HEADS, KV_DIM)
+        past_v = pool_v[page_table].view(1, SEQ_LENGTH, NUM_KEY_VALUE_HEADS, KV_DIM)
+        return super().forward(hidden_states, position_ids, attention_mask,
+                               past_k, past_v)
+
+
+class BlockPagedWithLength(BlockCacheWithLength):
+
+    def forward(self, hidden_states, position_ids, valid_length, pool_k,
+                pool_v, page_table):
+        past_k = pool_k[page_table].view(1, SEQ_LENGTH, NUM_KEY_VALUE_HEADS, KV_DIM)
+        past_v = pool_v[page_table].view(1, SEQ_LENGTH, NUM_KEY_VALUE_HEADS, KV_DIM)
+        return super().forward(hidden_states, position_ids, valid_length,
+                               past_k, past_v)
+
+
+class DecodeStep(torch.nn.Module):
+    # embedding_cache, every block_cache & lm_head_with_topk in one graph,
+    # the runtime writes the new KV rows to the cache by binding the outputs
+
+    def __init__(self):
+        super().__init__()
+        block = BlockCacheWithLength if args.mask_in_graph else BlockCache
+        self.blocks = [block(i) for i in range(NUM_LAYERS)]
+
+    def forward(self, input_ids, position_ids, attention_mask, *history):
+        hidden_states = transformer.embed_tokens(input_ids)
+        presents = []
+        for i, block in enumerate(self.blocks):
+            hidden_states, present_k, present_v = block(
+                hidden_states.to(dtype), position_ids, attention_mask,
+                history[2 * i], history[2 * i + 1])
+            presents += [present_k, present_v]
+        hidden_states = transformer.norm(hidden_states.to(dtype))
+        m_logits = origin_model.lm_head(hidden_states)
+        _, token = torch.topk(m_logits.float(), 1)
+        return (token, *presents)
+
+
+class BlockGroup(torch.nn.Module):
+    # block_i of layers first .. first + count - 1 in one graph
+
+    def __init__(self, first, count):
+        super().__init__()
+        block = BlockWithLength if args.mask_in_graph else Block
+        self.blocks = [block(i) for i in range(first, first + count)]
+
+    def forward(self, hidden_states, position_ids, attention_mask):
+        presents = []
+        for block in self.blocks:
+            hidden_states, present_k, present_v = block(
+                hidden_states.to(dtype), position_ids, attention_mask)
+            presents += [present_k, present_v]
+        return (hidden_states, *presents)
+
+
 class LmHeadWithTopK(torch.nn.Module):
 
     def __init__(self):
@@ -195,13 +348,98 @@ def convert_block(layer_id):
         [range(SEQ_LENGTH)], dtype=torch.long).to(device)
     attention_mask = torch.randn(
         (1, 1, SEQ_LENGTH, SEQ_LENGTH)).to(dtype).to(device)
+    mask_name = 'attention_mask'
+    if args.mask_in_graph:
+        model = BlockWithLength(layer_id)
+        attention_mask = torch.tensor([SEQ_LENGTH], dtype=torch.int32).to(device)
+        mask_name = 'valid_length'
+    dynamic_axes = None
+    if args.dynamic_prefill:
+        # each prefill stage fixes seq_len by --input_shapes in compile.sh
+        dynamic_axes = {
+            'input_states': {1: 'seq_len'},
+            'position_ids': {1: 'seq_len'},
+            'hidden_states': {1: 'seq_len'},
+            'past_k': {1: 'seq_len'},
+            'past_v': {1: 'seq_len'}
+        }
+        if not args.mask_in_graph:
+            dynamic_axes['attention_mask'] = {2: 'seq_len', 3: 'seq_len'}
 
     torch.onnx.export(
         model, (hidden_states, position_ids, attention_mask),
         f'{folder}/block_{layer_id}.onnx',
         verbose=False,
-        input_names=['input_states', 'position_ids', 'attention_mask'],
+        input_names=['input_states', 'position_ids', mask_name],
         output_names=['hidden_states', 'past_k', 'past_v'],
+        dynamic_axes=dynamic_axes,
+        do_constant_folding=True,
+        opset_version=15)
+
+
+def convert_decode_step():
+    model = DecodeStep()
+    input_ids = torch.tensor([[0]], dtype=torch.int32).to(device)
+    position_ids = torch.tensor([range(1)], dtype=torch.long).to(device)
+    attention_mask = torch.ones(
+        (1, 1, 1, SEQ_LENGTH + 1)).to(dtype).to(device)
+    mask_name = 'attention_mask'
+    if args.mask_in_graph:
+        attention_mask = torch.tensor([SEQ_LENGTH - 1], dtype=torch.int32).to(device)
+        mask_name = 'valid_length'
+    history, history_names, present_names = [], [], []
+    for i in range(NUM_LAYERS):
+        history += [kv_input(1, SEQ_LENGTH, NUM_KEY_VALUE_HEADS, HEAD_DIM),
+                    kv_input(1, SEQ_LENGTH, NUM_KEY_VALUE_HEADS, HEAD_DIM)]
+        history_names += [f'history_k_{i}', f'history_v_{i}']
+        present_names += [f'past_k_{i}', f'past_v_{i}']
+
+    torch.onnx.export(
+        model, (input_ids, position_ids, attention_mask, *history),
+        f'{folder}/decode_step.onnx',
+        verbose=False,
+        input_names=['input_ids', 'position_ids', mask_name] + history_names,
+        output_names=['token'] + present_names,
+        do_constant_folding=True,
+        opset_version=15)
+
+
+def convert_block_group(group_id, count):
+    first = group_id * count
+    count = min(count, NUM_LAYERS - first)
+    model = BlockGroup(first, count)
+    hidden_states = torch.randn(
+        (1, SEQ_LENGTH, HIDDEN_SIZE)).to(dtype).to(device)
+    position_ids = torch.tensor(
+        [range(SEQ_LENGTH)], dtype=torch.long).to(device)
+    attention_mask = torch.randn(
+        (1, 1, SEQ_LENGTH, SEQ_LENGTH)).to(dtype).to(device)
+    mask_name = 'attention_mask'
+    if args.mask_in_graph:
+        attention_mask = torch.tensor([SEQ_LENGTH], dtype=torch.int32).to(device)
+        mask_name = 'valid_length'
+    present_names = []
+    for i in range(first, first + count):
+        present_names += [f'past_k_{i}', f'past_v_{i}']
+    dynamic_axes = None
+    if args.dynamic_prefill:
+        dynamic_axes = {
+            'input_states': {1: 'seq_len'},
+            'position_ids': {1: 'seq_len'},
+            'hidden_states': {1: 'seq_len'},
+        }
+        for name in present_names:
+            dynamic_axes[name] = {1: 'seq_len'}
+        if not args.mask_in_graph:
+            dynamic_axes['attention_mask'] = {2: 'seq_len', 3: 'seq_len'}
+
+    torch.onnx.export(
+        model, (hidden_states, position_ids, attention_mask),
+        f'{folder}/block_group_{group_id}.onnx',
+        verbose=False,
+        input_names=['input_states', 'position_ids', mask_name],
+        output_names=['hidden_states'] + present_names,
+        dynamic_axes=dynamic_axes,
         do_constant_folding=True,
         opset_version=15)
 
@@ -212,15 +450,48 @@ def convert_block_cache(layer_id):
     position_ids = torch.tensor([range(1)], dtype=torch.long).to(device)
     attention_mask = torch.ones(
         (1, 1, 1, SEQ_LENGTH + 1)).to(dtype).to(device)
-    past_k = torch.randn((1, SEQ_LENGTH, NUM_KEY_VALUE_HEADS, HEAD_DIM)).to(dtype).to(device)
-    past_v = torch.randn((1, SEQ_LENGTH, NUM_KEY_VALUE_HEADS, HEAD_DIM)).to(dtype).to(device)
+    past_k = kv_input(1, SEQ_LENGTH, NUM_KEY_VALUE_HEADS, HEAD_DIM)
+    past_v = kv_input(1, SEQ_LENGTH, NUM_KEY_VALUE_HEADS, HEAD_DIM)
+    mask_name = 'attention_mask'
+    if args.mask_in_graph:
+        model = BlockCacheWithLength(layer_id)
+        attention_mask = torch.tensor([SEQ_LENGTH - 1], dtype=torch.int32).to(device)
+        mask_name = 'valid_length'
 
     torch.onnx.export(
         model, (hidden_states, position_ids, attention_mask, past_k, past_v),
         f'{folder}/block_cache_{layer_id}.onnx',
         verbose=False,
         input_names=[
-            'input_states', 'position_ids', 'attention_mask', 'history_k',
+            'input_states', 'position_ids', mask_name, 'history_k',
+            'history_v'
+        ],
+        output_names=['hidden_states', 'past_k', 'past_v'],
+        do_constant_folding=True,
+        opset_version=15)
+
+
+def convert_block_chunk(layer_id, chunk, name='block_chunk'):
+    # block_cache with chunk new tokens
+    model = BlockCache(layer_id)
+    hidden_states = torch.randn((1, chunk, HIDDEN_SIZE)).to(dtype).to(device)
+    position_ids = torch.tensor([range(chunk)], dtype=torch.long).to(device)
+    attention_mask = torch.ones(
+        (1, 1, chunk, SEQ_LENGTH + chunk)).to(dtype).to(device)
+    past_k = kv_input(1, SEQ_LENGTH, NUM_KEY_VALUE_HEADS, HEAD_DIM)
+    past_v = kv_input(1, SEQ_LENGTH, NUM_KEY_VALUE_HEADS, HEAD_DIM)
+    mask_name = 'attention_mask'
+    if args.mask_in_graph:
+        model = BlockChunkWithLength(layer_id)
+        attention_mask = torch.tensor([SEQ_LENGTH - chunk], dtype=torch.int32).to(device)
+        mask_name = 'valid_length'
+
+    torch.onnx.export(
+        model, (hidden_states, position_ids, attention_mask, past_k, past_v),
+        f'{folder}/{name}_{layer_id}.onnx',
+        verbose=False,
+        input_names=[
+            'input_states', 'position_ids', mask_name, 'history_k',
             'history_v'
         ],
         output_names=['hidden_states', 'past_k', 'past_v'],
@@ -228,6 +499,39 @@ def convert_block_cache(layer_id):
         opset_version=15)
 
 
+def convert_block_paged(layer_id):
+    # block_cache reading the kv cache of a session from a pool of pages, the
+    # new row is written to its page by the runtime
+    page = args.page_size
+    assert SEQ_LENGTH % page == 0, "seq_length must be a multiple of page_size"
+    model = BlockPaged(layer_id)
+    hidden_states = torch.randn((1, 1, HIDDEN_SIZE)).to(dtype).to(device)
+    position_ids = torch.tensor([range(1)], dtype=torch.long).to(device)
+    attention_mask = torch.ones(
+        (1, 1, 1, SEQ_LENGTH + 1)).to(dtype).to(device)
+    pool_k = kv_input(args.num_pages, page, NUM_KEY_VALUE_HEADS, HEAD_DIM)
+    pool_v = kv_input(args.num_pages, page, NUM_KEY_VALUE_HEADS, HEAD_DIM)
+    page_table = torch.zeros(SEQ_LENGTH // page, dtype=torch.int32).to(device)
+    mask_name = 'attention_mask'
+    if args.mask_in_graph:
+        model = BlockPagedWithLength(layer_id)
+        attention_mask = torch.tensor([SEQ_LENGTH - 1], dtype=torch.int32).to(device)
+        mask_name = 'valid_length'
+
+    torch.onnx.export(
+        model, (hidden_states, position_ids, attention_mask, pool_k, pool_v,
+                page_table),
+        f'{folder}/block_paged_{layer_id}.onnx',
+        verbose=False,
+        input_names=[
+            'input_states', 'position_ids', mask_name, 'pool_k', 'pool_v',
+            'page_table'
+        ],
+        output_names=['hidden_states', 'past_k', 'past_v'],
+        do_constant_folding=True,
+        opset_version=15)
+
+
 def convert_embedding():
     model = Embedding()
     input_ids = torch.tensor([range(SEQ_LENGTH)], dtype=torch.int32).to(device)
@@ -351,7 +655,66 @@ def test_net_with_mask():
     print("\noutput_ids:{}".format(out_ids))
 
 
+def test_kv_int8(steps=64):
+    # greedy decoding of one prompt with the float kv cache and with the int8
+    # one, reports where the tokens part and how close the logits stay
+    from transformers import AutoTokenizer
+    tokenizer = AutoTokenizer.from_pretrained(model_path, trust_remote_code=True)
+    ids = tokenizer.encode(build_prompt("tell me about sophgo in ten word"))
+    embed, lm = Embedding().to(device), LmHead()
+    blocks = [Block(i).to(device) for i in range(NUM_LAYERS)]
+    block_kvs = [BlockCache(i).to(device) for i in range(NUM_LAYERS)]
+    kv_int8 = args.kv_int8
+
+    def decode(int8):
+        args.kv_int8 = int8
+        token_len = len(ids)
+        out = embed(torch.tensor([ids]).to(device)).to(dtype)
+        position_ids = torch.tensor([range(token_len)]).to(device)
+        mask = causal_mask(token_len, token_len)
+        k_cache, v_cache = [], []
+        for i in range(NUM_LAYERS):
+            out, k, v = blocks[i](out.to(dtype), position_ids, mask)
+            if not int8:
+                k, v = k.to(dtype), v.to(dtype)
+            pad = torch.zeros((1, SEQ_LENGTH - token_len) + k.shape[2:], dtype=k.dtype)
+            k_cache.append(torch.cat([k, pad], dim=1))
+            v_cache.append(torch.cat([v, pad], dim=1))
+        logits = [lm(out[:, -1:].to(dtype)).float().view(-1)]
+        tokens = [int(logits[-1].argmax())]
+        while len(tokens) < steps and token_len < SEQ_LENGTH:
+            out = embed(torch.tensor([[tokens[-1]]]).to(device)).to(dtype)
+            position_ids = torch.tensor([[token_len]]).to(device)
+            mask = torch.zeros((1, 1, 1, SEQ_LENGTH + 1)).to(dtype).to(device)
+            mask[..., token_len:SEQ_LENGTH] = -10000.0
+            for i in range(NUM_LAYERS):
+                out, k, v = block_kvs[i](out.to(dtype), position_ids, mask,
+                                         k_cache[i], v_cache[i])
+                k_cache[i][:, token_len:token_len + 1] = k
+                v_cache[i][:, token_len:token_len + 1] = v
+            token_len += 1
+            logits.append(lm(out.to(dtype)).float().view(-1))
+            tokens.append(int(logits[-1].argmax()))
+        return tokens, logits
+
+    ref, ref_logits = decode(0)
+    test, test_logits = decode(1)
+    args.kv_int8 = kv_int8
+    same = next((i for i, (a, b) in enumerate(zip(ref, test)) if a != b), len(ref))
+    cos = [float(torch.cosine_similarity(a, b, dim=0))
+           for a, b in zip(ref_logits[:same + 1], test_logits)]
+    print(f"int8 kv: {same}/{len(ref)} tokens same as float kv, logits cosine min {min(cos):.5f}")
+    print(tokenizer.decode(ref))
+    print(tokenizer.decode(test))
+
+
 # test_net_with_mask()
+if args.test_kv_int8:
+    test_kv_int8()
+    exit()
+
+# block_multi_K_i, K new tokens see the cache & the ones before them
+multi_lengths = [int(k) for k in args.multi_lengths.split(',') if k]
 
 # create folder to store onnx
 if not os.path.exists(folder):
@@ -362,6 +725,24 @@ print('Convert block & block_cache')
 for i in tqdm(range(NUM_LAYERS)):
    convert_block(i)
    convert_block_cache(i)
+   if args.chunk_length:
+       convert_block_chunk(i, args.chunk_length)
+   if args.verify_length:
+       convert_block_chunk(i, args.verify_length, 'block_verify')
+   for k in multi_lengths:
+       convert_block_chunk(i, k, f'block_multi_{k}')
+   if args.page_size:
+       convert_block_paged(i)
+
+if args.fuse_decode:
+    print('Convert decode_step')
+    convert_decode_step()
+if args.fuse_prefill:
+    # the last group may have fewer layers
+    print('Convert block_group')
+    num_groups = (NUM_LAYERS + args.fuse_prefill - 1) // args.fuse_prefill
+    for g in tqdm(range(num_groups)):
+        convert_block_group(g, args.fuse_prefill)
 
 print('Convert embedding')
 convert_embedding()
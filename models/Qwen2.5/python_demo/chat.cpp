@@ -10,6 +10,7 @@
 #include <iostream>
 #include <cstdlib>
 #include <vector>
+#include <cstring>
 #include <assert.h>
 #include <chrono>
 #include <algorithm>
@@ -17,6 +18,9 @@
 #include <pybind11/stl.h>
 #include "memory.h"
 #include "bmruntime_interface.h"
+#include "session_file.h"
+#include "device_arena.h"
+#include "attention_mask.h"
 #include <getopt.h>
 #include <stdio.h>
 #include <inttypes.h>
@@ -31,19 +35,34 @@ public:
   void deinit();
   int forward_first(std::vector<int> &tokens);
   int forward_next(int cur_token);
+  int forward_append(std::vector<int> &tokens);
   int forward_first_with_topk(std::vector<int> &tokens, std::string mode = "sample");
   int forward_next_with_topk(int cur_token, std::string mode = "sample");
   std::vector<int> answer(std::vector<int> history_tokens);
+  bool save_session(const std::string &path, std::vector<int> &tokens);
+  bool load_session(const std::string &path);
 
   int EOS;
   int device_num;
   int NUM_LAYERS;
   int token_length;
   int SEQLEN;
+  std::vector<int> PREFILL_SEQLENS; // sorted prefill stage lengths
+  bool layer_sync = false; // debug: sync after every launch to locate errors
+  bool arena_compare = false; // init also times one allocation per buffer
+  std::vector<int> session_tokens; // token ids of the last loaded session
   std::mt19937 gen;
   Qwen() : gen(std::random_device()()) {};
   int sample(const std::vector<float>& probs, const std::vector<int>& tokens);
 
+private:
+  int prefill_seqlen(int length);
+  int stage_of(const bm_net_info_t *net, int seqlen);
+  void prefill(std::vector<int> &tokens);
+  void debug_sync();
+  SessionHeader session_header();
+  std::vector<SessionTensor> session_tensors();
+
 private:
   std::vector<bm_handle_t> handles;
   bm_handle_t bm_handle;
@@ -59,11 +78,13 @@ private:
   std::vector<std::vector<bm_tensor_t>> past_key, past_value;
   std::vector<bm_tensor_t> inputs_lm;
   std::vector<bm_tensor_t> outputs_lm, outputs_logit_lm, outputs_token_lm;
+  std::vector<DeviceArena> arenas; // runtime buffers, one block per device
   std::string name_embed;
   std::string name_embed_cache;
   std::string name_lm;
   std::vector<std::string> name_blocks;
   std::vector<std::string> name_blocks_cache;
+  uint64_t model_hash;
 };
 
 void Qwen::init(const std::vector<int> &devices, int eos_token_id, std::string model_path) {
@@ -98,10 +119,20 @@ void Qwen::init(const std::vector<int> &devices, int eos_token_id, std::string m
   bool ret = bmrt_load_bmodel(p_bmrt, model_path.c_str());
   assert(true == ret);
   printf("Done!\n");
+  model_hash = session_model_hash(model_path);
 
-  // set NUM_LAYERS
+  // set NUM_LAYERS, by name as compile.sh options add other nets
   auto num_nets = bmrt_get_network_number(p_bmrt);
-  NUM_LAYERS = (num_nets - 3) / 2;
+  const char **net_names = NULL;
+  bmrt_get_network_names(p_bmrt, &net_names);
+  NUM_LAYERS = 0;
+  for (int i = 0; i < num_nets; i++) {
+    if (strncmp(net_names[i], "block_cache_", 12) == 0) {
+      NUM_LAYERS++;
+    }
+  }
+  free(net_names);
+  assert(NUM_LAYERS > 0); // block_paged_i bmodels need sg_llm
 
   // net names
   name_embed = "embedding";
@@ -123,8 +154,18 @@ void Qwen::init(const std::vector<int> &devices, int eos_token_id, std::string m
         bmrt_get_network_info(p_bmrt, name_blocks_cache[i].c_str()));
   }
 
-  // set SEQLEN
-  SEQLEN = net_embed->stages[0].input_shapes[0].dims[1];
+  // set prefill stages & SEQLEN
+  for (int i = 0; i < net_embed->stage_num; i++) {
+    int seqlen = net_embed->stages[i].input_shapes[0].dims[1];
+    if (stage_of(net_blocks[0], seqlen) < 0) {
+      continue; // embedding only stage, e.g. of a chunk
+    }
+    PREFILL_SEQLENS.push_back(seqlen);
+  }
+  std::sort(PREFILL_SEQLENS.begin(), PREFILL_SEQLENS.end());
+  SEQLEN = PREFILL_SEQLENS.back();
+  int embed_stage = stage_of(net_embed, SEQLEN);
+  int block_stage = stage_of(net_blocks[0], SEQLEN);
 
   // resize
   net_blocks.resize(NUM_LAYERS);
@@ -132,134 +173,112 @@ void Qwen::init(const std::vector<int> &devices, int eos_token_id, std::string m
   past_key.resize(NUM_LAYERS);
   past_value.resize(NUM_LAYERS);
 
-  // net device mem
+  // net device mem, from one arena per device
+  arenas.resize(device_num);
   inputs_embed_512.resize(net_embed->input_num);
   for (int i = 0; i < device_num; ++i) {
-    ret = bmrt_tensor_ex(&inputs_embed_512[i], p_bmrt,
-                        net_embed->input_loc_devices[i],
-                        net_embed->input_dtypes[i],
-                        net_embed->stages[0].input_shapes[i]);
-    assert(true == ret);
+    arenas[net_embed->input_loc_devices[i]].add(
+        &inputs_embed_512[i], net_embed->input_dtypes[i],
+        net_embed->stages[embed_stage].input_shapes[i], "embedding");
   }
 
   outputs_embed_512.resize(net_embed->output_num);
   for (int i = 0; i < device_num; ++i) {
-    ret = bmrt_tensor_ex(&outputs_embed_512[i], p_bmrt,
-                        net_embed->output_loc_devices[i],
-                        net_embed->output_dtypes[i],
-                        net_embed->stages[0].output_shapes[i]);
-    assert(true == ret);
+    arenas[net_embed->output_loc_devices[i]].add(
+        &outputs_embed_512[i], net_embed->output_dtypes[i],
+        net_embed->stages[embed_stage].output_shapes[i], "embedding");
   }
 
   next_inputid.resize(device_num);
   for (int i = 0; i < device_num; ++i) {
-    ret = bmrt_tensor_ex(&next_inputid[i], p_bmrt,
-                        net_embed_cache->input_loc_devices[i],
-                        net_embed_cache->input_dtypes[i],
-                        net_embed_cache->stages[0].input_shapes[i]);
-    assert(true == ret);
+    arenas[net_embed_cache->input_loc_devices[i]].add(
+        &next_inputid[i], net_embed_cache->input_dtypes[i],
+        net_embed_cache->stages[0].input_shapes[i], "embedding");
   }
 
   inputs_pid.resize(device_num);
   inputs_attention.resize(device_num);
   int in_num = net_blocks[0]->input_num / device_num;
   for (int i = 0; i < device_num; ++i) {
-    ret = bmrt_tensor_ex(&inputs_pid[i], p_bmrt,
-                        net_blocks[0]->input_loc_devices[1 + i * in_num],
-                        net_blocks[0]->input_dtypes[1 + i * in_num],
-                        net_blocks[0]->stages[0].input_shapes[1 + i * in_num]);
-    assert(true == ret);
-
-    ret = bmrt_tensor_ex(&inputs_attention[i], p_bmrt,
-                        net_blocks[0]->input_loc_devices[2 + i * in_num],
-                        net_blocks[0]->input_dtypes[2 + i * in_num],
-                        net_blocks[0]->stages[0].input_shapes[2 + i * in_num]);
-    assert(true == ret);
+    arenas[net_blocks[0]->input_loc_devices[1 + i * in_num]].add(
+        &inputs_pid[i], net_blocks[0]->input_dtypes[1 + i * in_num],
+        net_blocks[0]->stages[block_stage].input_shapes[1 + i * in_num],
+        "position_id");
+    arenas[net_blocks[0]->input_loc_devices[2 + i * in_num]].add(
+        &inputs_attention[i], net_blocks[0]->input_dtypes[2 + i * in_num],
+        net_blocks[0]->stages[block_stage].input_shapes[2 + i * in_num],
+        "mask");
   }
 
   next_pid.resize(device_num);
   next_attention.resize(device_num);
   int in_num_cache = net_blocks_cache[0]->input_num / device_num;
   for (int i = 0; i < device_num; ++i) {
-    ret = bmrt_tensor_ex(&next_pid[i], p_bmrt,
-                        net_blocks_cache[0]->input_loc_devices[1 + i * in_num_cache],
-                        net_blocks_cache[0]->input_dtypes[1 + i * in_num_cache],
-                        net_blocks_cache[0]->stages[0].input_shapes[1 + i * in_num_cache]);
-    assert(true == ret);
-
-    ret = bmrt_tensor_ex(&next_attention[i], p_bmrt,
-                        net_blocks_cache[0]->input_loc_devices[2 + i * in_num_cache],
-                        net_blocks_cache[0]->input_dtypes[2 + i * in_num_cache],
-                        net_blocks_cache[0]->stages[0].input_shapes[2 + i * in_num_cache]);
-    assert(true == ret);
-  }
-
+    arenas[net_blocks_cache[0]->input_loc_devices[1 + i * in_num_cache]].add(
+        &next_pid[i], net_blocks_cache[0]->input_dtypes[1 + i * in_num_cache],
+        net_blocks_cache[0]->stages[0].input_shapes[1 + i * in_num_cache],
+        "position_id");
+    arenas[net_blocks_cache[0]->input_loc_devices[2 + i * in_num_cache]].add(
+        &next_attention[i],
+        net_blocks_cache[0]->input_dtypes[2 + i * in_num_cache],
+        net_blocks_cache[0]->stages[0].input_shapes[2 + i * in_num_cache],
+        "mask");
+  }
+
+  // KV of every layer & device
   int out_num = net_blocks[0]->output_num / device_num;
   for (int i = 0; i < NUM_LAYERS; i++) {
     past_key[i].resize(device_num);
     past_value[i].resize(device_num);
-    for (int j = 0; j < device_num; j++) {
-      ret = bmrt_tensor_ex(&past_key[i][j], p_bmrt,
-                          net_blocks[0]->output_loc_devices[1 + j * out_num],
-                          net_blocks[0]->output_dtypes[1 + j * out_num],
-                          net_blocks[0]->stages[0].output_shapes[1 + j * out_num]);
-      assert(true == ret);
-      ret = bmrt_tensor_ex(&past_value[i][j], p_bmrt,
-                          net_blocks[0]->output_loc_devices[2 + j * out_num],
-                          net_blocks[0]->output_dtypes[2 + j * out_num],
-                          net_blocks[0]->stages[0].output_shapes[2 + j * out_num]);
-      assert(true == ret);
+  }
+  for (int j = 0; j < device_num; j++) {
+    auto &arena = arenas[net_blocks[0]->output_loc_devices[1 + j * out_num]];
+    for (int i = 0; i < NUM_LAYERS; i++) {
+      arena.add(&past_key[i][j], net_blocks[0]->output_dtypes[1 + j * out_num],
+                net_blocks[0]->stages[block_stage].output_shapes[1 + j * out_num],
+                "kv");
+      arena.add(&past_value[i][j], net_blocks[0]->output_dtypes[2 + j * out_num],
+                net_blocks[0]->stages[block_stage].output_shapes[2 + j * out_num],
+                "kv");
     }
   }
 
   inputs_lm.resize(device_num);
-
+  for (int i = 0; i < device_num; ++i) {
+    arenas[i].add(&inputs_lm[i], net_lm->input_dtypes[0],
+                  net_lm->stages[0].input_shapes[0], "lm_head");
+  }
   if (net_lm->output_num == 1) {
     outputs_lm.resize(device_num);
     for (int i = 0; i < device_num; ++i) {
-      ret = bmrt_tensor_ex(&inputs_lm[i], p_bmrt, i, net_lm->input_dtypes[0],
-                          net_lm->stages[0].input_shapes[0]);
-      assert(true == ret);
-      ret = bmrt_tensor_ex(&outputs_lm[i], p_bmrt, i, net_lm->output_dtypes[0],
-                          net_lm->stages[0].output_shapes[0]);
-      assert(true == ret);
+      arenas[i].add(&outputs_lm[i], net_lm->output_dtypes[0],
+                    net_lm->stages[0].output_shapes[0], "lm_head");
     }
   } else if (net_lm->output_num == 2) {
     outputs_logit_lm.resize(device_num);
     outputs_token_lm.resize(device_num);
     for (int i = 0; i < device_num; ++i) {
-      ret = bmrt_tensor_ex(&inputs_lm[i], p_bmrt, i, net_lm->input_dtypes[0],
-                          net_lm->stages[0].input_shapes[0]);
-      assert(true == ret);
-      ret = bmrt_tensor_ex(&outputs_logit_lm[i], p_bmrt, i, net_lm->output_dtypes[0],
-                          net_lm->stages[0].output_shapes[0]);
-      assert(true == ret);
-      ret = bmrt_tensor_ex(&outputs_token_lm[i], p_bmrt, i, net_lm->output_dtypes[1],
-                          net_lm->stages[0].output_shapes[1]);
-      assert(true == ret);
+      arenas[i].add(&outputs_logit_lm[i], net_lm->output_dtypes[0],
+                    net_lm->stages[0].output_shapes[0], "lm_head");
+      arenas[i].add(&outputs_token_lm[i], net_lm->output_dtypes[1],
+                    net_lm->stages[0].output_shapes[1], "lm_head");
     }
   }
-}
 
-void Qwen::deinit() {
   for (int i = 0; i < device_num; ++i) {
-    bm_free_device(handles[i], inputs_embed_512[i].device_mem);
-    bm_free_device(handles[i], outputs_embed_512[i].device_mem);
-    bm_free_device(handles[i], inputs_pid[i].device_mem);
-    bm_free_device(handles[i], inputs_attention[i].device_mem);
-    bm_free_device(handles[i], next_inputid[i].device_mem);
-    bm_free_device(handles[i], next_pid[i].device_mem);
-    bm_free_device(handles[i], next_attention[i].device_mem);
-    bm_free_device(handles[i], inputs_lm[i].device_mem);
-    bm_free_device(handles[i], outputs_logit_lm[i].device_mem);
-    bm_free_device(handles[i], outputs_token_lm[i].device_mem);
+    arenas[i].compare = arena_compare;
+    ret = arenas[i].alloc(handles[i]);
+    assert(true == ret);
+    arenas[i].report(("Device " + std::to_string(devices[i])).c_str());
   }
-  for (int i = 0; i < NUM_LAYERS; i++) {
-    for (int j = 0; j < device_num; j++) {
-      bm_free_device(handles[j], past_key[i][j].device_mem);
-      bm_free_device(handles[j], past_value[i][j].device_mem);
-    }
+}
+
+void Qwen::deinit() {
+  // every buffer of init lives in the arenas
+  for (auto &arena : arenas) {
+    arena.free();
   }
+  arenas.clear();
   bmrt_destroy(p_bmrt);
   for (auto h : handles) {
     bm_dev_free(h);
@@ -271,78 +290,131 @@ int Qwen::sample(const std::vector<float>& probs, const std::vector<int>& tokens
   return tokens[dist(gen)];
 }
 
-int Qwen::forward_first(std::vector<int> &tokens) {
-  std::vector<int> input_ids(SEQLEN, 0);
-  std::vector<int> position_id(SEQLEN, 0);
-  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN, ATTENTION_MASK);
-  std::copy(tokens.begin(), tokens.end(), input_ids.data());
+// launches are queued in order on the device, so only the host read of the
+// token needs a sync; layer_sync restores the per-launch sync for debugging
+void Qwen::debug_sync() {
+  if (layer_sync) {
+    auto status = bm_thread_sync(bm_handle);
+    assert(BM_SUCCESS == status);
+  }
+}
 
+int Qwen::prefill_seqlen(int length) {
+  for (auto seqlen : PREFILL_SEQLENS) {
+    if (length <= seqlen) {
+      return seqlen;
+    }
+  }
+  return SEQLEN;
+}
+
+int Qwen::stage_of(const bm_net_info_t *net, int seqlen) {
+  for (int i = 0; i < net->stage_num; i++) {
+    if (net->stages[i].input_shapes[0].dims[1] == seqlen) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// run embedding & blocks on the smallest stage that holds tokens, the hidden
+// states are left in outputs_embed_512
+void Qwen::prefill(std::vector<int> &tokens) {
   token_length = tokens.size();
+  int seqlen = prefill_seqlen(token_length);
+  int embed_stage = stage_of(net_embed, seqlen);
+  int block_stage = stage_of(net_blocks[0], seqlen);
+
+  std::vector<int> input_ids(seqlen, 0);
+  std::vector<int> position_id(seqlen, 0);
+  std::vector<uint16_t> attention_mask(seqlen * seqlen);
+  std::copy(tokens.begin(), tokens.end(), input_ids.data());
 
   for (int i = 0; i < token_length; i++) {
     position_id[i] = i;
   }
-  for (int i = 0; i < token_length; i++) {
-    for (int j = 0; j < SEQLEN; j++) {
-      if (j <= i) {
-        attention_mask[i * SEQLEN + j] = 0;
-      }
-    }
-  }
+  build_prefill_mask(attention_mask.data(),
+                     token_length, seqlen, ATTENTION_MASK);
 
   // forward embeding
+  auto inputs_embed = inputs_embed_512;
+  auto outputs_embed = outputs_embed_512;
+  for (int i = 0; i < device_num; ++i) {
+    inputs_embed[i].shape = net_embed->stages[embed_stage].input_shapes[0];
+    outputs_embed[i].shape = net_embed->stages[embed_stage].output_shapes[0];
+  }
   std::vector<int> input_nums(device_num, 1);
   std::vector<void*> datas(device_num, (void*)input_ids.data());
-  bmrt_memcpy_s2d_parallel(p_bmrt, inputs_embed_512.data(), datas.data(),
+  bmrt_memcpy_s2d_parallel(p_bmrt, inputs_embed.data(), datas.data(),
                           input_nums.data(), device_num);
   auto ret =
       bmrt_launch_tensor_ex(p_bmrt, name_embed.c_str(),
-                            inputs_embed_512.data(), inputs_embed_512.size(),
-                            outputs_embed_512.data(), outputs_embed_512.size(),
+                            inputs_embed.data(), inputs_embed.size(),
+                            outputs_embed.data(), outputs_embed.size(),
                             true, false);
   assert(ret);
-  bm_thread_sync(bm_handle);
+  debug_sync();
 
   // forward blocks
+  auto pid = inputs_pid;
+  auto attention = inputs_attention;
+  int in_num = net_blocks[0]->input_num / device_num;
+  for (int i = 0; i < device_num; ++i) {
+    pid[i].shape =
+        net_blocks[0]->stages[block_stage].input_shapes[1 + i * in_num];
+    attention[i].shape =
+        net_blocks[0]->stages[block_stage].input_shapes[2 + i * in_num];
+  }
   std::vector<void*> pos_id_datas(device_num, position_id.data());
   std::vector<void*> in_attn_datas(device_num, attention_mask.data());
-  bmrt_memcpy_s2d_parallel(p_bmrt, inputs_pid.data(), pos_id_datas.data(),
+  bmrt_memcpy_s2d_parallel(p_bmrt, pid.data(), pos_id_datas.data(),
                           input_nums.data(), device_num);
-  bmrt_memcpy_s2d_parallel(p_bmrt, inputs_attention.data(),in_attn_datas.data(),
+  bmrt_memcpy_s2d_parallel(p_bmrt, attention.data(), in_attn_datas.data(),
                           input_nums.data(), device_num);
   auto embed_512 = outputs_embed_512;
   std::vector<bm_tensor_t> inputs_block;
   std::vector<bm_tensor_t> outputs_block;
+  int out_num = net_blocks[0]->output_num / device_num;
   for (int i = 0; i < device_num; ++i) {
-    embed_512[i].shape = net_blocks[0]->stages[0].input_shapes[0];
+    embed_512[i].shape = net_blocks[0]->stages[block_stage].input_shapes[0];
     inputs_block.push_back(embed_512[i]);
-    inputs_block.push_back(inputs_pid[i]);
-    inputs_block.push_back(inputs_attention[i]);
+    inputs_block.push_back(pid[i]);
+    inputs_block.push_back(attention[i]);
     outputs_block.push_back(embed_512[i]);
     outputs_block.push_back(past_key[0][i]);
     outputs_block.push_back(past_value[0][i]);
   }
 
+  // stage rows land at the head of the full-length cache
   for (int i = 0; i < NUM_LAYERS; i++) {
     for (int j = 0; j < device_num; ++j) {
       outputs_block[1 + j * 3] = past_key[i][j];
+      outputs_block[1 + j * 3].shape =
+          net_blocks[0]->stages[block_stage].output_shapes[1 + j * out_num];
       outputs_block[2 + j * 3] = past_value[i][j];
+      outputs_block[2 + j * 3].shape =
+          net_blocks[0]->stages[block_stage].output_shapes[2 + j * out_num];
     }
     ret = bmrt_launch_tensor_ex(p_bmrt, name_blocks[i].c_str(),
                                 inputs_block.data(), inputs_block.size(),
                                 outputs_block.data(), outputs_block.size(),
                                 true, false);
     assert(ret);
-    bm_thread_sync(bm_handle);
+    debug_sync();
   }
+}
+
+int Qwen::forward_first(std::vector<int> &tokens) {
+  prefill(tokens);
 
   // forward lmhead
-  int bytes = embed_512[0].device_mem.size / SEQLEN;
-  bm_memcpy_d2d_byte(bm_handle, inputs_lm[0].device_mem, 0,
-                     embed_512[0].device_mem, (token_length - 1) * bytes,
-                     bytes);
-  ret = bmrt_launch_tensor_ex(p_bmrt, name_lm.c_str(), &inputs_lm[0], 1,
-                              &outputs_lm[0], 1, true, false);
+  auto &embed_mem = outputs_embed_512[0].device_mem;
+  int bytes = embed_mem.size / SEQLEN;
+  bm_memcpy_d2d_byte(bm_handle, inputs_lm[0].device_mem, 0, embed_mem,
+                     (token_length - 1) * bytes, bytes);
+  auto ret = bmrt_launch_tensor_ex(p_bmrt, name_lm.c_str(), &inputs_lm[0], 1,
+                                   &outputs_lm[0], 1, true, false);
+  assert(ret);
   bm_thread_sync(bm_handle);
 
   int token = 0;
@@ -351,6 +423,7 @@ int Qwen::forward_first(std::vector<int> &tokens) {
 }
 
 int Qwen::forward_next(int cur_token) {
+  assert(token_length < SEQLEN);
   token_length += 1;
 
   std::vector<uint16_t> attention_mask(SEQLEN + 1, 0);
@@ -374,7 +447,7 @@ int Qwen::forward_next(int cur_token) {
                                   inputs_embed.data(), inputs_embed.size(),
                                   inputs_lm.data(), inputs_lm.size(), true, false);
   assert(ret);
-  bm_thread_sync(bm_handle);
+  debug_sync();
 
   // forward blocks
   std::vector<void*> attn_datas(device_num, attention_mask.data());
@@ -418,7 +491,7 @@ int Qwen::forward_next(int cur_token) {
                                 outputs_block.data(), outputs_block.size(),
                                 true, false);
     assert(ret);
-    bm_thread_sync(bm_handle);
+    debug_sync();
   }
 
   // forward lmhead
@@ -432,79 +505,31 @@ int Qwen::forward_next(int cur_token) {
   return token;
 }
 
-int Qwen::forward_first_with_topk(std::vector<int> &tokens, std::string mode) {
-  std::vector<int> input_ids(SEQLEN, 0);
-  std::vector<int> position_id(SEQLEN, 0);
-  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN, ATTENTION_MASK);
-  std::copy(tokens.begin(), tokens.end(), input_ids.data());
-
-  token_length = tokens.size();
-
-  for (int i = 0; i < token_length; i++) {
-    position_id[i] = i;
-  }
-  for (int i = 0; i < token_length; i++) {
-    for (int j = 0; j < SEQLEN; j++) {
-      if (j <= i) {
-        attention_mask[i * SEQLEN + j] = 0;
-      }
-    }
-  }
-
-  // forward embeding
-  std::vector<int> input_nums(device_num, 1);
-  std::vector<void*> datas(device_num, (void*)input_ids.data());
-  bmrt_memcpy_s2d_parallel(p_bmrt, inputs_embed_512.data(), datas.data(),
-                          input_nums.data(), device_num);
-  auto ret =
-      bmrt_launch_tensor_ex(p_bmrt, name_embed.c_str(),
-                            inputs_embed_512.data(), inputs_embed_512.size(),
-                            outputs_embed_512.data(), outputs_embed_512.size(),
-                            true, false);
-  assert(ret);
-  bm_thread_sync(bm_handle);
-
-  // forward blocks
-  std::vector<void*> pos_id_datas(device_num, position_id.data());
-  std::vector<void*> in_attn_datas(device_num, attention_mask.data());
-  bmrt_memcpy_s2d_parallel(p_bmrt, inputs_pid.data(), pos_id_datas.data(),
-                          input_nums.data(), device_num);
-  bmrt_memcpy_s2d_parallel(p_bmrt, inputs_attention.data(),in_attn_datas.data(),
-                          input_nums.data(), device_num);
-  auto embed_512 = outputs_embed_512;
-  std::vector<bm_tensor_t> inputs_block;
-  std::vector<bm_tensor_t> outputs_block;
-  for (int i = 0; i < device_num; ++i) {
-    embed_512[i].shape = net_blocks[0]->stages[0].input_shapes[0];
-    inputs_block.push_back(embed_512[i]);
-    inputs_block.push_back(inputs_pid[i]);
-    inputs_block.push_back(inputs_attention[i]);
-    outputs_block.push_back(embed_512[i]);
-    outputs_block.push_back(past_key[0][i]);
-    outputs_block.push_back(past_value[0][i]);
+// Append tokens after the KV cache one by one through block_cache_i and
+// return the token after the last, so a follow-up turn or a restored session
+// only computes the new tokens instead of prefilling the whole history again.
+int Qwen::forward_append(std::vector<int> &tokens) {
+  assert(!tokens.empty() && token_length + (int)tokens.size() <= SEQLEN);
+  int token = 0;
+  for (int cur_token : tokens) {
+    token = forward_next(cur_token);
   }
+  return token;
+}
 
-  for (int i = 0; i < NUM_LAYERS; i++) {
-    for (int j = 0; j < device_num; ++j) {
-      outputs_block[1 + j * 3] = past_key[i][j];
-      outputs_block[2 + j * 3] = past_value[i][j];
-    }
-    ret = bmrt_launch_tensor_ex(p_bmrt, name_blocks[i].c_str(),
-                                inputs_block.data(), inputs_block.size(),
-                                outputs_block.data(), outputs_block.size(),
-                                true, false);
-    assert(ret);
-    bm_thread_sync(bm_handle);
-  }
+int Qwen::forward_first_with_topk(std::vector<int> &tokens, std::string mode) {
+  prefill(tokens);
 
   // forward lmhead
-  int bytes = embed_512[0].device_mem.size / SEQLEN;
+  auto &embed_mem = outputs_embed_512[0].device_mem;
+  int bytes = embed_mem.size / SEQLEN;
   std::vector<bm_tensor_t> outputs_lm{outputs_logit_lm[0], outputs_token_lm[0]};
-  bm_memcpy_d2d_byte(bm_handle, inputs_lm[0].device_mem, 0,
-                     embed_512[0].device_mem, (token_length - 1) * bytes,
-                     bytes);
-  ret = bmrt_launch_tensor_ex(p_bmrt, name_lm.c_str(), &inputs_lm[0], 1,
-                              outputs_lm.data(), outputs_lm.size(), true, false);
+  bm_memcpy_d2d_byte(bm_handle, inputs_lm[0].device_mem, 0, embed_mem,
+                     (token_length - 1) * bytes, bytes);
+  auto ret = bmrt_launch_tensor_ex(p_bmrt, name_lm.c_str(), &inputs_lm[0], 1,
+                                   outputs_lm.data(), outputs_lm.size(), true,
+                                   false);
+  assert(ret);
   bm_thread_sync(bm_handle);
 
 
@@ -554,7 +579,7 @@ int Qwen::forward_next_with_topk(int cur_token, std::string mode) {
                                   inputs_embed.data(), inputs_embed.size(),
                                   inputs_lm.data(), inputs_lm.size(), true, false);
   assert(ret);
-  bm_thread_sync(bm_handle);
+  debug_sync();
 
   // forward blocks
   std::vector<void*> attn_datas(device_num, attention_mask.data());
@@ -598,7 +623,7 @@ int Qwen::forward_next_with_topk(int cur_token, std::string mode) {
                                 outputs_block.data(), outputs_block.size(),
                                 true, false);
     assert(ret);
-    bm_thread_sync(bm_handle);
+    debug_sync();
   }
 
   // forward lmhead
@@ -651,16 +676,65 @@ std::vector<int> Qwen::answer(std::vector<int> history_tokens) {
   return result_tokens;
 }
 
+SessionHeader Qwen::session_header() {
+  SessionHeader header = {};
+  header.model_hash = model_hash;
+  header.dtype = net_blocks_cache[0]->input_dtypes[3];
+  header.seqlen = SEQLEN;
+  header.num_layers = NUM_LAYERS;
+  header.token_length = token_length;
+  return header;
+}
+
+// one entry per KV tensor: a session file holds only the first token_length
+// rows of each, so they can't go in one copy of all the KV
+std::vector<SessionTensor> Qwen::session_tensors() {
+  std::vector<SessionTensor> tensors;
+  for (int i = 0; i < NUM_LAYERS; i++) {
+    for (int j = 0; j < device_num; j++) {
+      tensors.push_back({handles[j], past_key[i][j].device_mem});
+      tensors.push_back({handles[j], past_value[i][j].device_mem});
+    }
+  }
+  return tensors;
+}
+
+// save the KV cache of the current conversation, tokens are the ids it holds
+bool Qwen::save_session(const std::string &path, std::vector<int> &tokens) {
+  for (auto h : handles) {
+    bm_thread_sync(h);
+  }
+  return save_session_file(path, session_header(), tokens, session_tensors());
+}
+
+// restore a saved conversation, its token ids are put in session_tokens
+bool Qwen::load_session(const std::string &path) {
+  auto header = session_header();
+  if (!load_session_file(path, header, session_tokens, session_tensors())) {
+    return false;
+  }
+  token_length = header.token_length;
+  return true;
+}
+
 PYBIND11_MODULE(chat, m) {
     pybind11::class_<Qwen>(m, "Qwen")
         .def(pybind11::init<>())
         .def("init", &Qwen::init)
         .def_readwrite("SEQLEN", &Qwen::SEQLEN) // read SEQLEN in pipeline.py
+        .def_readwrite("layer_sync", &Qwen::layer_sync)
+        .def_readwrite("arena_compare", &Qwen::arena_compare)
         .def("forward_first", &Qwen::forward_first)
         .def("forward_next", &Qwen::forward_next)
+        .def("forward_append", &Qwen::forward_append)
         .def("forward_first_with_topk", &Qwen::forward_first_with_topk)
         .def("forward_next_with_topk", &Qwen::forward_next_with_topk)
         .def("answer", &Qwen::answer)
+        .def("save_session", &Qwen::save_session, pybind11::arg("path"),
+             pybind11::arg("tokens") = std::vector<int>())
+        .def("load_session", &Qwen::load_session)
+        .def_readonly("session_tokens", &Qwen::session_tokens)
+        .def_readonly("token_length", &Qwen::token_length)
         .def("deinit", &Qwen::deinit);
 }
 
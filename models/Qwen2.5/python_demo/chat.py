@@ -1,3 +1,5 @@
+import os
+import json
 import time
 import argparse
 from transformers import AutoTokenizer
@@ -12,7 +14,7 @@ class Engine:
         self.messages = [{"role": "system", "content": self.system_prompt}]
 
         # model parameters
-        self.token_length = 0
+        self.history_tokens = [] # tokens in the KV cache
 
         # postprocess parameters
         self.mode = "greedy"
@@ -25,8 +27,18 @@ class Engine:
         # load model
         devices = [int(d) for d in args.devid.split(",")]
         self.model = chat.Qwen()
+        self.model.arena_compare = args.arena_compare
         self.model.init(devices, self.sp.eos_token_id, args.model_path)
 
+        # restore the conversation of a saved session, the next question is
+        # appended to its KV cache
+        self.session = args.session
+        if self.session and os.path.exists(self.session):
+            if self.model.load_session(self.session):
+                self.history_tokens = list(self.model.session_tokens)
+                with open(self.session + ".json") as f:
+                    self.messages = json.load(f)
+
         # warm up
         self.sp.decode([0])
         print("Done!")
@@ -36,6 +48,7 @@ class Engine:
         while True:
             self.input_str = input("\nQuestion: ")
             if self.input_str in ["exit","quit"]:
+                self.save_session()
                 break
 
             # tokens_with_template = self.generate_tokens(self.input_str)
@@ -54,6 +67,13 @@ class Engine:
             # res = self.model.answer(tokens)
             # print(self.sp.decode(res))
 
+    def save_session(self):
+        if not self.session or not self.history_tokens:
+            return
+        if self.model.save_session(self.session, self.history_tokens):
+            with open(self.session + ".json", "w") as f:
+                json.dump(self.messages, f, ensure_ascii=False)
+
     def stream_answer(self, tokens):
         tok_num = 0
         self.answer_cur = ""
@@ -61,19 +81,27 @@ class Engine:
         if not tokens:
             print("Sorry: your question is too wierd!!")
             return
-        if self.token_length > self.model.SEQLEN:
-            print("The maximum question length should be shorter than {} but we get {} instead.".format(self.model.SEQLEN, self.token_length))
+        if len(tokens) >= self.model.SEQLEN:
+            print("The maximum question length should be shorter than {} but we get {} instead.".format(self.model.SEQLEN, len(tokens)))
             return
 
-        # First token
+        # First token, a follow-up turn only appends its new tokens to the
+        # KV cache when the conversation so far is its prefix
         first_start = time.time()
-        token = self.forward_first(tokens)
+        history = self.history_tokens
+        if history and len(history) < len(tokens) \
+                and tokens[:len(history)] == history:
+            token = self.forward_append(tokens[len(history):])
+        else:
+            token = self.forward_first(tokens)
+        self.history_tokens = list(tokens)
         first_end = time.time()
 
         # Following tokens
         full_word_tokens = []
-        while token != self.EOS and self.token_length < self.model.SEQLEN:
+        while token != self.EOS and self.model.token_length < self.model.SEQLEN:
             full_word_tokens.append(token)
+            self.history_tokens.append(token)
             diff = self.sp.decode(full_word_tokens, skip_special_tokens=True)
             if "�" in diff:
                 token = self.forward_next(token)
@@ -81,8 +109,6 @@ class Engine:
                 continue
             self.answer_cur += diff
             print(diff, flush=True, end='')
-            if self.token_length < self.model.SEQLEN:
-                self.token_length += 1
             token = self.forward_next(token)
             tok_num += 1
             full_word_tokens = []
@@ -93,11 +119,12 @@ class Engine:
         next_duration = next_end - first_end
         tps = tok_num / next_duration
 
-        if self.token_length >= self.model.SEQLEN:
+        if self.model.token_length >= self.model.SEQLEN:
             print("... (reach the maximal length)", flush=True, end='')
             self.messages = [{"role": "system", "content": self.system_prompt}]
             self.messages.append({"role": "user", "content": self.input_str})
             self.messages.append({"role": "assistant", "content": self.answer_cur})
+            self.history_tokens = []
         else:
             self.messages.append({"role": "assistant", "content": self.answer_cur})
 
@@ -112,6 +139,14 @@ class Engine:
             token = self.model.forward_first_with_topk(tokens, self.mode)
         return token
 
+    def forward_append(self, tokens):
+        if self.mode == "greedy":
+            return self.model.forward_append(tokens)
+        # the last new token is sampled from like a decode step
+        if len(tokens) > 1:
+            self.model.forward_append(tokens[:-1])
+        return self.model.forward_next_with_topk(tokens[-1], self.mode)
+
     def forward_next(self, token):
         if self.mode == "greedy":
             token = self.model.forward_next(token)
@@ -128,5 +163,7 @@ if __name__ == "__main__":
     parser.add_argument('--devid', type=str, default='0', help='Device ID to use.')
     parser.add_argument('--model_path', type=str, help='Path to the bmodel file.')
     parser.add_argument('--tokenizer_path', type=str, help='Path to the tokenizer file.')
+    parser.add_argument('--arena_compare', action='store_true', help='Also time one device allocation per buffer at init and print both.')
+    parser.add_argument('--session', type=str, default="", help='Restore the conversation from this file if it exists, save it on exit.')
     args = parser.parse_args()
     main(args)
@@ -17,6 +17,7 @@
 #include <pybind11/stl.h>
 #include "memory.h"
 #include "bmruntime_interface.h"
+#include "attention_mask.h"
 #include <getopt.h>
 #include <stdio.h>
 #include <inttypes.h>
@@ -174,20 +175,14 @@ void Qwen2::deinit() {
 
 int Qwen2::forward_first(std::vector<int> &tokens) {
   std::vector<int> position_id(SEQLEN, 0);
-  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN, mask_value);
+  std::vector<uint16_t> attention_mask(SEQLEN * SEQLEN);
   std::copy(tokens.begin(), tokens.end(), visited_tokens.data());
   token_length = tokens.size();
 
   for (int i = 0; i < token_length; i++) {
     position_id[i] = i; 
   }
-  for (int i = 0; i < token_length; i++) {
-    for (int j = 0; j < SEQLEN; j++) {
-      if (j <= i) {
-        attention_mask[i * SEQLEN + j] = 0;
-      }
-    }
-  }
+  build_prefill_mask(attention_mask.data(), token_length, SEQLEN, mask_value);
 
   // forward embeding
   auto &in_mem = net_embed->stages[0].input_mems[0];
@@ -0,0 +1,245 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2023 Sophgo Technologies Inc.  All rights reserved.
+//
+// TPU-MLIR is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <vector>
+#include "bmruntime_interface.h"
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// fill n halves with value, NEON on the SoC host, AVX2/SSE2 on PCIe hosts
+static inline void fill_u16(uint16_t *dst, uint16_t value, size_t n) {
+  size_t i = 0;
+#if defined(__ARM_NEON)
+  uint16x8_t v = vdupq_n_u16(value);
+  for (; i + 8 <= n; i += 8) {
+    vst1q_u16(dst + i, v);
+  }
+#elif defined(__AVX2__)
+  __m256i v = _mm256_set1_epi16((short)value);
+  for (; i + 16 <= n; i += 16) {
+    _mm256_storeu_si256((__m256i *)(dst + i), v);
+  }
+#elif defined(__SSE2__)
+  __m128i v = _mm_set1_epi16((short)value);
+  for (; i + 8 <= n; i += 8) {
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = value;
+  }
+}
+
+// Mask of chunk new tokens following history cached rows, for block_chunk_i
+// which concatenates seqlen cache rows and the chunk: chunk x (seqlen + chunk),
+// row i sees the history and the new tokens up to itself.
+static inline void build_chunk_mask(std::vector<uint16_t> &mask, int history,
+                                    int chunk, int seqlen,
+                                    uint16_t mask_value) {
+  int width = seqlen + chunk;
+  mask.resize((size_t)chunk * width);
+  for (int i = 0; i < chunk; i++) {
+    uint16_t *row = &mask[(size_t)i * width];
+    fill_u16(row, 0, history);
+    fill_u16(row + history, mask_value, seqlen - history);
+    fill_u16(row + seqlen, 0, i + 1);
+    fill_u16(row + seqlen + i + 1, mask_value, chunk - i - 1);
+  }
+}
+
+// Row i of the prefill causal mask, seqlen x seqlen: it sees columns [0, i]
+// when i < length and nothing otherwise.
+static inline void fill_prefill_row(uint16_t *row, int i, int length,
+                                    int seqlen, uint16_t mask_value) {
+  if (i < length) {
+    fill_u16(row, 0, i + 1);
+    fill_u16(row + i + 1, mask_value, seqlen - i - 1);
+  } else {
+    fill_u16(row, mask_value, seqlen);
+  }
+}
+
+// The whole prefill causal mask of length tokens into seqlen x seqlen mask.
+static inline void build_prefill_mask(uint16_t *mask, int length, int seqlen,
+                                      uint16_t mask_value) {
+  for (int i = 0; i < seqlen; i++) {
+    fill_prefill_row(mask + (size_t)i * seqlen, i, length, seqlen, mask_value);
+  }
+}
+
+// Prefill causal mask kept between calls.
+// Row i only depends on whether i < length, so going from the previous
+// length to a new one only rewrites the rows in between. One host buffer is
+// kept per seqlen (prefill stage); the mask value fixes the dtype.
+class PrefillMask {
+public:
+  explicit PrefillMask(uint16_t mask_value = 0) : mask_value(mask_value) {}
+
+  // update the buffer of seqlen to length, return the mask
+  const uint16_t *build(int length, int seqlen) {
+    auto &buf = buffer(seqlen);
+    int begin = std::min(buf.length, length);
+    int end = std::max(buf.length, length);
+    for (int i = begin; i < end; i++) {
+      fill_prefill_row(&buf.host[(size_t)i * seqlen], i, length, seqlen,
+                       mask_value);
+    }
+    buf.dirty_begin = std::min(buf.dirty_begin, begin);
+    buf.dirty_end = std::max(buf.dirty_end, end);
+    buf.length = length;
+    return buf.host.data();
+  }
+
+  // Upload the mask of seqlen to mem. When mem still holds what the last
+  // upload of this buffer wrote (resident), only the dirty rows are sent.
+  void upload(bm_handle_t handle, bm_device_mem_t mem, int seqlen,
+              bool resident) {
+    auto &buf = buffer(seqlen);
+    auto addr = bm_mem_get_device_addr(mem);
+    size_t row_bytes = seqlen * sizeof(uint16_t);
+    auto it = device_seqlen.find(addr);
+    if (resident && it != device_seqlen.end() && it->second == seqlen) {
+      if (buf.dirty_begin < buf.dirty_end) {
+        size_t size = (buf.dirty_end - buf.dirty_begin) * row_bytes;
+        bm_memcpy_s2d_partial_offset(handle, mem,
+                                     &buf.host[buf.dirty_begin * seqlen],
+                                     size, buf.dirty_begin * row_bytes);
+        uploaded_bytes += size;
+      }
+    } else {
+      bm_memcpy_s2d_partial(handle, mem, buf.host.data(), seqlen * row_bytes);
+      uploaded_bytes += seqlen * row_bytes;
+    }
+    device_seqlen[addr] = seqlen;
+    buf.dirty_begin = seqlen;
+    buf.dirty_end = 0;
+  }
+
+  uint64_t uploaded_bytes = 0;
+
+private:
+  struct Buffer {
+    std::vector<uint16_t> host;
+    int length;      // rows built as visible
+    int dirty_begin; // rows changed since the last upload
+    int dirty_end;
+  };
+
+  Buffer &buffer(int seqlen) {
+    auto it = buffers.find(seqlen);
+    if (it == buffers.end()) {
+      auto &buf = buffers[seqlen];
+      buf.host.assign((size_t)seqlen * seqlen, mask_value);
+      buf.length = 0;
+      buf.dirty_begin = 0;
+      buf.dirty_end = seqlen;
+      return buf;
+    }
+    return it->second;
+  }
+
+  uint16_t mask_value;
+  std::map<int, Buffer> buffers;
+  std::map<unsigned long long, int> device_seqlen; // last seqlen per mem
+};
+
+// Keeps the decode position id & mask resident on the device.
+// The mask has SEQLEN + 1 elements: one per cache row and a last one for the
+// new token itself. A decode step only unmasks one more cache row, so only
+// the elements that changed are uploaded; reset() rewrites the whole mask,
+// after prefill or when the cache rows are rearranged.
+// Nets exported with the mask built in graph take the number of visible rows
+// as an int32 scalar instead (scalar = true), then only 4 bytes are sent.
+class DecodeMask {
+public:
+  void init(bm_handle_t handle, bm_device_mem_t pid_mem,
+            bm_device_mem_t mask_mem, int seqlen, uint16_t mask_value,
+            bool scalar = false) {
+    bm_handle = handle;
+    this->pid_mem = pid_mem;
+    this->mask_mem = mask_mem;
+    this->seqlen = seqlen;
+    this->mask_value = mask_value;
+    this->scalar = scalar;
+    host.assign(seqlen + 1, mask_value);
+    host[seqlen] = 0;
+    visible = 0;
+  }
+
+  // rows [0, length) visible, full upload
+  void reset(int length) {
+    if (scalar) {
+      upload_length(length);
+      return;
+    }
+    std::fill(host.begin(), host.begin() + length, 0);
+    std::fill(host.begin() + length, host.end() - 1, mask_value);
+    visible = length;
+    upload(0, seqlen + 1);
+  }
+
+  // rows [0, length) visible, upload only the rows that flipped
+  void update(int length) {
+    if (scalar) {
+      if (length != visible) {
+        upload_length(length);
+      }
+      return;
+    }
+    if (length > visible) {
+      std::fill(host.begin() + visible, host.begin() + length, 0);
+      upload(visible, length);
+    } else if (length < visible) {
+      std::fill(host.begin() + length, host.begin() + visible, mask_value);
+      upload(length, visible);
+    }
+    visible = length;
+  }
+
+  void set_position(int position_id) {
+    bm_memcpy_s2d_partial(bm_handle, pid_mem, (void *)&position_id,
+                          sizeof(int));
+    uploaded_bytes += sizeof(int);
+  }
+
+  int visible_rows() const { return visible; }
+  const uint16_t *data() const { return host.data(); }
+
+  uint64_t uploaded_bytes = 0;
+
+private:
+  void upload_length(int length) {
+    bm_memcpy_s2d_partial(bm_handle, mask_mem, (void *)&length, sizeof(int));
+    uploaded_bytes += sizeof(int);
+    visible = length;
+  }
+
+  void upload(int begin, int end) {
+    unsigned int size = (end - begin) * sizeof(uint16_t);
+    bm_memcpy_s2d_partial_offset(bm_handle, mask_mem, (void *)&host[begin],
+                                 size, begin * sizeof(uint16_t));
+    uploaded_bytes += size;
+  }
+
+  bm_handle_t bm_handle;
+  bm_device_mem_t pid_mem;
+  bm_device_mem_t mask_mem;
+  int seqlen;
+  uint16_t mask_value;
+  bool scalar;
+  std::vector<uint16_t> host; // mirrors the mask on the device
+  int visible;                // cache rows visible on the device
+};
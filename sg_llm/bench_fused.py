@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+# Prefill & decode of one bmodel with and without the fused nets of
+# compile.sh --fuse_decode --fuse_prefill: launches per token drop from
+# NUM_LAYERS + 2 to 1, the time difference is the launch overhead removed.
+# Usage: python3 bench_fused.py --model your.bmodel [--prompt 256] [--steps 128]
+import time
+import argparse
+
+from python import sg_llm
+
+def run(model, fused, prompt, steps):
+    model.fused_prefill = fused
+    model.fused_decode = fused
+    launches = model.launches
+    start = time.time()
+    token = model.forward_first(prompt)
+    prefill = time.time() - start
+    prefill_launches = model.launches - launches
+
+    launches = model.launches
+    start = time.time()
+    tokens = [token]
+    for _ in range(steps):
+        tokens.append(model.forward_next(tokens[-1]))
+    decode = time.time() - start
+    decode_launches = (model.launches - launches) / steps
+    print(f"{'fused' if fused else 'per layer':>9}: "
+          f"prefill {prefill * 1000:.1f} ms / {prefill_launches} launches, "
+          f"decode {decode * 1000 / steps:.2f} ms / {decode_launches:.0f} "
+          f"launches per token")
+    return tokens
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--model', type=str, help='Path to a bmodel compiled with --fuse_decode and/or --fuse_prefill.')
+    parser.add_argument('--prompt', type=int, default=256, help='Prompt tokens of the prefill.')
+    parser.add_argument('--steps', type=int, default=128, help='Decode steps timed.')
+    args = parser.parse_args()
+
+    model = sg_llm.sg_llm(args.model)
+    model.prefix_cache_budget = 0
+    steps = min(args.steps, model.MAX_SEQLEN - args.prompt - 1)
+    prompt = [(i * 37 + 100) % 20000 for i in range(args.prompt)]
+    run(model, True, prompt, 8) # warm up
+    ref = run(model, False, prompt, steps)
+    out = run(model, True, prompt, steps)
+    # fused graphs may round differently, report where the tokens part
+    same = next((i for i, (a, b) in enumerate(zip(ref, out)) if a != b),
+                len(ref))
+    print(f"{same}/{len(ref)} tokens same as per layer decoding")
@@ -0,0 +1,90 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2023 Sophgo Technologies Inc.  All rights reserved.
+//
+// TPU-MLIR is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+// Host side micro-benchmark of the prefill causal mask: the per-prefill
+// double loop used by forward_first before PrefillMask, against
+// PrefillMask::build. Usage: bench_mask [seqlen] [rounds]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "attention_mask.h"
+
+static const uint16_t ATTENTION_MASK = 0xF0E2; // -10000 by float16
+
+static std::vector<uint16_t> loop_mask(int length, int seqlen) {
+  std::vector<uint16_t> attention_mask(seqlen * seqlen, ATTENTION_MASK);
+  for (int i = 0; i < length; i++) {
+    for (int j = 0; j < seqlen; j++) {
+      if (j <= i) {
+        attention_mask[i * seqlen + j] = 0;
+      }
+    }
+  }
+  return attention_mask;
+}
+
+template <typename F> static double time_ms(F func) {
+  auto start = std::chrono::high_resolution_clock::now();
+  func();
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main(int argc, char **argv) {
+  int seqlen = argc > 1 ? atoi(argv[1]) : 2048;
+  int rounds = argc > 2 ? atoi(argv[2]) : 32;
+
+  // multi-turn chat: the prompt grows a little every round, plus random
+  // unrelated prompts
+  std::vector<int> lengths;
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<int> grow(16, 96);
+  std::uniform_int_distribution<int> any(1, seqlen);
+  int length = 32;
+  for (int i = 0; i < rounds; i++) {
+    length = std::min(seqlen, length + grow(gen));
+    lengths.push_back(i % 4 == 3 ? any(gen) : length);
+  }
+
+  // check both give the same mask
+  PrefillMask prefill_mask(ATTENTION_MASK);
+  for (auto l : lengths) {
+    auto ref = loop_mask(l, seqlen);
+    auto mask = prefill_mask.build(l, seqlen);
+    if (memcmp(ref.data(), mask, ref.size() * sizeof(uint16_t)) != 0) {
+      printf("Error: mask mismatch at length %d\n", l);
+      return 1;
+    }
+  }
+
+  volatile uint16_t sink = 0;
+  double loop = time_ms([&]() {
+    for (auto l : lengths) {
+      auto mask = loop_mask(l, seqlen);
+      sink = sink + mask[(size_t)l * seqlen / 2];
+    }
+  });
+  PrefillMask bench_mask(ATTENTION_MASK);
+  double cached = time_ms([&]() {
+    for (auto l : lengths) {
+      auto mask = bench_mask.build(l, seqlen);
+      sink = sink + mask[(size_t)l * seqlen / 2];
+    }
+  });
+
+  printf("seqlen %d, %d prefills\n", seqlen, rounds);
+  printf("loop   : %8.3f ms/prefill\n", loop / rounds);
+  printf("cached : %8.3f ms/prefill (%.1fx)\n", cached / rounds,
+         loop / cached);
+  return 0;
+}
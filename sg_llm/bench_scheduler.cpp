@@ -0,0 +1,265 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2023 Sophgo Technologies Inc.  All rights reserved.
+//
+// TPU-MLIR is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+// Host side run of Scheduler on a stand-in engine that sleeps like the TPU
+// would, no device needed. Checks every request gets the tokens it would get
+// alone, also in a second turn of the same conversation, and compares first
+// token latency of the short prompts with serving one request after another.
+// Usage: bench_scheduler [requests] [decode_us] [prefill_us_per_token]
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+#include "scheduler.h"
+
+// next token is a hash of the whole history, so mixing up sessions shows.
+// Sessions beyond MAX_SESSIONS stand for ones swapped out to host.
+class HostEngine {
+public:
+  // max_tokens: KV rows of all sessions together like the page pool of a
+  // paged sg_llm, 0 for no limit
+  HostEngine(int decode_us, int prefill_us, int max_sessions, int max_swapped,
+             int max_tokens = 0)
+      : MAX_SESSIONS(max_sessions), decode_us(decode_us),
+        prefill_us(prefill_us), max_swapped(max_swapped),
+        max_tokens(max_tokens) {
+    sessions[0];
+  }
+
+  int create_session() {
+    if ((int)sessions.size() >= MAX_SESSIONS + max_swapped) {
+      return -1;
+    }
+    sessions[next_session];
+    return next_session++;
+  }
+
+  void close_session(int id) {
+    if (id == session) {
+      switch_session(0);
+    }
+    sessions.erase(id);
+  }
+
+  void clear_session(int id) {
+    if (id == session) {
+      history.clear();
+      token_length = 0;
+    } else {
+      sessions[id].clear();
+    }
+  }
+
+  bool prefetch(int id) { return sessions.count(id) > 0; }
+
+  void switch_session(int id) {
+    sessions[session] = history;
+    history = sessions[id];
+    session = id;
+    token_length = history.size();
+  }
+
+  int forward_first(std::vector<int> &tokens) {
+    history.clear();
+    return forward_append(tokens);
+  }
+
+  int forward_append(std::vector<int> &tokens) {
+    if (!fits(tokens.size())) {
+      return -1;
+    }
+    history.insert(history.end(), tokens.begin(), tokens.end());
+    token_length = history.size();
+    std::this_thread::sleep_for(
+        std::chrono::microseconds(prefill_us * tokens.size()));
+    return next();
+  }
+
+  int forward_next(int token) {
+    if (!fits(1)) {
+      return -1;
+    }
+    history.push_back(token);
+    token_length = history.size();
+    std::this_thread::sleep_for(std::chrono::microseconds(decode_us));
+    return next();
+  }
+
+  int MAX_SEQLEN = 4096;
+  int CHUNK_LENGTH = 64;
+  int MAX_SESSIONS;
+  int token_length = 0;
+  int session = 0;
+
+private:
+  bool fits(size_t num) const {
+    if (max_tokens <= 0) {
+      return true;
+    }
+    size_t used = history.size() + num;
+    for (auto &s : sessions) {
+      if (s.first != session) {
+        used += s.second.size();
+      }
+    }
+    return used <= (size_t)max_tokens;
+  }
+
+  int next() const {
+    uint32_t hash = 2166136261u;
+    for (int t : history) {
+      hash = (hash ^ t) * 16777619u;
+    }
+    return hash % 32000;
+  }
+
+  int decode_us, prefill_us, max_swapped, max_tokens;
+  int next_session = 1;
+  std::vector<int> history;
+  std::map<int, std::vector<int>> sessions;
+};
+
+struct Job {
+  std::vector<int> prompt;
+  int max_new_tokens;
+  int priority;
+  std::vector<int> expect;
+  std::vector<int> follow; // second turn
+  std::vector<int> expect_follow;
+};
+
+// generate n tokens from first on, the last one is left out of the KV
+static std::vector<int> generate(HostEngine &engine, int first, int n) {
+  std::vector<int> tokens = {first};
+  while ((int)tokens.size() < n) {
+    tokens.push_back(engine.forward_next(tokens.back()));
+  }
+  return tokens;
+}
+
+template <typename S>
+static bool collect(S &scheduler, int id, std::vector<int> &tokens,
+                    double &first_token_ms) {
+  while (true) {
+    auto r = scheduler.poll(id);
+    tokens.insert(tokens.end(), r.tokens.begin(), r.tokens.end());
+    if (r.done) {
+      first_token_ms = r.first_token_ms;
+      return !r.expired;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+int main(int argc, char **argv) {
+  int num = argc > 1 ? atoi(argv[1]) : 16;
+  int decode_us = argc > 2 ? atoi(argv[2]) : 2000;
+  int prefill_us = argc > 3 ? atoi(argv[3]) : 20;
+
+  // every fourth request has a long prompt and a long answer, the others
+  // are short interactive turns
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<int> token(0, 31999);
+  std::vector<Job> jobs(num);
+  HostEngine ref(0, 0, 1, 0);
+  for (int i = 0; i < num; i++) {
+    bool big = i % 4 == 0;
+    jobs[i].prompt.resize(big ? 2048 : 32);
+    for (auto &t : jobs[i].prompt) {
+      t = token(gen);
+    }
+    jobs[i].max_new_tokens = big ? 128 : 16;
+    jobs[i].priority = big ? 1 : 0;
+    jobs[i].expect = generate(ref, ref.forward_first(jobs[i].prompt),
+                              jobs[i].max_new_tokens);
+    jobs[i].follow.resize(16);
+    for (auto &t : jobs[i].follow) {
+      t = token(gen);
+    }
+    std::vector<int> follow = {jobs[i].expect.back()};
+    follow.insert(follow.end(), jobs[i].follow.begin(), jobs[i].follow.end());
+    jobs[i].expect_follow = generate(ref, ref.forward_append(follow), 8);
+  }
+
+  // one after another: first token latency is everything before it
+  HostEngine host(decode_us, prefill_us, 8, num);
+  double fifo_short = 0, clock_ms = 0;
+  int num_short = 0;
+  for (auto &job : jobs) {
+    double prefill = job.prompt.size() * prefill_us / 1000.0;
+    if (job.priority == 0) {
+      fifo_short += clock_ms + prefill;
+      num_short++;
+    }
+    clock_ms += prefill + (job.max_new_tokens - 1) * decode_us / 1000.0;
+  }
+
+  Scheduler<HostEngine> scheduler(host, 256);
+  std::vector<int> ids;
+  for (int i = 0; i < num; i++) {
+    ids.push_back(scheduler.submit(jobs[i].prompt, jobs[i].max_new_tokens,
+                                   jobs[i].priority, 0, -1, i));
+  }
+  double sched_short = 0, first_token_ms;
+  for (int i = 0; i < num; i++) {
+    std::vector<int> tokens;
+    if (!collect(scheduler, ids[i], tokens, first_token_ms) ||
+        tokens != jobs[i].expect) {
+      printf("Error: request %d got other tokens than alone\n", i);
+      return 1;
+    }
+    if (jobs[i].priority == 0) {
+      sched_short += first_token_ms;
+    }
+  }
+  for (int i = 0; i < num; i++) {
+    ids[i] = scheduler.submit(jobs[i].follow, 8, 0, 0, -1, i);
+  }
+  for (int i = 0; i < num; i++) {
+    std::vector<int> tokens;
+    if (!collect(scheduler, ids[i], tokens, first_token_ms) ||
+        tokens != jobs[i].expect_follow) {
+      printf("Error: second turn of %d got other tokens than alone\n", i);
+      return 1;
+    }
+    scheduler.end_conversation(i);
+  }
+  auto m = scheduler.metrics();
+  scheduler.stop();
+
+  // KV for about one big request and a few short ones: the others are
+  // preempted and prefilled again, with the same tokens in the end
+  HostEngine small(0, 0, 8, num, 2048 + 512);
+  Scheduler<HostEngine> tight(small, 256);
+  for (int i = 0; i < num; i++) {
+    ids[i] = tight.submit(jobs[i].prompt, jobs[i].max_new_tokens,
+                          jobs[i].priority, 0, -1, -1);
+  }
+  for (int i = 0; i < num; i++) {
+    std::vector<int> tokens;
+    if (!collect(tight, ids[i], tokens, first_token_ms) ||
+        tokens != jobs[i].expect) {
+      printf("Error: request %d got other tokens when preempted\n", i);
+      return 1;
+    }
+  }
+  auto preempted = tight.metrics().preempted;
+  tight.stop();
+
+  printf("%d requests, %lu tokens in %lu rounds\n", num, m.tokens, m.rounds);
+  printf("KV for %d tokens: %lu preempted\n", 2048 + 512, preempted);
+  printf("queue   : %8.1f ms/request\n", m.queue_ms / m.finished);
+  printf("compute : %8.1f ms/request\n", m.compute_ms / m.finished);
+  printf("short prompts, first token: one by one %.1f ms, scheduled %.1f ms\n",
+         fifo_short / num_short, sched_short / num_short);
+  return 0;
+}
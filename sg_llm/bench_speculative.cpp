@@ -0,0 +1,153 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2023 Sophgo Technologies Inc.  All rights reserved.
+//
+// TPU-MLIR is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+// Host side run of Speculative on stand-in engines that sleep like the TPU
+// would, no device needed. Checks the tokens are the ones greedy decoding of
+// the target alone gives, also across a second turn, and compares tokens/s.
+// The draft agrees with the target on a share of the tokens.
+// Usage: bench_speculative [verify_length] [agree_percent] [target_us]
+//                          [draft_us]
+
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "speculative.h"
+
+// next token is a hash of the whole history; a draft replaces a share of
+// them by another token, also by hash
+class HostEngine {
+public:
+  HostEngine(int pass_us, int verify_length = 0, int agree = 100)
+      : VERIFY_LENGTH(verify_length), pass_us(pass_us), agree(agree) {}
+
+  int forward_first(std::vector<int> &tokens) {
+    history.clear();
+    return forward_append(tokens);
+  }
+
+  int forward_append(std::vector<int> &tokens) {
+    history.insert(history.end(), tokens.begin(), tokens.end());
+    return pass();
+  }
+
+  int forward_next(int token) {
+    history.push_back(token);
+    return pass();
+  }
+
+  std::vector<int> forward_verify(std::vector<int> &tokens) {
+    std::vector<int> next;
+    for (int t : tokens) {
+      history.push_back(t);
+      next.push_back(predict(history));
+    }
+    token_length = history.size();
+    std::this_thread::sleep_for(std::chrono::microseconds(pass_us));
+    return next;
+  }
+
+  void rollback(int length) {
+    history.resize(length);
+    token_length = length;
+  }
+
+  int MAX_SEQLEN = 4096;
+  int VERIFY_LENGTH;
+  int token_length = 0;
+  uint64_t passes = 0;
+
+private:
+  int pass() {
+    token_length = history.size();
+    passes++;
+    std::this_thread::sleep_for(std::chrono::microseconds(pass_us));
+    return predict(history);
+  }
+
+  int predict(const std::vector<int> &h) const {
+    uint32_t hash = 2166136261u;
+    for (int t : h) {
+      hash = (hash ^ t) * 16777619u;
+    }
+    int token = hash % 32000;
+    if ((int)((hash >> 8) % 100) >= agree) {
+      token = (token + 1) % 32000;
+    }
+    return token;
+  }
+
+  int pass_us, agree;
+  std::vector<int> history;
+};
+
+static double ms_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+int main(int argc, char **argv) {
+  int k = argc > 1 ? atoi(argv[1]) : 4;
+  int agree = argc > 2 ? atoi(argv[2]) : 80;
+  int target_us = argc > 3 ? atoi(argv[3]) : 2000;
+  int draft_us = argc > 4 ? atoi(argv[4]) : 500;
+  const int num = 256;
+
+  std::vector<int> prompt(64), follow(16);
+  for (int i = 0; i < 64; i++) {
+    prompt[i] = i * 37 % 32000;
+  }
+  for (int i = 0; i < 16; i++) {
+    follow[i] = i * 91 % 32000;
+  }
+
+  HostEngine target(target_us, k), draft(draft_us, 0, agree);
+  Speculative<HostEngine, HostEngine> spec(target, draft);
+  std::vector<int> tokens = {spec.forward_first(prompt)};
+  while ((int)tokens.size() < num) {
+    auto out = spec.forward_next(tokens.back());
+    tokens.insert(tokens.end(), out.begin(), out.end());
+  }
+  std::vector<int> turn = {tokens.back()};
+  turn.insert(turn.end(), follow.begin(), follow.end());
+  std::vector<int> tokens2 = {spec.forward_append(turn)};
+  while ((int)tokens2.size() < 32) {
+    auto out = spec.forward_next(tokens2.back());
+    tokens2.insert(tokens2.end(), out.begin(), out.end());
+  }
+
+  // the target alone, as many tokens: the last step may overshoot num
+  HostEngine ref(target_us);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<int> expect = {ref.forward_first(prompt)};
+  while (expect.size() < tokens.size()) {
+    expect.push_back(ref.forward_next(expect.back()));
+  }
+  double plain_ms = ms_since(start);
+  if (tokens != expect) {
+    printf("Error: speculative tokens differ from the target alone\n");
+    return 1;
+  }
+  std::vector<int> expect2 = {ref.forward_append(turn)};
+  while (expect2.size() < tokens2.size()) {
+    expect2.push_back(ref.forward_next(expect2.back()));
+  }
+  if (tokens2 != expect2) {
+    printf("Error: second turn differs from the target alone\n");
+    return 1;
+  }
+
+  printf("verify length %d, draft agrees on %d%% of the tokens\n", k, agree);
+  printf("acceptance rate: %.2f, %.2f tokens per target pass\n",
+         spec.acceptance_rate(), (double)spec.tokens / spec.steps);
+  printf("target alone: %.1f tokens/s, speculative: %.1f tokens/s\n",
+         (expect.size() - 1) * 1000.0 / plain_ms, spec.tokens_per_second());
+  return 0;
+}
@@ -1,10 +1,42 @@
 #!/usr/bin/env python3
+import os
+import json
 import time
 import argparse
 from transformers import AutoTokenizer
 
 from python import sg_llm
 
+class EarlyExit:
+    """Self-speculative decoding: the first exit_layer blocks of the model
+    draft tokens, all of them verify, see sg_llm::forward_early_exit."""
+    def __init__(self, model, eos, exit_layer, draft_length):
+        self.model = model
+        self.eos = eos
+        model.exit_layer = exit_layer
+        model.draft_length = draft_length
+
+    def forward_first(self, tokens):
+        return self.model.forward_first(tokens)
+
+    def forward_append(self, tokens):
+        return self.model.forward_append(tokens)
+
+    def resume(self, tokens):
+        # the draft layers share the KV of the model, nothing to restore
+        pass
+
+    def forward_next(self, token):
+        return self.model.forward_early_exit(token, self.eos)
+
+    @property
+    def proposed(self):
+        return self.model.exit_proposed
+
+    @property
+    def accepted(self):
+        return self.model.exit_accepted
+
 class Engine:
     def __init__(self, args):
         # preprocess parameters, such as prompt & tokenizer
@@ -13,7 +45,7 @@ class Engine:
         self.messages = [{"role": "system", "content": self.system_prompt}]
 
         # model parameters
-        self.token_length = 0
+        self.history_tokens = [] # tokens in the KV cache
 
         # postprocess parameters
         self.mode = "greedy"
@@ -24,8 +56,35 @@ class Engine:
         self.EOS = self.tokenizer.eos_token_id
 
         self.model = sg_llm.sg_llm(args.model)
+        self.model.prefix_cache_budget = args.prefix_cache_mb << 20
         self.MAX_SEQLEN = self.model.MAX_SEQLEN
 
+        # a small model on the same tokenizer drafts tokens, the target
+        # checks VERIFY_LENGTH of them in one pass
+        self.spec = None
+        if args.draft:
+            self.draft = sg_llm.sg_llm(args.draft)
+            self.draft.prefix_cache_budget = 0
+            self.spec = sg_llm.Speculative(self.model, self.draft, self.EOS)
+        elif args.prompt_lookup:
+            # the drafts are copied from earlier tokens, no second model
+            self.spec = sg_llm.PromptLookup(self.model, self.EOS,
+                                            max_ngram=args.prompt_lookup)
+        elif args.early_exit:
+            # the first layers of the model itself draft tokens
+            self.spec = EarlyExit(self.model, self.EOS, args.early_exit,
+                                  args.draft_length)
+
+        # restore the conversation of a saved session
+        self.session = args.session
+        if self.session and os.path.exists(self.session):
+            if self.model.load_session(self.session):
+                self.history_tokens = list(self.model.session_tokens)
+                with open(self.session + ".json") as f:
+                    self.messages = json.load(f)
+                if self.spec:
+                    self.spec.resume(self.history_tokens)
+
         # warm up
         self.tokenizer.decode([0])
 
@@ -34,6 +93,7 @@ class Engine:
         while True:
             self.input_str = input("\nQuestion: ")
             if self.input_str in ["exit","quit"]:
+                self.save_session()
                 break
 
             # tokens_with_template = self.generate_tokens(self.input_str)
@@ -49,6 +109,13 @@ class Engine:
             self.stream_answer(tokens)
 
 
+    def save_session(self):
+        if not self.session or not self.history_tokens:
+            return
+        if self.model.save_session(self.session, self.history_tokens):
+            with open(self.session + ".json", "w") as f:
+                json.dump(self.messages, f, ensure_ascii=False)
+
     def stream_answer(self, tokens):
         tok_num = 0
         self.answer_cur = ""
@@ -56,24 +123,40 @@ class Engine:
         if not tokens:
             print("Sorry: your question is too wierd!!")
             return
-        if self.token_length > self.MAX_SEQLEN:
-            print("The maximum question length should be shorter than {} but we get {} instead.".format(self.MAX_SEQLEN, self.token_length))
+        if len(tokens) >= self.MAX_SEQLEN:
+            print("The maximum question length should be shorter than {} but we get {} instead.".format(self.MAX_SEQLEN, len(tokens)))
             return
 
-        # First token
+        # First token, a follow-up turn only appends its new tokens to the
+        # KV cache when the conversation so far is its prefix
+        saved_start = self.model.hidden_bytes_saved
         first_start = time.time()
-        token = self.model.forward_first(tokens)
+        history = self.history_tokens
+        if history and len(history) < len(tokens) <= self.MAX_SEQLEN \
+                and tokens[:len(history)] == history:
+            token = self.runner().forward_append(tokens[len(history):])
+        else:
+            token = self.runner().forward_first(tokens)
+        self.history_tokens = list(tokens)
         first_end = time.time()
 
-        # Following tokens
-        while token != self.EOS and self.token_length < self.MAX_SEQLEN:
+        # Following tokens, speculative decoding returns several at once
+        pending = []
+        spec_start = (self.spec.proposed, self.spec.accepted) if self.spec else None
+        # the KV cache carries over between turns, so its own length bounds
+        # the answer, not the tokens generated in this one
+        while token != self.EOS and self.model.token_length < self.MAX_SEQLEN:
             diff = self.tokenizer.decode([token])
             self.answer_cur += diff
             print(diff, flush=True, end='')
-            if self.token_length < self.MAX_SEQLEN:
-                self.token_length += 1
             tok_num += 1
-            token = self.model.forward_next(token)
+            self.history_tokens.append(token)
+            if self.spec:
+                if not pending:
+                    pending = self.spec.forward_next(token)
+                token = pending.pop(0)
+            else:
+                token = self.model.forward_next(token)
 
         # counting time
         next_end = time.time()
@@ -81,20 +164,38 @@ class Engine:
         next_duration = next_end - first_end
         tps = tok_num / next_duration
 
-        if self.token_length >= self.MAX_SEQLEN - 128:
+        if self.model.token_length >= self.MAX_SEQLEN - 128:
             print("... (reach the maximal length)", flush=True, end='')
-            self.messages = self.messages[0]
+            self.messages = [self.messages[0]]
             self.messages.append({"role": "user", "content": self.input_str})
             self.messages.append({"role": "assistant", "content": self.answer_cur})
+            self.history_tokens = []
         else:
             self.messages.append({"role": "assistant", "content": self.answer_cur})
 
-        print(f"\nFTL: {first_duration:.3f} s, TPS: {tps:.3f} token/s")
+        saved = (self.model.hidden_bytes_saved - saved_start) / (tok_num + 1)
+        print(f"\nFTL: {first_duration:.3f} s, TPS: {tps:.3f} token/s, "
+              f"hidden d2d saved: {saved / 1024:.1f} KB/token")
+        if self.spec:
+            proposed = self.spec.proposed - spec_start[0]
+            accepted = self.spec.accepted - spec_start[1]
+            rate = accepted / proposed if proposed else 0
+            print(f"Draft acceptance rate: {rate:.2f} "
+                  f"({accepted}/{proposed}), effective TPS: {tps:.3f} token/s")
+
+    def runner(self):
+        return self.spec if self.spec else self.model
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser()
     parser.add_argument('--model', type=str, help='Path to the bmodel file.')
     parser.add_argument('--tokenizer', type=str, help='Path to the tokenizer file.')
+    parser.add_argument('--session', type=str, default="", help='Restore the conversation from this file if it exists, save it on exit.')
+    parser.add_argument('--draft', type=str, default="", help='Bmodel of a small draft model on the same tokenizer for speculative decoding, the model needs block_verify.')
+    parser.add_argument('--prompt_lookup', type=int, default=0, help='Longest n-gram of prompt lookup decoding, drafts copied from the conversation so far are checked by block_verify, 0 to disable.')
+    parser.add_argument('--early_exit', type=int, default=0, help='Layers that draft tokens for self-speculative decoding, the full model checks them by block_verify, 0 to disable.')
+    parser.add_argument('--draft_length', type=int, default=0, help='Tokens drafted per step with --early_exit, below the compiled verify length, 0 for all.')
+    parser.add_argument('--prefix_cache_mb', type=int, default=64, help='Device memory for KV of shared prompt prefixes, 0 to disable.')
     args = parser.parse_args()
     engine = Engine(args)
     engine.chat()
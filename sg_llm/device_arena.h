@@ -0,0 +1,182 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2023 Sophgo Technologies Inc.  All rights reserved.
+//
+// TPU-MLIR is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include "bmruntime_interface.h"
+
+// Device buffers of the runtime carved out of one allocation per device.
+// Buffers are added with their purpose first, alloc() then makes a single
+// bm_malloc_device_byte and binds each of them to its aligned slice: startup
+// pays one allocation, nothing fragments, and free() can't miss a buffer.
+class DeviceArena {
+public:
+  static const uint64_t ALIGN = 256;
+
+  // a tensor of dtype & shape, bound by alloc()
+  void add(bm_tensor_t *tensor, bm_data_type_t dtype, const bm_shape_t &shape,
+           const char *purpose) {
+    Slot slot = {};
+    slot.tensor = tensor;
+    slot.dtype = dtype;
+    slot.shape = shape;
+    slot.size = bmrt_shape_count(&shape) * bmrt_data_type_size(dtype);
+    slot.purpose = purpose;
+    slots.push_back(slot);
+  }
+
+  // raw bytes, bound by alloc()
+  void add(bm_device_mem_t *mem, uint64_t size, const char *purpose) {
+    Slot slot = {};
+    slot.mem = mem;
+    slot.size = size;
+    slot.purpose = purpose;
+    slots.push_back(slot);
+  }
+
+  bool alloc(bm_handle_t handle) {
+    if (compare) {
+      alloc_separate(handle);
+    }
+    uint64_t heap_before = heap_used(handle);
+    auto start = std::chrono::steady_clock::now();
+    this->handle = handle;
+    bytes = 0;
+    for (auto &slot : slots) {
+      slot.offset = bytes;
+      bytes += (slot.size + ALIGN - 1) / ALIGN * ALIGN;
+    }
+    if (bytes > UINT32_MAX ||
+        BM_SUCCESS != bm_malloc_device_byte(handle, &block, bytes)) {
+      printf("Error: can't allocate %.1f MB of device memory\n",
+             bytes / 1048576.0);
+      return false;
+    }
+    auto addr = bm_mem_get_device_addr(block);
+    for (auto &slot : slots) {
+      bm_device_mem_t mem;
+      bm_set_device_mem(&mem, slot.size, addr + slot.offset);
+      if (slot.tensor) {
+        bmrt_tensor_with_device(slot.tensor, mem, slot.dtype, slot.shape);
+      } else {
+        *slot.mem = mem;
+      }
+    }
+    allocated = true;
+    alloc_ms = std::chrono::duration<double, std::milli>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+    heap_bytes = heap_used(handle) - heap_before;
+    return true;
+  }
+
+  void free() {
+    if (allocated) {
+      bm_free_device(handle, block);
+      allocated = false;
+    }
+    slots.clear();
+  }
+
+  // bytes by purpose, with the padding of the slices
+  void report(const char *name) {
+    std::map<std::string, std::pair<int, uint64_t>> usage;
+    uint64_t used = 0;
+    for (auto &slot : slots) {
+      usage[slot.purpose].first++;
+      usage[slot.purpose].second += slot.size;
+      used += slot.size;
+    }
+    printf("%s device memory: %.2f MB in 1 allocation instead of %zu, "
+           "%.3f ms\n",
+           name, bytes / 1048576.0, slots.size(), alloc_ms);
+    if (separate_ms >= 0) {
+      printf("  %zu allocations: %.3f ms, %.2f MB of heap; "
+             "1 allocation: %.3f ms, %.2f MB of heap\n",
+             slots.size(), separate_ms, separate_heap_bytes / 1048576.0,
+             alloc_ms, heap_bytes / 1048576.0);
+    }
+    for (auto &it : usage) {
+      printf("  %-12s %4d buffers %10.2f MB\n", it.first.c_str(),
+             it.second.first, it.second.second / 1048576.0);
+    }
+    printf("  %-12s %4s         %10.2f MB\n", "padding", "",
+           (bytes - used) / 1048576.0);
+  }
+
+  uint64_t bytes = 0;      // of the allocation
+  double alloc_ms = 0;     // spent in alloc()
+  uint64_t heap_bytes = 0; // device heap the allocation took
+  // before alloc(), time one allocation per buffer as the runtime used to
+  // make and free them again, report() then prints both
+  bool compare = false;
+  double separate_ms = -1;
+  uint64_t separate_heap_bytes = 0;
+
+private:
+  // bytes in use over all heaps of the device
+  static uint64_t heap_used(bm_handle_t handle) {
+    unsigned int num = 0;
+    uint64_t used = 0;
+    bm_get_gmem_total_heap_num(handle, &num);
+    for (unsigned int i = 0; i < num; i++) {
+      bm_heap_stat_byte_t stat = {};
+      if (BM_SUCCESS == bm_get_gmem_heap_stat_byte_by_id(handle, &stat, i)) {
+        used += stat.mem_used;
+      }
+    }
+    return used;
+  }
+
+  void alloc_separate(bm_handle_t handle) {
+    std::vector<bm_device_mem_t> mems;
+    uint64_t heap_before = heap_used(handle);
+    auto start = std::chrono::steady_clock::now();
+    bool ok = true;
+    for (auto &slot : slots) {
+      bm_device_mem_t mem;
+      ok = slot.size <= UINT32_MAX &&
+           BM_SUCCESS == bm_malloc_device_byte(handle, &mem, slot.size);
+      if (!ok) {
+        break;
+      }
+      mems.push_back(mem);
+    }
+    if (ok) {
+      separate_ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+      separate_heap_bytes = heap_used(handle) - heap_before;
+    }
+    for (auto &mem : mems) {
+      bm_free_device(handle, mem);
+    }
+  }
+
+  struct Slot {
+    bm_tensor_t *tensor;
+    bm_device_mem_t *mem;
+    bm_data_type_t dtype;
+    bm_shape_t shape;
+    uint64_t size;
+    uint64_t offset;
+    std::string purpose;
+  };
+
+  std::vector<Slot> slots;
+  bm_handle_t handle = 0;
+  bm_device_mem_t block;
+  bool allocated = false;
+};
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+# C-Eval val & MMLU test accuracy of two bmodels of the same model, one
+# exported with the float KV cache and one with --kv_int8 1, and how often
+# they pick the same option.
+# Usage: python3 eval_kv_int8.py --f16 float_kv.bmodel --int8 int8_kv.bmodel
+#            --tokenizer ../models/Qwen2.5/token_config
+#            [--ceval ceval-exam] [--mmlu data] [--limit 20]
+import os
+import re
+import argparse
+import pandas as pd
+from tqdm import tqdm
+from transformers import AutoTokenizer
+
+from python import sg_llm
+
+choices = ["A", "B", "C", "D"]
+
+def ceval_questions(path, limit):
+    # val has the answers, test doesn't
+    questions = []
+    val = os.path.join(path, "val")
+    for f in sorted(os.listdir(val)):
+        subject = f.replace("_val.csv", "")
+        df = pd.read_csv(os.path.join(val, f))
+        for i in range(min(limit, len(df)) if limit else len(df)):
+            row = df.loc[i]
+            prompt = "以下是中国关于{}考试的单项选择题，请选出其中的正确答案。\n\n".format(subject)
+            prompt += "{}\nA. {}\nB. {}\nC. {}\nD. {}\n答案：".format(
+                row.question, row.A, row.B, row.C, row.D)
+            questions.append(("ceval", prompt, row.answer))
+    return questions
+
+def mmlu_questions(path, limit):
+    questions = []
+    test = os.path.join(path, "test")
+    for f in sorted(os.listdir(test)):
+        subject = f.replace("_test.csv", "").replace("_", " ")
+        df = pd.read_csv(os.path.join(test, f), header=None)
+        for i in range(min(limit, len(df)) if limit else len(df)):
+            prompt = "The following are multiple choice questions (with answers) about {}.\n\n".format(subject)
+            prompt += df.iloc[i, 0]
+            for j in range(4):
+                prompt += "\n{}. {}".format(choices[j], df.iloc[i, j + 1])
+            prompt += "\nAnswer:"
+            questions.append(("mmlu", prompt, df.iloc[i, 5]))
+    return questions
+
+def predict(model, tokenizer, questions, steps=8):
+    # the first option letter of a short greedy answer
+    preds = []
+    for _, prompt, _ in tqdm(questions):
+        text = tokenizer.apply_chat_template(
+            [{"role": "user", "content": prompt}], tokenize=False,
+            add_generation_prompt=True)
+        tokens = tokenizer(text).input_ids[-(model.MAX_SEQLEN - steps):]
+        token = model.forward_first(tokens)
+        out = [token]
+        while len(out) < steps and token != tokenizer.eos_token_id:
+            token = model.forward_next(token)
+            out.append(token)
+        found = re.search("[ABCD]", tokenizer.decode(out))
+        preds.append(found.group(0) if found else "")
+    return preds
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--f16', type=str, help='Bmodel with the float kv cache.')
+    parser.add_argument('--int8', type=str, help='Bmodel of the same model exported with --kv_int8 1.')
+    parser.add_argument('--tokenizer', type=str, help='Path to the tokenizer.')
+    parser.add_argument('--ceval', type=str, default="", help='Unzipped ceval-exam directory.')
+    parser.add_argument('--mmlu', type=str, default="", help='Unpacked MMLU data directory.')
+    parser.add_argument('--limit', type=int, default=0, help='Questions per subject, 0 for all.')
+    args = parser.parse_args()
+
+    tokenizer = AutoTokenizer.from_pretrained(args.tokenizer, trust_remote_code=True)
+    questions = []
+    if args.ceval:
+        questions += ceval_questions(args.ceval, args.limit)
+    if args.mmlu:
+        questions += mmlu_questions(args.mmlu, args.limit)
+    assert questions, "give --ceval and/or --mmlu"
+
+    # one model on the device at a time
+    preds = {}
+    for name in ["f16", "int8"]:
+        model = sg_llm.sg_llm(getattr(args, name))
+        model.prefix_cache_budget = 0
+        preds[name] = predict(model, tokenizer, questions)
+        del model
+
+    for bench in ["ceval", "mmlu"]:
+        idx = [i for i, q in enumerate(questions) if q[0] == bench]
+        if not idx:
+            continue
+        acc = {name: sum(p[i] == questions[i][2] for i in idx) / len(idx)
+               for name, p in preds.items()}
+        same = sum(preds["f16"][i] == preds["int8"][i] for i in idx) / len(idx)
+        print(f"{bench}: {len(idx)} questions, f16 kv {acc['f16']:.4f}, "
+              f"int8 kv {acc['int8']:.4f}, same answer {same:.4f}")
@@ -0,0 +1,293 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2023 Sophgo Technologies Inc.  All rights reserved.
+//
+// TPU-MLIR is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <vector>
+#include "bmruntime_interface.h"
+
+// KV rows of token prefixes seen by earlier prefills, in a radix tree keyed
+// on the token ids. Every node owns the rows of its edge in one device mem:
+// [layer][key, value][row]. A new prompt copies the rows of its longest
+// cached prefix to the head of past_key/past_value and only computes the
+// rest. Leaves are evicted least recently used first to stay under budget.
+class PrefixCache {
+public:
+  void init(bm_handle_t handle, int num_layers, int row_bytes) {
+    bm_handle = handle;
+    this->num_layers = num_layers;
+    this->row_bytes = row_bytes;
+    clear();
+  }
+
+  ~PrefixCache() { clear(); }
+
+  void clear() {
+    if (root) {
+      free_tree(root.get());
+    }
+    root.reset(new Node());
+    root->parent = nullptr;
+    bytes = 0;
+  }
+
+  void set_budget(uint64_t budget) {
+    this->budget = budget;
+    clock++;
+    evict(0);
+  }
+
+  // length of the longest cached prefix of tokens, up to max_length
+  int match(const std::vector<int> &tokens, int max_length) {
+    int length = 0;
+    Node *node = root.get();
+    while (length < max_length) {
+      auto it = node->children.find(tokens[length]);
+      if (it == node->children.end()) {
+        break;
+      }
+      int n = common(it->second.get(), tokens, length, max_length);
+      length += n;
+      if (n < (int)it->second->tokens.size()) {
+        break;
+      }
+      node = it->second.get();
+    }
+    return length;
+  }
+
+  // Copy the cached rows of the first length (<= match()) tokens to the head
+  // of keys/values, a length of 0 counts as a miss.
+  void load(const std::vector<int> &tokens, int length,
+            std::vector<bm_device_mem_t> &keys,
+            std::vector<bm_device_mem_t> &values) {
+    if (budget == 0) {
+      return;
+    }
+    if (length == 0) {
+      misses++;
+      return;
+    }
+    clock++;
+    Node *node = root.get();
+    int pos = 0;
+    while (pos < length) {
+      Node *child = node->children[tokens[pos]].get();
+      int n = std::min((int)child->tokens.size(), length - pos);
+      for (int i = 0; i < num_layers; i++) {
+        copy_rows(keys[i], pos, child, 2 * i, 0, n, false);
+        copy_rows(values[i], pos, child, 2 * i + 1, 0, n, false);
+      }
+      child->last_use = clock;
+      pos += n;
+      node = child;
+    }
+    hits++;
+    hit_tokens += length;
+  }
+
+  // Cache the first length rows of keys/values as the KV of tokens.
+  void insert(const std::vector<int> &tokens, int length,
+              std::vector<bm_device_mem_t> &keys,
+              std::vector<bm_device_mem_t> &values) {
+    if (budget == 0) {
+      return;
+    }
+    clock++;
+    Node *node = root.get();
+    int pos = 0;
+    while (pos < length) {
+      auto it = node->children.find(tokens[pos]);
+      if (it == node->children.end()) {
+        break;
+      }
+      Node *child = it->second.get();
+      int n = common(child, tokens, pos, length);
+      if (n < (int)child->tokens.size()) {
+        child = split(node, child, n);
+        if (!child) {
+          return; // out of device memory
+        }
+      }
+      child->last_use = clock;
+      pos += n;
+      node = child;
+    }
+    int rows = length - pos;
+    if (rows <= 0) {
+      return;
+    }
+    uint64_t size = node_bytes(rows);
+    if (!evict(size)) {
+      return;
+    }
+    auto leaf = new_node(node, &tokens[pos], rows);
+    if (!leaf) {
+      return;
+    }
+    for (int i = 0; i < num_layers; i++) {
+      copy_rows(keys[i], pos, leaf, 2 * i, 0, rows, true);
+      copy_rows(values[i], pos, leaf, 2 * i + 1, 0, rows, true);
+    }
+  }
+
+  uint64_t budget = 0; // bytes of device memory the cache may hold
+  uint64_t bytes = 0;  // bytes held
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t hit_tokens = 0; // prefill rows skipped
+  uint64_t evictions = 0;
+
+private:
+  struct Node {
+    std::vector<int> tokens; // edge label, one KV row per token
+    std::map<int, std::unique_ptr<Node>> children;
+    Node *parent;
+    bm_device_mem_t mem;
+    uint64_t last_use = 0;
+  };
+
+  uint64_t node_bytes(int rows) const {
+    return (uint64_t)rows * row_bytes * num_layers * 2;
+  }
+
+  // tokens of node's edge matching tokens[pos, end)
+  static int common(const Node *node, const std::vector<int> &tokens, int pos,
+                    int end) {
+    int n = 0;
+    while (n < (int)node->tokens.size() && pos + n < end &&
+           node->tokens[n] == tokens[pos + n]) {
+      n++;
+    }
+    return n;
+  }
+
+  // copy rows [first, first + n) of slot (layer * 2 + k/v) of node to/from
+  // row `row` of cache
+  void copy_rows(bm_device_mem_t &cache, int row, Node *node, int slot,
+                 int first, int n, bool to_node) {
+    int rows = node->tokens.size();
+    auto node_offset = ((uint64_t)slot * rows + first) * row_bytes;
+    auto cache_offset = (uint64_t)row * row_bytes;
+    if (to_node) {
+      bm_memcpy_d2d_byte(bm_handle, node->mem, node_offset, cache, cache_offset,
+                         (uint64_t)n * row_bytes);
+    } else {
+      bm_memcpy_d2d_byte(bm_handle, cache, cache_offset, node->mem, node_offset,
+                         (uint64_t)n * row_bytes);
+    }
+  }
+
+  Node *new_node(Node *parent, const int *tokens, int rows) {
+    std::unique_ptr<Node> node(new Node());
+    auto status =
+        bm_malloc_device_byte(bm_handle, &node->mem, node_bytes(rows));
+    if (BM_SUCCESS != status) {
+      return nullptr;
+    }
+    bytes += node_bytes(rows);
+    node->tokens.assign(tokens, tokens + rows);
+    node->parent = parent;
+    node->last_use = clock;
+    auto ptr = node.get();
+    parent->children[tokens[0]] = std::move(node);
+    return ptr;
+  }
+
+  // split child after n tokens, the head becomes a new node between parent
+  // and child; return the head, nullptr with the tree unchanged if device
+  // memory runs out
+  Node *split(Node *parent, Node *child, int n) {
+    int rows = child->tokens.size();
+    std::unique_ptr<Node> head(new Node());
+    std::unique_ptr<Node> tail(new Node());
+    if (BM_SUCCESS !=
+        bm_malloc_device_byte(bm_handle, &head->mem, node_bytes(n))) {
+      return nullptr;
+    }
+    if (BM_SUCCESS !=
+        bm_malloc_device_byte(bm_handle, &tail->mem, node_bytes(rows - n))) {
+      bm_free_device(bm_handle, head->mem);
+      return nullptr;
+    }
+    auto owned = std::move(parent->children[child->tokens[0]]);
+    for (int slot = 0; slot < 2 * num_layers; slot++) {
+      bm_memcpy_d2d_byte(bm_handle, head->mem, (uint64_t)slot * n * row_bytes,
+                         child->mem, (uint64_t)slot * rows * row_bytes,
+                         (uint64_t)n * row_bytes);
+      bm_memcpy_d2d_byte(
+          bm_handle, tail->mem, (uint64_t)slot * (rows - n) * row_bytes,
+          child->mem, ((uint64_t)slot * rows + n) * row_bytes,
+          (uint64_t)(rows - n) * row_bytes);
+    }
+    bm_free_device(bm_handle, child->mem);
+    head->tokens.assign(child->tokens.begin(), child->tokens.begin() + n);
+    tail->tokens.assign(child->tokens.begin() + n, child->tokens.end());
+    head->parent = parent;
+    tail->parent = head.get();
+    head->last_use = child->last_use;
+    tail->last_use = child->last_use;
+    tail->children = std::move(child->children);
+    for (auto &it : tail->children) {
+      it.second->parent = tail.get();
+    }
+    auto ptr = head.get();
+    head->children[tail->tokens[0]] = std::move(tail);
+    parent->children[ptr->tokens[0]] = std::move(head);
+    return ptr;
+  }
+
+  // evict leaves not used by the current call until size more bytes fit
+  bool evict(uint64_t size) {
+    if (size > budget) {
+      return false;
+    }
+    while (bytes + size > budget) {
+      Node *lru = nullptr;
+      find_lru(root.get(), lru);
+      if (lru == nullptr) {
+        return false;
+      }
+      bytes -= node_bytes(lru->tokens.size());
+      bm_free_device(bm_handle, lru->mem);
+      lru->parent->children.erase(lru->tokens[0]);
+      evictions++;
+    }
+    return true;
+  }
+
+  void find_lru(Node *node, Node *&lru) {
+    for (auto &it : node->children) {
+      Node *child = it.second.get();
+      if (!child->children.empty()) {
+        find_lru(child, lru);
+      } else if (child->last_use < clock &&
+                 (lru == nullptr || child->last_use < lru->last_use)) {
+        lru = child;
+      }
+    }
+  }
+
+  void free_tree(Node *node) {
+    for (auto &it : node->children) {
+      free_tree(it.second.get());
+      bm_free_device(bm_handle, it.second->mem);
+    }
+    node->children.clear();
+  }
+
+  bm_handle_t bm_handle = 0;
+  int num_layers = 0;
+  int row_bytes = 0;
+  uint64_t clock = 0; // bumped by every load/insert, for LRU
+  std::unique_ptr<Node> root;
+};
@@ -0,0 +1,182 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2023 Sophgo Technologies Inc.  All rights reserved.
+//
+// TPU-MLIR is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+// Drafts for prompt lookup decoding. Summaries, code edits & RAG answers copy
+// long spans of the prompt, so the tokens that followed the last occurrence
+// of the latest n-gram are a good guess of what comes next. The index maps
+// each n-gram (MIN_NGRAM..MAX_NGRAM tokens) to where its latest earlier
+// occurrence ended and is kept up to date as tokens are appended, so a lookup
+// costs a few hash probes however long the history is.
+class NgramIndex {
+public:
+  NgramIndex(int min_ngram = 1, int max_ngram = 3)
+      : MIN_NGRAM(min_ngram), MAX_NGRAM(max_ngram), ends(max_ngram + 1) {
+    assert(min_ngram >= 1 && min_ngram <= max_ngram);
+  }
+
+  void clear() {
+    tokens.clear();
+    for (auto &map : ends) {
+      map.clear();
+    }
+  }
+
+  void append(int token) {
+    // the n-grams ending at the previous token now have a continuation; the
+    // ones ending at token are indexed on the next append, so a lookup never
+    // finds the suffix itself
+    int last = tokens.size();
+    for (int n = MIN_NGRAM; n <= MAX_NGRAM && n <= last; n++) {
+      ends[n][hash(last - n, n)] = last;
+    }
+    tokens.push_back(token);
+  }
+
+  void append(const std::vector<int> &tokens) {
+    for (int token : tokens) {
+      append(token);
+    }
+  }
+
+  // up to max_tokens tokens that followed the longest n-gram ending the
+  // history, empty if it never occurred before
+  std::vector<int> propose(int max_tokens) const {
+    int size = tokens.size();
+    for (int n = std::min(MAX_NGRAM, size - 1); n >= MIN_NGRAM; n--) {
+      auto it = ends[n].find(hash(size - n, n));
+      if (it == ends[n].end()) {
+        continue;
+      }
+      int end = it->second;
+      if (!std::equal(tokens.begin() + end - n, tokens.begin() + end,
+                      tokens.begin() + size - n)) {
+        continue; // hash collision
+      }
+      int num = std::min(max_tokens, size - end);
+      return std::vector<int>(tokens.begin() + end,
+                              tokens.begin() + end + num);
+    }
+    return {};
+  }
+
+  int MIN_NGRAM;
+  int MAX_NGRAM;
+  std::vector<int> tokens; // the history
+
+private:
+  uint64_t hash(int start, int n) const {
+    uint64_t h = 14695981039346656037ull;
+    for (int i = start; i < start + n; i++) {
+      h = (h ^ (uint32_t)tokens[i]) * 1099511628211ull;
+    }
+    return h;
+  }
+
+  std::vector<std::unordered_map<uint64_t, int>> ends; // [n]
+};
+
+// Greedy prompt lookup decoding on a target with verify nets, no draft model:
+// the drafts come from NgramIndex and the target checks them with one
+// forward_verify pass like Speculative does. Without a match it is a plain
+// decode step. Target needs forward_first, forward_append, forward_verify,
+// rollback, token_length, MAX_SEQLEN & VERIFY_LENGTH.
+template <typename Target> class PromptLookup {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  PromptLookup(Target &target, int eos = -1, int min_ngram = 1,
+               int max_ngram = 3)
+      : index(min_ngram, max_ngram), target(target), eos(eos) {
+    assert(target.VERIFY_LENGTH > 1);
+  }
+
+  int forward_first(std::vector<int> &tokens) {
+    index.clear();
+    index.append(tokens);
+    return target.forward_first(tokens);
+  }
+
+  int forward_append(std::vector<int> &tokens) {
+    index.append(tokens);
+    return target.forward_append(tokens);
+  }
+
+  // tokens are already in the target KV, e.g. of a restored session: only
+  // index them
+  void resume(std::vector<int> &tokens) {
+    index.clear();
+    index.append(tokens);
+  }
+
+  // Tokens after cur_token, the last returned one: the accepted drafts and
+  // the target's next token, which is the next cur_token. Stops at eos.
+  std::vector<int> forward_next(int cur_token) {
+    auto start = Clock::now();
+    int k = target.VERIFY_LENGTH;
+    int base = target.token_length;
+    index.append(cur_token);
+    std::vector<int> input = {cur_token};
+    if (base + k <= target.MAX_SEQLEN) {
+      auto drafts = index.propose(k - 1);
+      input.insert(input.end(), drafts.begin(), drafts.end());
+    }
+    std::vector<int> out;
+    if (input.size() == 1) {
+      out.push_back(target.forward_append(input));
+    } else {
+      auto next = target.forward_verify(input);
+      int num = input.size();
+      int accepted = 0;
+      while (accepted < num - 1 && input[accepted + 1] == next[accepted] &&
+             input[accepted + 1] != eos) {
+        accepted++;
+      }
+      out.assign(input.begin() + 1, input.begin() + 1 + accepted);
+      out.push_back(next[accepted]);
+      index.append(std::vector<int>(out.begin(), out.end() - 1));
+      target.rollback(base + 1 + accepted);
+      proposed += num - 1;
+      this->accepted += accepted;
+      verified++;
+    }
+    steps++;
+    tokens += out.size();
+    decode_ms += std::chrono::duration<double, std::milli>(Clock::now() - start)
+                     .count();
+    return out;
+  }
+
+  double acceptance_rate() const {
+    return proposed ? (double)accepted / proposed : 0;
+  }
+  double tokens_per_second() const {
+    return decode_ms > 0 ? tokens * 1000.0 / decode_ms : 0;
+  }
+
+  NgramIndex index;
+  uint64_t proposed = 0; // drafts scored by the target
+  uint64_t accepted = 0; // of them agreed with
+  uint64_t verified = 0; // steps that had drafts
+  uint64_t steps = 0;    // target passes of forward_next
+  uint64_t tokens = 0;   // returned by forward_next
+  double decode_ms = 0;  // in forward_next
+
+private:
+  Target &target;
+  int eos;
+};
@@ -0,0 +1,478 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2023 Sophgo Technologies Inc.  All rights reserved.
+//
+// TPU-MLIR is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Iteration level scheduler. One thread owns the engine and its sessions;
+// every round it gives one prefill chunk to a request still reading its
+// prompt and one decode step to every request generating, so neither a long
+// answer nor a long prompt holds the TPU while others wait.
+// Lower priority values go first: they are admitted, prefilled and stepped
+// before the others, and among equals the earliest deadline goes first.
+// Requests past their deadline are finished where they are.
+// Requests of one conversation continue its KV cache. Its session is
+// prefetched when a request is queued, so a session the engine swapped out
+// to host while idle is on its way back before its turn. A conversation
+// holds its session until end_conversation; when no session is left and
+// the engine can't swap one out, new requests wait.
+// When the engine's KV pool has no pages left for a step (forward_* return
+// -1), the last request in serving order that holds KV is preempted: its KV
+// is dropped and it waits again, to prefill its prompt and the tokens it
+// generated so far. The step is retried next round. One continuing a
+// conversation can't be rebuilt and is finished as expired, as is a request
+// that doesn't fit with no one else holding KV.
+// Engine is sg_llm, or a host stand-in with the same methods for testing:
+// create_session, switch_session, close_session, clear_session, prefetch,
+// forward_first, forward_append, forward_next, token_length, MAX_SEQLEN,
+// MAX_SESSIONS & CHUNK_LENGTH.
+// The engine must not be used by anyone else while the scheduler runs.
+template <typename Engine> class Scheduler {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Result {
+    std::vector<int> tokens; // generated since the last poll
+    bool done = false;
+    bool expired = false;    // stopped by its deadline, or prompt too long
+    double queue_ms = 0;     // waiting for the TPU, so far
+    double compute_ms = 0;   // in its own prefill & decode launches
+    double first_token_ms = 0;
+  };
+
+  struct Metrics {
+    uint64_t finished = 0;
+    uint64_t expired = 0;
+    uint64_t tokens = 0;
+    uint64_t rounds = 0;
+    uint64_t preempted = 0; // for lack of KV pages
+    double queue_ms = 0;   // summed over finished requests
+    double compute_ms = 0;
+    double first_token_ms = 0;
+  };
+
+  // prefill_chunk: prompt tokens prefilled per round, used when the engine
+  // has chunk nets; otherwise a prompt is prefilled in one go
+  explicit Scheduler(Engine &engine, int prefill_chunk = 256)
+      : engine(engine), prefill_chunk(prefill_chunk) {
+    if (engine.CHUNK_LENGTH <= 1) {
+      this->prefill_chunk = engine.MAX_SEQLEN;
+    }
+    first_session = engine.session;
+    free_sessions.push_back(first_session);
+    worker = std::thread(&Scheduler::run, this);
+  }
+
+  ~Scheduler() { stop(); }
+
+  // queue a prompt, return its request id; deadline_ms 0 means none.
+  // conversation >= 0 is a key of the caller: tokens follow the KV of the
+  // earlier requests with that key, up to their last generated token.
+  int submit(const std::vector<int> &tokens, int max_new_tokens,
+             int priority = 1, int deadline_ms = 0, int eos = -1,
+             int conversation = -1) {
+    auto req = std::make_shared<Request>();
+    req->prompt = tokens;
+    req->conversation = conversation;
+    req->max_new_tokens = max_new_tokens;
+    req->priority = priority;
+    req->eos = eos;
+    req->enqueued = Clock::now();
+    req->has_deadline = deadline_ms > 0;
+    req->deadline = req->enqueued + std::chrono::milliseconds(deadline_ms);
+    std::lock_guard<std::mutex> lock(mu);
+    req->id = next_id++;
+    requests[req->id] = req;
+    waiting.push_back(req);
+    stalled = false;
+    cond.notify_one();
+    return req->id;
+  }
+
+  // tokens of request id since the last poll; a done request is forgotten
+  // after it is polled
+  Result poll(int id) {
+    std::lock_guard<std::mutex> lock(mu);
+    Result result;
+    auto it = requests.find(id);
+    if (it == requests.end()) {
+      result.done = true;
+      return result;
+    }
+    auto &req = *it->second;
+    result.tokens.swap(req.out);
+    result.done = req.done;
+    result.expired = req.expired;
+    result.compute_ms = req.compute_ms;
+    result.queue_ms = ms(req.enqueued, req.done ? req.finished : Clock::now()) -
+                      req.compute_ms;
+    result.first_token_ms = req.first_token_ms;
+    if (req.done) {
+      requests.erase(it);
+    }
+    return result;
+  }
+
+  // drop the KV of a conversation once its requests are done
+  void end_conversation(int conversation) {
+    std::lock_guard<std::mutex> lock(mu);
+    ending.push_back(conversation);
+    stalled = false;
+    cond.notify_one();
+  }
+
+  Metrics metrics() {
+    std::lock_guard<std::mutex> lock(mu);
+    return stats;
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      running = false;
+      cond.notify_one();
+    }
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+
+private:
+  struct Request {
+    int id;
+    int priority;
+    int max_new_tokens;
+    int eos;
+    int conversation;
+    bool append = false;    // prompt follows the KV of its conversation
+    bool prefetched = false;
+    std::vector<int> prompt;
+    int prefilled = 0;  // prompt tokens in the KV cache
+    int session = -1;
+    int next_token = 0; // last generated token, fed by the next step
+    int generated = 0;
+    bool has_deadline;
+    Clock::time_point enqueued, deadline, finished;
+    double compute_ms = 0;
+    double first_token_ms = 0;
+    std::vector<int> out; // generated, not polled yet
+    std::vector<int> answer; // generated, prefilled again if preempted
+    bool done = false;
+    bool expired = false;
+  };
+  using RequestPtr = std::shared_ptr<Request>;
+
+  struct Conversation {
+    int session = -1;
+    int next_token = -1; // generated last, not in the KV yet
+    bool busy = false;   // a request of it is active
+  };
+
+  static double ms(Clock::time_point begin, Clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - begin).count();
+  }
+
+  static bool before(const RequestPtr &a, const RequestPtr &b) {
+    if (a->priority != b->priority) {
+      return a->priority < b->priority;
+    }
+    if (a->has_deadline != b->has_deadline) {
+      return a->has_deadline;
+    }
+    if (a->has_deadline && a->deadline != b->deadline) {
+      return a->deadline < b->deadline;
+    }
+    return a->id < b->id;
+  }
+
+  // under mu
+  void finish(const RequestPtr &req, bool expired) {
+    req->done = true;
+    req->expired = expired;
+    req->finished = Clock::now();
+    if (req->conversation >= 0) {
+      auto &conv = conversations[req->conversation];
+      conv.busy = false;
+      if (!expired) {
+        conv.next_token = req->next_token;
+      } else if (req->session >= 0) {
+        // the KV stopped halfway, the conversation starts over
+        release(req->session);
+        conv = Conversation();
+      }
+    } else if (req->session >= 0) {
+      release(req->session);
+    }
+    req->session = -1;
+    stats.finished++;
+    stats.expired += expired;
+    stats.queue_ms += ms(req->enqueued, req->finished) - req->compute_ms;
+    stats.compute_ms += req->compute_ms;
+    stats.first_token_ms += req->first_token_ms;
+  }
+
+  // under mu: close ended conversations, drop expired requests, give
+  // sessions to waiting ones by priority, return the active ones in
+  // serving order
+  std::vector<RequestPtr> admit() {
+    std::vector<int> still_ending;
+    for (int key : ending) {
+      auto it = conversations.find(key);
+      if (it != conversations.end() && it->second.busy) {
+        still_ending.push_back(key);
+      } else if (it != conversations.end()) {
+        int id = it->second.session;
+        if (id == first_session) {
+          release(id);
+        } else if (id >= 0) {
+          engine.close_session(id); // may be in host, don't reuse
+        }
+        conversations.erase(it);
+      }
+    }
+    ending.swap(still_ending);
+
+    auto now = Clock::now();
+    auto expire = [&](std::vector<RequestPtr> &list) {
+      for (auto &req : list) {
+        bool too_long = (int)req->prompt.size() >= engine.MAX_SEQLEN ||
+                        req->prompt.empty();
+        if (too_long || (req->has_deadline && now > req->deadline)) {
+          finish(req, true);
+        }
+      }
+      list.erase(std::remove_if(list.begin(), list.end(),
+                                [](const RequestPtr &r) { return r->done; }),
+                 list.end());
+    };
+    expire(waiting);
+    expire(active);
+    // start bringing swapped out conversations back right away
+    for (auto &req : waiting) {
+      if (req->conversation >= 0 && !req->prefetched) {
+        int id = conversations[req->conversation].session;
+        req->prefetched = id < 0 || engine.prefetch(id);
+      }
+    }
+    std::sort(waiting.begin(), waiting.end(), before);
+    for (auto it = waiting.begin(); it != waiting.end();) {
+      if ((int)active.size() >= engine.MAX_SESSIONS) {
+        break;
+      }
+      auto req = *it;
+      Conversation *conv = nullptr;
+      if (req->conversation >= 0) {
+        conv = &conversations[req->conversation];
+        if (conv->busy) {
+          ++it; // one request of a conversation at a time
+          continue;
+        }
+      }
+      if (conv && conv->session >= 0) {
+        req->session = conv->session;
+        if (conv->next_token >= 0) {
+          req->prompt.insert(req->prompt.begin(), conv->next_token);
+        }
+        req->append = true;
+      } else {
+        if (free_sessions.empty()) {
+          int id = engine.create_session();
+          if (id < 0) {
+            break;
+          }
+          free_sessions.push_back(id);
+        }
+        req->session = free_sessions.back();
+        free_sessions.pop_back();
+      }
+      if (conv) {
+        conv->session = req->session;
+        conv->busy = true;
+      }
+      it = waiting.erase(it);
+      active.push_back(req);
+    }
+    std::sort(active.begin(), active.end(), before);
+    return active;
+  }
+
+  void step(const RequestPtr &req) {
+    auto begin = Clock::now();
+    engine.switch_session(req->session);
+    int token;
+    int total = req->prompt.size();
+    bool prefill = req->prefilled < total;
+    int n = prefill ? std::min(prefill_chunk, total - req->prefilled) : 1;
+    if (prefill && (req->append || req->prefilled > 0)) {
+      if (engine.token_length + n >= engine.MAX_SEQLEN) {
+        std::lock_guard<std::mutex> lock(mu);
+        finish(req, true); // no room left in the KV cache
+        return;
+      }
+    }
+    if (prefill) {
+      std::vector<int> chunk(req->prompt.begin() + req->prefilled,
+                             req->prompt.begin() + req->prefilled + n);
+      token = req->prefilled == 0 && !req->append
+                  ? engine.forward_first(chunk)
+                  : engine.forward_append(chunk);
+    } else {
+      token = engine.forward_next(req->next_token);
+    }
+    auto end = Clock::now();
+
+    std::lock_guard<std::mutex> lock(mu);
+    req->compute_ms += ms(begin, end);
+    if (token < 0) {
+      out_of_kv(req);
+      return;
+    }
+    if (prefill) {
+      req->prefilled += n;
+    }
+    if (req->prefilled < total) {
+      return; // the token of a partial prompt means nothing
+    }
+    if (prefill && req->generated == 0) {
+      req->first_token_ms = ms(req->enqueued, end);
+    }
+    req->next_token = token;
+    req->out.push_back(token);
+    req->answer.push_back(token);
+    req->generated++;
+    stats.tokens++;
+    if (token == req->eos || req->generated >= req->max_new_tokens ||
+        engine.token_length >= engine.MAX_SEQLEN) {
+      finish(req, false);
+    }
+  }
+
+  // under mu: empty session id and keep it for the next request
+  void release(int id) {
+    engine.clear_session(id);
+    free_sessions.push_back(id);
+  }
+
+  // under mu: the engine had no KV pages for a step of req
+  void out_of_kv(const RequestPtr &req) {
+    RequestPtr victim;
+    int holders = 0;
+    for (auto &r : active) { // in serving order
+      if (!r->done && (r == req || r->prefilled > 0 || r->append)) {
+        victim = r;
+        holders++;
+      }
+    }
+    if (holders <= 1) {
+      finish(req, true); // doesn't fit even alone
+      return;
+    }
+    stats.preempted++;
+    if (victim->append) {
+      finish(victim, true);
+      return;
+    }
+    // the prompt and the answer so far are prefilled again, the token of
+    // that prefill is the next of the answer
+    victim->prompt.insert(victim->prompt.end(), victim->answer.begin(),
+                          victim->answer.end());
+    victim->answer.clear();
+    victim->prefilled = 0;
+    if (victim->conversation >= 0) {
+      conversations[victim->conversation] = Conversation();
+    }
+    release(victim->session);
+    victim->session = -1;
+    active.erase(std::find(active.begin(), active.end(), victim));
+    waiting.push_back(victim);
+  }
+
+  // under mu: the earliest deadline of the waiting requests, if any
+  bool waiting_deadline() {
+    bool found = false;
+    for (auto &req : waiting) {
+      if (req->has_deadline && (!found || req->deadline < next_deadline)) {
+        next_deadline = req->deadline;
+        found = true;
+      }
+    }
+    return found;
+  }
+
+  void run() {
+    while (true) {
+      std::vector<RequestPtr> order;
+      {
+        std::unique_lock<std::mutex> lock(mu);
+        auto ready = [this] {
+          return !running || !active.empty() || (!waiting.empty() && !stalled);
+        };
+        if (stalled && waiting_deadline()) {
+          // wake up to expire the first waiting request past its deadline
+          if (!cond.wait_until(lock, next_deadline, ready)) {
+            stalled = false;
+          }
+        } else {
+          cond.wait(lock, ready);
+        }
+        if (!running) {
+          break;
+        }
+        order = admit();
+        // nothing got a session: wait for a new request or a conversation
+        // to end rather than asking the engine again right away
+        stalled = order.empty();
+        stats.rounds++;
+      }
+      // one prefill chunk, the first by priority, between decode steps
+      for (auto &req : order) {
+        if (req->prefilled < (int)req->prompt.size()) {
+          step(req);
+          break;
+        }
+      }
+      for (auto &req : order) {
+        if (!req->done && req->prefilled == (int)req->prompt.size() &&
+            req->generated > 0) {
+          step(req);
+        }
+      }
+      std::lock_guard<std::mutex> lock(mu);
+      active.erase(std::remove_if(active.begin(), active.end(),
+                                  [](const RequestPtr &r) { return r->done; }),
+                   active.end());
+    }
+  }
+
+  Engine &engine;
+  int prefill_chunk;
+  std::thread worker;
+  std::mutex mu;
+  std::condition_variable cond;
+  bool running = true;
+  bool stalled = false; // the waiting requests could not get a session
+  Clock::time_point next_deadline;
+  int next_id = 0;
+  std::map<int, RequestPtr> requests;
+  std::vector<RequestPtr> waiting; // no session yet
+  std::vector<RequestPtr> active;  // prefilling or generating
+  int first_session; // the engine's own, never closed
+  std::vector<int> free_sessions;
+  std::map<int, Conversation> conversations;
+  std::vector<int> ending; // conversations to close
+  Metrics stats;
+};
@@ -0,0 +1,181 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2023 Sophgo Technologies Inc.  All rights reserved.
+//
+// TPU-MLIR is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "bmruntime_interface.h"
+
+// Session file: the first token_length rows of every KV tensor, so a
+// conversation survives a restart, or a system prompt can be prefilled once
+// and shipped next to the bmodel.
+//   SessionHeader | tokens (int32 x num_tokens) | KV tensors in the order
+//   given to save, token_length * row_bytes each
+// row_bytes of a tensor is its device size / seqlen.
+
+struct SessionHeader {
+  char magic[8];         // "SGKVSES1"
+  uint64_t model_hash;   // session_model_hash() of the bmodel
+  uint32_t dtype;        // bm_data_type_t of the KV
+  uint32_t seqlen;       // rows of every KV tensor
+  uint32_t num_layers;
+  uint32_t num_tensors;  // KV tensors saved, 2 * num_layers * devices
+  uint32_t token_length; // rows saved per tensor
+  uint32_t num_tokens;   // token ids saved, may be 0
+};
+
+// one KV tensor, with the handle of its device
+struct SessionTensor {
+  bm_handle_t handle;
+  bm_device_mem_t mem;
+};
+
+static const char SESSION_MAGIC[8] = {'S', 'G', 'K', 'V', 'S', 'E', 'S', '1'};
+static const size_t SESSION_CHUNK = 4 << 20; // bytes per d2s/s2d copy
+
+// FNV-1a over the size and the first & last MB of the bmodel, cheap enough
+// to run at load while telling builds of different models apart
+static inline uint64_t session_model_hash(const std::string &model_path) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  auto mix = [&hash](const uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+  };
+  FILE *fp = fopen(model_path.c_str(), "rb");
+  if (fp == NULL) {
+    return 0;
+  }
+  fseek(fp, 0, SEEK_END);
+  uint64_t size = ftell(fp);
+  mix((const uint8_t *)&size, sizeof(size));
+  std::vector<uint8_t> buf(1 << 20);
+  uint64_t tail = size > buf.size() ? size - buf.size() : 0;
+  for (uint64_t offset : {(uint64_t)0, tail}) {
+    fseek(fp, offset, SEEK_SET);
+    size_t n = fread(buf.data(), 1, buf.size(), fp);
+    mix(buf.data(), n);
+  }
+  fclose(fp);
+  return hash;
+}
+
+// Stream token_length rows of every tensor to path.
+static inline bool save_session_file(const std::string &path,
+                                     SessionHeader header,
+                                     const std::vector<int> &tokens,
+                                     const std::vector<SessionTensor> &tensors) {
+  memcpy(header.magic, SESSION_MAGIC, sizeof(header.magic));
+  header.num_tensors = tensors.size();
+  header.num_tokens = tokens.size();
+  FILE *fp = fopen(path.c_str(), "wb");
+  if (fp == NULL) {
+    printf("Error: can't write session %s\n", path.c_str());
+    return false;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+  if (ok && !tokens.empty()) {
+    ok = fwrite(tokens.data(), sizeof(int), tokens.size(), fp) == tokens.size();
+  }
+  std::vector<uint8_t> buf;
+  for (auto &t : tensors) {
+    size_t row_bytes = bm_mem_get_device_size(t.mem) / header.seqlen;
+    size_t bytes = row_bytes * header.token_length;
+    for (size_t offset = 0; ok && offset < bytes; offset += SESSION_CHUNK) {
+      size_t size = std::min(SESSION_CHUNK, bytes - offset);
+      buf.resize(size);
+      ok = BM_SUCCESS == bm_memcpy_d2s_partial_offset(t.handle, buf.data(),
+                                                      t.mem, size, offset) &&
+           fwrite(buf.data(), 1, size, fp) == size;
+    }
+  }
+  fclose(fp);
+  if (!ok) {
+    printf("Error: failed to write session %s\n", path.c_str());
+  }
+  return ok;
+}
+
+// Map path and copy its rows back to the tensors. expect gives the model
+// hash, dtype, seqlen and num_layers the session must match; on success the
+// saved token_length is returned in it and the token ids in tokens.
+static inline bool load_session_file(const std::string &path,
+                                     SessionHeader &expect,
+                                     std::vector<int> &tokens,
+                                     const std::vector<SessionTensor> &tensors) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    printf("Error: can't open session %s\n", path.c_str());
+    return false;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  size_t file_size = st.st_size;
+  void *map = file_size >= sizeof(SessionHeader)
+                  ? mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                  : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED) {
+    printf("Error: can't map session %s\n", path.c_str());
+    return false;
+  }
+  auto data = (const uint8_t *)map;
+  SessionHeader header;
+  memcpy(&header, data, sizeof(header));
+  bool ok = memcmp(header.magic, SESSION_MAGIC, sizeof(header.magic)) == 0 &&
+            header.model_hash == expect.model_hash &&
+            header.dtype == expect.dtype && header.seqlen == expect.seqlen &&
+            header.num_layers == expect.num_layers &&
+            header.num_tensors == tensors.size() &&
+            header.token_length <= header.seqlen;
+  if (!ok) {
+    printf("Error: session %s was saved by another model\n", path.c_str());
+    munmap(map, file_size);
+    return false;
+  }
+  size_t pos = sizeof(header);
+  size_t expect_size = pos + header.num_tokens * sizeof(int);
+  for (auto &t : tensors) {
+    expect_size += bm_mem_get_device_size(t.mem) / header.seqlen *
+                   header.token_length;
+  }
+  if (file_size != expect_size) {
+    printf("Error: session %s is truncated\n", path.c_str());
+    munmap(map, file_size);
+    return false;
+  }
+  tokens.assign((const int *)(data + pos),
+                (const int *)(data + pos) + header.num_tokens);
+  pos += header.num_tokens * sizeof(int);
+  for (auto &t : tensors) {
+    size_t bytes =
+        bm_mem_get_device_size(t.mem) / header.seqlen * header.token_length;
+    for (size_t offset = 0; ok && offset < bytes; offset += SESSION_CHUNK) {
+      size_t size = std::min(SESSION_CHUNK, bytes - offset);
+      ok = BM_SUCCESS == bm_memcpy_s2d_partial_offset(
+                             t.handle, t.mem, (void *)(data + pos + offset),
+                             size, offset);
+    }
+    pos += bytes;
+  }
+  munmap(map, file_size);
+  expect.token_length = header.token_length;
+  if (!ok) {
+    printf("Error: failed to load session %s\n", path.c_str());
+  }
+  return ok;
+}
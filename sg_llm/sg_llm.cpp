@@ -9,33 +9,148 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 #include <vector>
 #include <assert.h>
 #include <chrono>
 #include <algorithm>
+#include <atomic>
+#include <future>
+#include <map>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include "bmruntime_interface.h"
+#include "attention_mask.h"
+#include "prefix_cache.h"
+#include "prompt_lookup.h"
+#include "scheduler.h"
+#include "session_file.h"
+#include "speculative.h"
 #include <stdio.h>
 #include <inttypes.h>
 
 static const uint16_t ATTENTION_MASK_BF16 = 0xC61C; // -10000 by bfloat16
 static const uint16_t ATTENTION_MASK_F16 = 0xF0E2;  // -10000 by float16
 
+// tensors of one net bound to fixed device mems, built once and reused by
+// every launch
+struct LaunchPlan {
+  const char *name;
+  bool io_alone; // io tensors may be rebound to any device mem
+  std::vector<bm_tensor_t> inputs;
+  std::vector<bm_tensor_t> outputs;
+};
+
+// KV cache & state of one conversation, the engine binds the KV of the
+// current one to the block nets
+struct KVSession {
+  std::vector<bm_device_mem_t> past_key;
+  std::vector<bm_device_mem_t> past_value;
+  int token_length = 0;
+  std::vector<int> history; // tokens in the KV cache
+  bool owned;               // KV allocated here, not the io mems of the nets
+  bool swapped = false;     // KV rows in host, device KV freed
+  std::vector<uint8_t> host; // [layer][key, value][token_length rows]
+  std::shared_future<void> pending; // swap copy in flight
+  std::chrono::steady_clock::time_point last_use;
+  std::vector<int> pages; // paged KV: its pool pages, in row order
+};
+
 class sg_llm {
 public:
-  sg_llm(const std::string &model_path);
+  sg_llm(const std::string &model_path, uint64_t session_budget = 0);
   ~sg_llm();
 
+  // the next token, or -1 when the KV pool has no pages left for the new
+  // tokens: nothing is run, forward_first leaves the session empty
   int forward_first(std::vector<int> &tokens);
   int forward_next(int cur_token);
+  int forward_append(std::vector<int> &tokens);
+  std::vector<int> forward_verify(std::vector<int> &tokens);
+  std::vector<int> forward_early_exit(int cur_token, int eos = -1);
+  std::vector<int> forward_multi(std::vector<int> &tokens);
+  void rollback(int length);
+  bool save_session(const std::string &path, std::vector<int> &tokens);
+  bool load_session(const std::string &path);
+  int create_session();
+  void switch_session(int id);
+  void close_session(int id);
+  void clear_session(int id);
+  void swap_out(int id);
+  bool prefetch(int id);
 
   int MAX_SEQLEN;
   int NUM_LAYERS;
+  int CHUNK_LENGTH = 0;             // rows of block_chunk_i, 0 if absent
+  int VERIFY_LENGTH = 0;            // rows of block_verify_i, 0 if absent
+  std::vector<int> MULTI_LENGTHS;   // rows of the block_multi_K_i, ascending
+  int token_length = 0;             // tokens in the KV cache
+  std::vector<int> history;         // token ids in the KV cache
+  int MAX_SESSIONS;                 // sessions resident in session_budget
+  int session = 0;                  // id of the current session
+  std::vector<int> PREFILL_SEQLENS; // sorted prefill stage lengths
+  uint64_t launches = 0;            // bmrt_launch_tensor_ex calls
+  uint64_t decode_steps = 0;
+  bool fused_decode = false;  // forward_next runs decode_step, if compiled
+  bool fused_prefill = false; // forward_first runs block_group_g, if compiled
+  int GROUP_LAYERS = 0;       // layers of a block_group_g, 0 if absent
+  bool layer_sync = false; // debug: sync after every launch to locate errors
+  uint64_t hidden_bytes_saved = 0;  // hidden state d2d avoided by aliasing
+  uint64_t hidden_bytes_copied = 0; // hidden state d2d still issued
+  uint64_t mask_bytes_uploaded() const { return decode_mask.uploaded_bytes; }
+  PrefixCache prefix_cache; // KV of earlier prompt prefixes, off by default
+  std::vector<int> session_tokens; // token ids of the last loaded session
+  int max_swapped = 0;   // sessions create_session & swap_idle_ms may swap out
+  int swap_idle_ms = 0;  // swap out sessions idle this long, 0 is off
+  uint64_t swaps_out = 0;
+  uint64_t swaps_in = 0;
+  std::atomic<uint64_t> swap_out_bytes{0}; // copied by the swap threads
+  std::atomic<uint64_t> swap_in_bytes{0};
+  std::atomic<uint64_t> swap_out_us{0};
+  std::atomic<uint64_t> swap_in_us{0};
+  double swap_wait_ms = 0; // switch_session blocked on swap ins
+  int PAGE_SIZE = 0;       // rows of a KV page, 0 without block_paged_i
+  int NUM_PAGES = 0;       // pages in the pool of every layer
+  bool KV_INT8 = false;    // KV rows are int8 with a scale per head
+  int exit_layer = 0;      // forward_early_exit drafts with these blocks
+  int draft_length = 0;    // drafts per step, < VERIFY_LENGTH, 0 is all
+  uint64_t exit_proposed = 0; // early exit drafts scored by all blocks
+  uint64_t exit_accepted = 0; // of them agreed with
+  uint64_t exit_steps = 0;    // calls of forward_early_exit
+  int free_pages() const { return free_list.size(); }
 
 private:
-  void net_launch(const bm_net_info_t *net, int stage_idx = 0);
+  void net_launch(LaunchPlan &plan);
+  LaunchPlan make_plan(const bm_net_info_t *net, int stage_idx = 0);
+  void debug_sync(const char *name);
+  void bind_kv();
+  void update_decode_mask();
+  bool alloc_kv(KVSession &kv);
+  void free_kv(KVSession &kv);
+  void wait_swap(KVSession &kv);
+  bool make_room(int keep, bool grow);
+  void swap_idle();
+  bool reserve_pages(int rows);
+  void release_pages(std::vector<int> &list);
+  void copy_pages(int rows, bool to_pages);
+  void upload_page_table();
+  SessionHeader session_header();
+  std::vector<SessionTensor> session_tensors();
+  bm_device_mem_t launch_hidden(LaunchPlan &plan, bm_device_mem_t src,
+                                size_t bytes);
   inline void d2d(bm_device_mem_t &dst, bm_device_mem_t &src);
+  inline void d2d(bm_device_mem_t &dst, bm_device_mem_t &src, size_t size);
+  bm_device_mem_t forward_blocks_cache(bm_device_mem_t out_mem,
+                                       int end_layer = -1);
+  bm_device_mem_t forward_chunk(std::vector<LaunchPlan> &plans,
+                                int embed_stage, const int *tokens, int num);
+  bm_device_mem_t forward_chunk_blocks(std::vector<LaunchPlan> &plans,
+                                       bm_device_mem_t out_mem, int num,
+                                       int begin_layer);
+  int prefill_seqlen(int length);
+  int embed_stage_of(int rows);
+  int multi_of(int rows);
+  int stage_of(const bm_net_info_t *net, int seqlen);
 
 private:
   bm_handle_t bm_handle = 0;
@@ -45,14 +160,58 @@ private:
   const bm_net_info_t *net_lm;
   std::vector<const bm_net_info_t *> net_blocks;
   std::vector<const bm_net_info_t *> net_blocks_cache;
-  std::vector<bm_device_mem_t> past_key;
+  std::vector<const bm_net_info_t *> net_blocks_chunk;
+  std::vector<const bm_net_info_t *> net_blocks_verify;
+  const bm_net_info_t *net_lm_verify = NULL;
+  std::vector<std::vector<const bm_net_info_t *>> net_blocks_multi; // [K]
+  std::vector<const bm_net_info_t *> net_lm_multi;
+  const bm_net_info_t *net_decode_step = NULL;
+  std::vector<const bm_net_info_t *> net_groups;
+  std::vector<bm_device_mem_t> past_key;   // KV of the current session
   std::vector<bm_device_mem_t> past_value;
-  int token_length;
+  std::map<int, KVSession> sessions;        // the current one may be stale
+  int next_session = 1;
+  uint64_t session_bytes;                   // KV bytes of one session
+  int hidden_bytes;                 // bytes of one hidden state row
+  bm_data_type_t hidden_dtype;      // of the hidden states between blocks
+  int kv_bytes;                     // bytes of one past_key/past_value row
+  std::vector<LaunchPlan> plan_embed; // [stage]
+  LaunchPlan plan_embed_cache;
+  LaunchPlan plan_lm;
+  std::vector<std::vector<LaunchPlan>> plan_blocks; // [layer][stage]
+  std::vector<LaunchPlan> plan_blocks_cache;
+  std::vector<LaunchPlan> plan_blocks_chunk;
+  std::vector<LaunchPlan> plan_blocks_verify;
+  LaunchPlan plan_lm_verify;
+  std::vector<std::vector<LaunchPlan>> plan_blocks_multi; // [K][layer]
+  std::vector<LaunchPlan> plan_lm_multi;
+  std::vector<int> multi_embed_stages;
+  LaunchPlan plan_decode_step;
+  std::vector<std::vector<LaunchPlan>> plan_groups; // [group][stage]
+  DecodeMask decode_mask;
+  PrefillMask prefill_mask;
+  std::vector<uint16_t> chunk_mask;
+  int chunk_embed_stage; // embedding stage that holds a chunk
+  int verify_embed_stage;
+  bm_device_mem_t hidden_mems[2];  // ping-pong hidden states between blocks
+  bm_device_mem_t exit_hidden;     // early exit rows for the deep blocks
   bool io_alone;
+  bool mask_in_graph; // blocks take a valid length instead of a mask
+  // paged KV: block_paged_i read the pools through a page table, block_i
+  // still write to past_key/past_value, which only stage the rows
+  bool paged = false;
+  std::vector<bm_device_mem_t> pool_key; // [NUM_PAGES * PAGE_SIZE rows]
+  std::vector<bm_device_mem_t> pool_value;
+  bm_device_mem_t kv_arena;  // staging & pools not given by the nets
+  std::vector<int> pages;     // pages of the current session
+  std::vector<int> free_list;
+  std::vector<int> page_table; // pages padded to MAX_SEQLEN / PAGE_SIZE
+  bool page_table_dirty = true;
+  uint64_t model_hash;
   uint16_t ATTENTION_MASK;
 };
 
-sg_llm::sg_llm(const std::string &model_path) {
+sg_llm::sg_llm(const std::string &model_path, uint64_t session_budget) {
   // request bm_handle
   bm_status_t status = bm_dev_request(&bm_handle, 0);
   assert(BM_SUCCESS == status);
@@ -67,21 +226,113 @@ sg_llm::sg_llm(const std::string &model_path) {
   bool ret = bmrt_load_bmodel(p_bmrt, model_path.c_str());
   assert(true == ret);
   printf("\nDone!\n");
+  model_hash = session_model_hash(model_path);
 
-  // set NUM_LAYERS
+  // set NUM_LAYERS, by name as the bmodel may hold optional nets
   auto num_nets = bmrt_get_network_number(p_bmrt);
-  NUM_LAYERS = (num_nets - 3) / 2;
+  const char **net_names = NULL;
+  bmrt_get_network_names(p_bmrt, &net_names);
+  NUM_LAYERS = 0;
+  for (int i = 0; i < num_nets; i++) {
+    if (strncmp(net_names[i], "block_cache_", 12) == 0 ||
+        strncmp(net_names[i], "block_paged_", 12) == 0) {
+      NUM_LAYERS++;
+    }
+    // block_multi_K_0 tells the Ks of --multi_lengths
+    int k = 0, layer = -1;
+    if (sscanf(net_names[i], "block_multi_%d_%d", &k, &layer) == 2 &&
+        layer == 0) {
+      MULTI_LENGTHS.push_back(k);
+    }
+  }
+  std::sort(MULTI_LENGTHS.begin(), MULTI_LENGTHS.end());
+  free(net_names);
 
   // net infos
   net_embed = bmrt_get_network_info(p_bmrt, "embedding");
   net_embed_cache = bmrt_get_network_info(p_bmrt, "embedding_cache");
   net_lm = bmrt_get_network_info(p_bmrt, "lm_head");
+  // block_paged_i, compiled by compile.sh --page_size, replace block_cache_i
+  paged = bmrt_get_network_info(p_bmrt, "block_paged_0") != NULL;
   for (int i = 0; i < NUM_LAYERS; i++) {
     auto block_name = "block_" + std::to_string(i);
-    auto cache_name = "block_cache_" + std::to_string(i);
+    auto cache_name =
+        (paged ? "block_paged_" : "block_cache_") + std::to_string(i);
     net_blocks.emplace_back(bmrt_get_network_info(p_bmrt, block_name.c_str()));
     net_blocks_cache.emplace_back(
         bmrt_get_network_info(p_bmrt, cache_name.c_str()));
+    assert(net_blocks_cache.back() != NULL);
+  }
+  // block_chunk_i, compiled by compile.sh --chunk_length, not paged
+  for (int i = 0; i < NUM_LAYERS && !paged; i++) {
+    auto chunk_name = "block_chunk_" + std::to_string(i);
+    auto net = bmrt_get_network_info(p_bmrt, chunk_name.c_str());
+    if (net == NULL) {
+      assert(i == 0);
+      break;
+    }
+    net_blocks_chunk.emplace_back(net);
+  }
+  // block_verify_i & lm_head_verify, compiled by compile.sh --verify_length,
+  // score VERIFY_LENGTH draft tokens in one pass, not paged
+  for (int i = 0; i < NUM_LAYERS && !paged; i++) {
+    auto verify_name = "block_verify_" + std::to_string(i);
+    auto net = bmrt_get_network_info(p_bmrt, verify_name.c_str());
+    if (net == NULL) {
+      assert(i == 0);
+      break;
+    }
+    net_blocks_verify.emplace_back(net);
+  }
+  if (!net_blocks_verify.empty()) {
+    net_lm_verify = bmrt_get_network_info(p_bmrt, "lm_head_verify");
+    assert(net_lm_verify != NULL);
+  }
+  // block_multi_K_i & lm_head_multi_K, compiled by compile.sh
+  // --multi_lengths, append K tokens in one pass, not paged
+  if (paged) {
+    MULTI_LENGTHS.clear();
+  }
+  for (int k : MULTI_LENGTHS) {
+    std::vector<const bm_net_info_t *> nets;
+    for (int i = 0; i < NUM_LAYERS; i++) {
+      auto multi_name =
+          "block_multi_" + std::to_string(k) + "_" + std::to_string(i);
+      nets.emplace_back(bmrt_get_network_info(p_bmrt, multi_name.c_str()));
+      assert(nets.back() != NULL);
+    }
+    net_blocks_multi.emplace_back(nets);
+    auto lm_name = "lm_head_multi_" + std::to_string(k);
+    net_lm_multi.emplace_back(bmrt_get_network_info(p_bmrt, lm_name.c_str()));
+    assert(net_lm_multi.back() != NULL);
+  }
+
+  // decode_step & block_group_g, compiled by compile.sh --fuse_decode &
+  // --fuse_prefill, replace the per layer launches of a decode token and of
+  // prefill; decode_step is not paged
+  if (!paged) {
+    net_decode_step = bmrt_get_network_info(p_bmrt, "decode_step");
+  }
+  for (int g = 0;; g++) {
+    auto group_name = "block_group_" + std::to_string(g);
+    auto net = bmrt_get_network_info(p_bmrt, group_name.c_str());
+    if (net == NULL) {
+      break;
+    }
+    net_groups.emplace_back(net);
+  }
+  if (net_decode_step) {
+    assert(net_decode_step->input_num == 3 + 2 * NUM_LAYERS);
+    fused_decode = true;
+  }
+  if (!net_groups.empty()) {
+    GROUP_LAYERS = (net_groups[0]->output_num - 1) / 2;
+    int layers = 0;
+    for (auto net : net_groups) {
+      layers += (net->output_num - 1) / 2;
+    }
+    assert(layers == NUM_LAYERS);
+    fused_prefill = true;
   }
 
   // set mask
@@ -97,8 +348,64 @@ sg_llm::sg_llm(const std::string &model_path) {
     exit(-1);
     break;
   }
-  // set MAX_SEQLEN
-  MAX_SEQLEN = net_embed->stages[0].input_shapes[0].dims[1];
+  prefill_mask = PrefillMask(ATTENTION_MASK);
+
+  // set prefill stages & MAX_SEQLEN
+  for (int i = 0; i < net_embed->stage_num; i++) {
+    int seqlen = net_embed->stages[i].input_shapes[0].dims[1];
+    if (stage_of(net_blocks[0], seqlen) < 0) {
+      continue; // embedding only stage, e.g. of a chunk
+    }
+    for (int j = 0; j < NUM_LAYERS; j++) {
+      assert(stage_of(net_blocks[j], seqlen) >= 0);
+    }
+    PREFILL_SEQLENS.push_back(seqlen);
+  }
+  std::sort(PREFILL_SEQLENS.begin(), PREFILL_SEQLENS.end());
+  MAX_SEQLEN = PREFILL_SEQLENS.back();
+  if (PREFILL_SEQLENS.size() > 1) {
+    printf("Prefill stages:");
+    for (auto seqlen : PREFILL_SEQLENS) {
+      printf(" %d", seqlen);
+    }
+    printf("\n");
+  }
+  if (!net_blocks_chunk.empty()) {
+    CHUNK_LENGTH = net_blocks_chunk[0]->stages[0].input_shapes[0].dims[1];
+    chunk_embed_stage = embed_stage_of(CHUNK_LENGTH);
+    assert(chunk_embed_stage >= 0 && CHUNK_LENGTH <= MAX_SEQLEN);
+    printf("Chunk length: %d\n", CHUNK_LENGTH);
+  }
+  if (!net_blocks_verify.empty()) {
+    VERIFY_LENGTH = net_blocks_verify[0]->stages[0].input_shapes[0].dims[1];
+    verify_embed_stage = embed_stage_of(VERIFY_LENGTH);
+    assert(verify_embed_stage >= 0 && VERIFY_LENGTH <= MAX_SEQLEN);
+    assert(net_lm_verify->stages[0].input_shapes[0].dims[1] == VERIFY_LENGTH);
+    printf("Verify length: %d\n", VERIFY_LENGTH);
+  }
+  for (int j = 0; j < (int)MULTI_LENGTHS.size(); j++) {
+    int k = MULTI_LENGTHS[j];
+    multi_embed_stages.push_back(embed_stage_of(k));
+    assert(multi_embed_stages.back() >= 0 && k <= MAX_SEQLEN);
+    assert(net_blocks_multi[j][0]->stages[0].input_shapes[0].dims[1] == k);
+    assert(net_lm_multi[j]->stages[0].input_shapes[0].dims[1] == k);
+  }
+  for (auto net : net_groups) {
+    for (auto seqlen : PREFILL_SEQLENS) {
+      assert(stage_of(net, seqlen) >= 0);
+    }
+  }
+  if (net_decode_step || !net_groups.empty()) {
+    printf("Fused decode: %s, prefill groups of %d layers\n",
+           net_decode_step ? "yes" : "no", GROUP_LAYERS);
+  }
+  if (!MULTI_LENGTHS.empty()) {
+    printf("Multi lengths:");
+    for (int k : MULTI_LENGTHS) {
+      printf(" %d", k);
+    }
+    printf("\n");
+  }
 
   // resize
   past_key.resize(NUM_LAYERS);
@@ -107,164 +414,1374 @@ sg_llm::sg_llm(const std::string &model_path) {
   // net device mem
   auto addr_mode = net_blocks_cache[0]->addr_mode;
   io_alone = addr_mode == 1;
-  for (int i = 0; i < NUM_LAYERS; i++) {
+  if (paged) {
+    auto &pool_shape = net_blocks_cache[0]->stages[0].input_shapes[3];
+    NUM_PAGES = pool_shape.dims[0];
+    PAGE_SIZE = pool_shape.dims[1];
+  }
+  for (int i = 0; i < NUM_LAYERS && !paged; i++) {
     assert(addr_mode == net_blocks_cache[i]->addr_mode);
-    past_key[i] = net_blocks_cache[i]->stages[0].input_mems[3];
-    past_value[i] = net_blocks_cache[i]->stages[0].input_mems[4];
+    if (io_alone) {
+      past_key[i] = net_blocks_cache[i]->stages[0].input_mems[3];
+      past_value[i] = net_blocks_cache[i]->stages[0].input_mems[4];
+    } else {
+      // io mems are shared by all blocks, every layer needs its own cache
+      auto kv_size =
+          bm_mem_get_device_size(net_blocks_cache[i]->stages[0].input_mems[3]);
+      status = bm_malloc_device_byte(bm_handle, &past_key[i], kv_size);
+      assert(BM_SUCCESS == status);
+      status = bm_malloc_device_byte(bm_handle, &past_value[i], kv_size);
+      assert(BM_SUCCESS == status);
+    }
+  }
+  // nets exported with --mask_in_graph take an int32 length as input 2
+  mask_in_graph = net_blocks[0]->input_dtypes[2] == BM_INT32;
+  for (int i = 0; i < NUM_LAYERS; i++) {
+    assert(mask_in_graph == (net_blocks[i]->input_dtypes[2] == BM_INT32));
+    assert(mask_in_graph == (net_blocks_cache[i]->input_dtypes[2] == BM_INT32));
+  }
+  for (auto net : net_blocks_chunk) {
+    assert(mask_in_graph == (net->input_dtypes[2] == BM_INT32));
+  }
+  for (auto net : net_blocks_verify) {
+    assert(mask_in_graph == (net->input_dtypes[2] == BM_INT32));
+  }
+  for (auto &nets : net_blocks_multi) {
+    for (auto net : nets) {
+      assert(mask_in_graph == (net->input_dtypes[2] == BM_INT32));
+      assert(net_blocks_cache[0]->input_dtypes[3] == net->input_dtypes[3]);
+    }
+  }
+  // nets exported with --kv_int8 keep the KV in int8, the scales of a row
+  // are part of it, so it is sized & copied by bytes like a float one
+  auto kv_dtype = net_blocks_cache[0]->input_dtypes[3];
+  KV_INT8 = kv_dtype == BM_INT8;
+  for (int i = 0; i < NUM_LAYERS; i++) {
+    assert(kv_dtype == net_blocks[i]->output_dtypes[1]);
+    assert(kv_dtype == net_blocks_cache[i]->input_dtypes[3]);
+    assert(kv_dtype == net_blocks_cache[i]->output_dtypes[1]);
+  }
+  for (auto net : net_blocks_chunk) {
+    assert(kv_dtype == net->input_dtypes[3]);
+  }
+  for (auto net : net_blocks_verify) {
+    assert(kv_dtype == net->input_dtypes[3]);
+  }
+  hidden_bytes =
+      bm_mem_get_device_size(net_blocks_cache[0]->stages[0].output_mems[0]);
+  hidden_dtype = net_embed->output_dtypes[0];
+  kv_bytes =
+      bm_mem_get_device_size(net_blocks_cache[0]->stages[0].output_mems[1]);
+  if (paged) {
+    // one arena holds the staging rows, and the pools unless the io_alone
+    // nets own them
+    uint64_t stage_bytes = (uint64_t)MAX_SEQLEN * kv_bytes;
+    uint64_t pool_bytes = (uint64_t)NUM_PAGES * PAGE_SIZE * kv_bytes;
+    uint64_t arena_bytes =
+        2 * NUM_LAYERS * (stage_bytes + (io_alone ? 0 : pool_bytes));
+    assert(arena_bytes <= UINT32_MAX);
+    status = bm_malloc_device_byte(bm_handle, &kv_arena, arena_bytes);
+    assert(BM_SUCCESS == status);
+    auto addr = bm_mem_get_device_addr(kv_arena);
+    pool_key.resize(NUM_LAYERS);
+    pool_value.resize(NUM_LAYERS);
+    for (int i = 0; i < NUM_LAYERS; i++) {
+      assert(addr_mode == net_blocks_cache[i]->addr_mode);
+      bm_set_device_mem(&past_key[i], stage_bytes, addr);
+      bm_set_device_mem(&past_value[i], stage_bytes, addr + stage_bytes);
+      addr += 2 * stage_bytes;
+      if (io_alone) {
+        pool_key[i] = net_blocks_cache[i]->stages[0].input_mems[3];
+        pool_value[i] = net_blocks_cache[i]->stages[0].input_mems[4];
+      } else {
+        bm_set_device_mem(&pool_key[i], pool_bytes, addr);
+        bm_set_device_mem(&pool_value[i], pool_bytes, addr + pool_bytes);
+        addr += 2 * pool_bytes;
+      }
+    }
+    for (int i = NUM_PAGES - 1; i >= 0; i--) {
+      free_list.push_back(i);
+    }
+    page_table.assign(MAX_SEQLEN / PAGE_SIZE, 0);
+    printf("Paged KV: %d pages of %d tokens\n", NUM_PAGES, PAGE_SIZE);
+  }
+
+  // launch plans & staging buffers, KV is read and written in place
+  for (int i = 0; i < 2; i++) {
+    status = bm_malloc_device_byte(bm_handle, &hidden_mems[i],
+                                   MAX_SEQLEN * hidden_bytes);
+    assert(BM_SUCCESS == status);
+  }
+  if (VERIFY_LENGTH > 0) {
+    status = bm_malloc_device_byte(bm_handle, &exit_hidden,
+                                   VERIFY_LENGTH * hidden_bytes);
+    assert(BM_SUCCESS == status);
+  }
+  for (int j = 0; j < net_embed->stage_num; j++) {
+    plan_embed.emplace_back(make_plan(net_embed, j));
+  }
+  plan_embed_cache = make_plan(net_embed_cache);
+  plan_lm = make_plan(net_lm);
+  plan_blocks.resize(NUM_LAYERS);
+  for (int i = 0; i < NUM_LAYERS; i++) {
+    for (int j = 0; j < net_blocks[i]->stage_num; j++) {
+      plan_blocks[i].emplace_back(make_plan(net_blocks[i], j));
+    }
+    plan_blocks_cache.emplace_back(make_plan(net_blocks_cache[i]));
+  }
+  for (auto net : net_blocks_chunk) {
+    plan_blocks_chunk.emplace_back(make_plan(net));
+  }
+  for (auto net : net_blocks_verify) {
+    plan_blocks_verify.emplace_back(make_plan(net));
+  }
+  if (net_lm_verify) {
+    plan_lm_verify = make_plan(net_lm_verify);
+  }
+  if (net_decode_step) {
+    plan_decode_step = make_plan(net_decode_step);
+  }
+  for (auto net : net_groups) {
+    plan_groups.emplace_back();
+    for (int j = 0; j < net->stage_num; j++) {
+      plan_groups.back().emplace_back(make_plan(net, j));
+    }
+  }
+  for (int j = 0; j < (int)MULTI_LENGTHS.size(); j++) {
+    plan_blocks_multi.emplace_back();
+    for (auto net : net_blocks_multi[j]) {
+      plan_blocks_multi[j].emplace_back(make_plan(net));
+    }
+    plan_lm_multi.emplace_back(make_plan(net_lm_multi[j]));
+  }
+  bind_kv();
+  // io_alone blocks own their position id & mask mems, bind them all to the
+  // ones of layer 0 so a step uploads them once; shared io mems already are
+  for (int i = 1; i < NUM_LAYERS; i++) {
+    for (int j = 0; j < net_blocks[i]->stage_num; j++) {
+      auto &plan = plan_blocks[i][j];
+      int seqlen = net_blocks[i]->stages[j].input_shapes[0].dims[1];
+      auto &plan0 = plan_blocks[0][stage_of(net_blocks[0], seqlen)];
+      if (plan.io_alone) {
+        plan.inputs[1].device_mem = plan0.inputs[1].device_mem;
+        plan.inputs[2].device_mem = plan0.inputs[2].device_mem;
+      }
+    }
+    auto &plan = plan_blocks_cache[i];
+    if (plan.io_alone) {
+      plan.inputs[1].device_mem = plan_blocks_cache[0].inputs[1].device_mem;
+      plan.inputs[2].device_mem = plan_blocks_cache[0].inputs[2].device_mem;
+      if (paged) {
+        plan.inputs[5].device_mem = plan_blocks_cache[0].inputs[5].device_mem;
+      }
+    }
+  }
+  // the fused nets read the position id & mask uploaded for block_0 and
+  // block_cache_0, whatever the addr mode, their own mems are never written
+  for (int g = 0; g < (int)net_groups.size(); g++) {
+    for (int j = 0; j < net_groups[g]->stage_num; j++) {
+      auto &plan = plan_groups[g][j];
+      int seqlen = net_groups[g]->stages[j].input_shapes[0].dims[1];
+      auto &plan0 = plan_blocks[0][stage_of(net_blocks[0], seqlen)];
+      plan.inputs[1].device_mem = plan0.inputs[1].device_mem;
+      plan.inputs[2].device_mem = plan0.inputs[2].device_mem;
+    }
+  }
+  if (net_decode_step) {
+    plan_decode_step.inputs[1].device_mem =
+        plan_blocks_cache[0].inputs[1].device_mem;
+    plan_decode_step.inputs[2].device_mem =
+        plan_blocks_cache[0].inputs[2].device_mem;
+  }
+  std::vector<std::vector<LaunchPlan> *> row_plans = {&plan_blocks_chunk,
+                                                      &plan_blocks_verify};
+  for (auto &plans : plan_blocks_multi) {
+    row_plans.push_back(&plans);
   }
+  for (auto plans : row_plans) {
+    for (int i = 1; i < (int)plans->size(); i++) {
+      auto &plan = (*plans)[i];
+      if (plan.io_alone) {
+        plan.inputs[1].device_mem = (*plans)[0].inputs[1].device_mem;
+        plan.inputs[2].device_mem = (*plans)[0].inputs[2].device_mem;
+      }
+    }
+  }
+  decode_mask.init(bm_handle, plan_blocks_cache[0].inputs[1].device_mem,
+                   plan_blocks_cache[0].inputs[2].device_mem, MAX_SEQLEN,
+                   ATTENTION_MASK, mask_in_graph);
+  prefix_cache.init(bm_handle, NUM_LAYERS, kv_bytes);
+
+  // session 0 uses the KV above, every other one allocates its own; paged
+  // sessions only hold pages, at least one each
+  session_bytes = 0;
+  for (auto net : net_blocks_cache) {
+    session_bytes += net->max_input_bytes[3] + net->max_input_bytes[4];
+  }
+  MAX_SESSIONS = paged ? NUM_PAGES : 1 + session_budget / session_bytes;
+  printf("KV cache: %s, %d bytes per token\n", KV_INT8 ? "int8" : "float",
+         2 * NUM_LAYERS * kv_bytes);
+  auto &first = sessions[0];
+  first.past_key = past_key;
+  first.past_value = past_value;
+  first.owned = !io_alone && !paged;
 }
 
 sg_llm::~sg_llm() {
-  if (false == io_alone) {
-    for (int i = 0; i < NUM_LAYERS; i++) {
-      bm_free_device(bm_handle, past_key[i]);
-      bm_free_device(bm_handle, past_value[i]);
+  prefix_cache.clear();
+  for (int i = 0; i < 2; i++) {
+    bm_free_device(bm_handle, hidden_mems[i]);
+  }
+  if (VERIFY_LENGTH > 0) {
+    bm_free_device(bm_handle, exit_hidden);
+  }
+  for (auto &it : sessions) {
+    wait_swap(it.second);
+    if (it.second.owned && !it.second.swapped) {
+      free_kv(it.second);
     }
   }
+  if (paged) {
+    bm_free_device(bm_handle, kv_arena);
+  }
   bmrt_destroy(p_bmrt);
   bm_dev_free(bm_handle);
 }
 
-void sg_llm::net_launch(const bm_net_info_t *net, int stage_idx) {
-  std::vector<bm_tensor_t> in_tensors(net->input_num);
-  std::vector<bm_tensor_t> out_tensors(net->output_num);
+// Point every block plan at past_key/past_value: block_i writes its rows to
+// the head of the cache, block_cache_i & block_chunk_i read the cache, their
+// KV outputs are rebound to the current row every step.
+void sg_llm::bind_kv() {
+  for (int i = 0; i < NUM_LAYERS; i++) {
+    for (auto &plan : plan_blocks[i]) {
+      plan.outputs[1].device_mem = past_key[i];
+      plan.outputs[2].device_mem = past_value[i];
+    }
+    plan_blocks_cache[i].inputs[3].device_mem =
+        paged ? pool_key[i] : past_key[i];
+    plan_blocks_cache[i].inputs[4].device_mem =
+        paged ? pool_value[i] : past_value[i];
+  }
+  for (int i = 0; i < (int)plan_blocks_chunk.size(); i++) {
+    plan_blocks_chunk[i].inputs[3].device_mem = past_key[i];
+    plan_blocks_chunk[i].inputs[4].device_mem = past_value[i];
+  }
+  for (int i = 0; i < (int)plan_blocks_verify.size(); i++) {
+    plan_blocks_verify[i].inputs[3].device_mem = past_key[i];
+    plan_blocks_verify[i].inputs[4].device_mem = past_value[i];
+  }
+  for (auto &plans : plan_blocks_multi) {
+    for (int i = 0; i < (int)plans.size(); i++) {
+      plans[i].inputs[3].device_mem = past_key[i];
+      plans[i].inputs[4].device_mem = past_value[i];
+    }
+  }
+  if (net_decode_step) {
+    for (int i = 0; i < NUM_LAYERS; i++) {
+      plan_decode_step.inputs[3 + 2 * i].device_mem = past_key[i];
+      plan_decode_step.inputs[4 + 2 * i].device_mem = past_value[i];
+    }
+  }
+  int layer = 0;
+  for (auto &stages : plan_groups) {
+    int count = (stages[0].outputs.size() - 1) / 2;
+    for (auto &plan : stages) {
+      for (int j = 0; j < count; j++) {
+        plan.outputs[1 + 2 * j].device_mem = past_key[layer + j];
+        plan.outputs[2 + 2 * j].device_mem = past_value[layer + j];
+      }
+    }
+    layer += count;
+  }
+}
+
+bool sg_llm::alloc_kv(KVSession &kv) {
+  for (int i = 0; i < NUM_LAYERS; i++) {
+    bm_device_mem_t key, value;
+    auto net = net_blocks_cache[i];
+    if (BM_SUCCESS !=
+        bm_malloc_device_byte(bm_handle, &key, net->max_input_bytes[3])) {
+      break;
+    }
+    if (BM_SUCCESS !=
+        bm_malloc_device_byte(bm_handle, &value, net->max_input_bytes[4])) {
+      bm_free_device(bm_handle, key);
+      break;
+    }
+    kv.past_key.push_back(key);
+    kv.past_value.push_back(value);
+  }
+  if ((int)kv.past_key.size() < NUM_LAYERS) {
+    free_kv(kv);
+    return false;
+  }
+  return true;
+}
+
+void sg_llm::free_kv(KVSession &kv) {
+  for (int i = 0; i < (int)kv.past_key.size(); i++) {
+    bm_free_device(bm_handle, kv.past_key[i]);
+    bm_free_device(bm_handle, kv.past_value[i]);
+  }
+  kv.past_key.clear();
+  kv.past_value.clear();
+}
+
+void sg_llm::wait_swap(KVSession &kv) {
+  if (kv.pending.valid()) {
+    kv.pending.wait();
+    kv.pending = std::shared_future<void>();
+  }
+}
+
+// Free a device slot if MAX_SESSIONS are resident by swapping out the least
+// recently used session other than 0, the current one and keep. grow: the
+// caller adds a session, so max_swapped bounds how many may live in host.
+bool sg_llm::make_room(int keep, bool grow) {
+  int resident = 0, swapped = 0;
+  for (auto &it : sessions) {
+    swapped += it.second.swapped;
+    resident += !it.second.swapped;
+  }
+  if (resident < MAX_SESSIONS) {
+    return true;
+  }
+  if (grow && swapped >= max_swapped) {
+    return false;
+  }
+  int lru = -1;
+  for (auto &it : sessions) {
+    int id = it.first;
+    if (id == 0 || id == session || id == keep || it.second.swapped) {
+      continue;
+    }
+    if (lru < 0 || it.second.last_use < sessions[lru].last_use) {
+      lru = id;
+    }
+  }
+  if (lru < 0) {
+    return false;
+  }
+  swap_out(lru);
+  wait_swap(sessions[lru]); // its device KV is free once the copy is done
+  return true;
+}
+
+// swap out sessions not used for swap_idle_ms, up to max_swapped in host
+void sg_llm::swap_idle() {
+  if (swap_idle_ms <= 0) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  int swapped = 0;
+  for (auto &it : sessions) {
+    swapped += it.second.swapped;
+  }
+  for (auto &it : sessions) {
+    auto &kv = it.second;
+    if (swapped >= max_swapped) {
+      break;
+    }
+    if (it.first == 0 || it.first == session || kv.swapped ||
+        now - kv.last_use < std::chrono::milliseconds(swap_idle_ms)) {
+      continue;
+    }
+    swap_out(it.first);
+    swapped++;
+  }
+}
+
+// take pages from the free list until the current session holds rows rows;
+// none are taken when the free list can't cover them all
+bool sg_llm::reserve_pages(int rows) {
+  int need = (rows + PAGE_SIZE - 1) / PAGE_SIZE - (int)pages.size();
+  if (need > (int)free_list.size()) {
+    return false;
+  }
+  while ((int)pages.size() * PAGE_SIZE < rows) {
+    pages.push_back(free_list.back());
+    free_list.pop_back();
+    page_table_dirty = true;
+  }
+  return true;
+}
+
+void sg_llm::release_pages(std::vector<int> &list) {
+  free_list.insert(free_list.end(), list.begin(), list.end());
+  page_table_dirty |= &list == &pages;
+  list.clear();
+}
+
+// copy the first rows rows of every layer between past_key/past_value, where
+// block_i put them, and the pages of the current session
+void sg_llm::copy_pages(int rows, bool to_pages) {
+  for (int p = 0; p * PAGE_SIZE < rows; p++) {
+    size_t size = (size_t)std::min(PAGE_SIZE, rows - p * PAGE_SIZE) * kv_bytes;
+    size_t stage_offset = (size_t)p * PAGE_SIZE * kv_bytes;
+    size_t pool_offset = (size_t)pages[p] * PAGE_SIZE * kv_bytes;
+    for (int i = 0; i < NUM_LAYERS; i++) {
+      if (to_pages) {
+        bm_memcpy_d2d_byte(bm_handle, pool_key[i], pool_offset, past_key[i],
+                           stage_offset, size);
+        bm_memcpy_d2d_byte(bm_handle, pool_value[i], pool_offset,
+                           past_value[i], stage_offset, size);
+      } else {
+        bm_memcpy_d2d_byte(bm_handle, past_key[i], stage_offset, pool_key[i],
+                           pool_offset, size);
+        bm_memcpy_d2d_byte(bm_handle, past_value[i], stage_offset,
+                           pool_value[i], pool_offset, size);
+      }
+    }
+  }
+}
+
+// rows past the session's pages read page 0, they are masked anyway
+void sg_llm::upload_page_table() {
+  std::fill(page_table.begin(), page_table.end(), 0);
+  std::copy(pages.begin(), pages.end(), page_table.begin());
+  bm_memcpy_s2d_partial(bm_handle, plan_blocks_cache[0].inputs[5].device_mem,
+                        (void *)page_table.data(),
+                        page_table.size() * sizeof(int));
+  page_table_dirty = false;
+}
+
+// New empty session with its own KV, -1 if MAX_SESSIONS are open and none
+// can be swapped out, or the device is out of memory. The current session
+// does not change.
+int sg_llm::create_session() {
+  KVSession kv;
+  kv.owned = !paged;
+  kv.last_use = std::chrono::steady_clock::now();
+  if (paged) {
+    if ((int)sessions.size() >= MAX_SESSIONS) {
+      return -1;
+    }
+  } else if (!make_room(-1, true) || !alloc_kv(kv)) {
+    return -1;
+  }
+  int id = next_session++;
+  sessions[id] = std::move(kv);
+  return id;
+}
+
+// Copy the token_length rows of session id to host on a background thread
+// and free its device KV. prefetch or switch_session bring it back.
+void sg_llm::swap_out(int id) {
+  assert(id != 0 && id != session && sessions.count(id));
+  auto &kv = sessions[id];
+  if (kv.swapped || paged) {
+    return;
+  }
+  wait_swap(kv);
+  size_t bytes = (size_t)kv.token_length * kv_bytes;
+  kv.host.resize(bytes * 2 * NUM_LAYERS);
+  kv.swapped = true;
+  swaps_out++;
+  auto host = kv.host.data();
+  auto keys = std::move(kv.past_key);
+  auto values = std::move(kv.past_value);
+  kv.past_key.clear();
+  kv.past_value.clear();
+  kv.pending = std::async(std::launch::async, [=]() {
+                 auto start = std::chrono::steady_clock::now();
+                 for (int i = 0; i < NUM_LAYERS; i++) {
+                   if (bytes > 0) {
+                     bm_memcpy_d2s_partial(bm_handle, host + 2 * i * bytes,
+                                           keys[i], bytes);
+                     bm_memcpy_d2s_partial(bm_handle,
+                                           host + (2 * i + 1) * bytes,
+                                           values[i], bytes);
+                   }
+                   bm_free_device(bm_handle, keys[i]);
+                   bm_free_device(bm_handle, values[i]);
+                 }
+                 auto end = std::chrono::steady_clock::now();
+                 swap_out_bytes += bytes * 2 * NUM_LAYERS;
+                 swap_out_us += std::chrono::duration_cast<
+                                    std::chrono::microseconds>(end - start)
+                                    .count();
+               }).share();
+}
+
+// Start copying a swapped out session back to the device, so a later
+// switch_session to it doesn't wait for the whole copy. May swap out the
+// least recently used session for room; false if there is none.
+bool sg_llm::prefetch(int id) {
+  assert(sessions.count(id));
+  auto &kv = sessions[id];
+  if (!kv.swapped) {
+    return true;
+  }
+  if (!make_room(id, false)) {
+    return false;
+  }
+  wait_swap(kv); // the swap out is done writing host
+  if (!alloc_kv(kv)) {
+    return false;
+  }
+  kv.swapped = false;
+  swaps_in++;
+  size_t bytes = (size_t)kv.token_length * kv_bytes;
+  auto keys = kv.past_key;
+  auto values = kv.past_value;
+  auto host = &kv.host;
+  kv.pending = std::async(std::launch::async, [=]() {
+                 auto start = std::chrono::steady_clock::now();
+                 for (int i = 0; i < NUM_LAYERS && bytes > 0; i++) {
+                   bm_memcpy_s2d_partial(bm_handle, keys[i],
+                                         host->data() + 2 * i * bytes, bytes);
+                   bm_memcpy_s2d_partial(bm_handle, values[i],
+                                         host->data() + (2 * i + 1) * bytes,
+                                         bytes);
+                 }
+                 std::vector<uint8_t>().swap(*host);
+                 auto end = std::chrono::steady_clock::now();
+                 swap_in_bytes += bytes * 2 * NUM_LAYERS;
+                 swap_in_us += std::chrono::duration_cast<
+                                   std::chrono::microseconds>(end - start)
+                                   .count();
+               }).share();
+  return true;
+}
+
+// Make id the current session: only the KV tensors given to the launches
+// change, the nets and their other io stay as they are. forward_next takes
+// the token to decode from the caller, so nothing else is per session.
+void sg_llm::switch_session(int id) {
+  assert(sessions.count(id));
+  if (id == session) {
+    return;
+  }
+  bm_thread_sync(bm_handle);
+  auto &cur = sessions[session];
+  cur.token_length = token_length;
+  cur.history.swap(history);
+  cur.last_use = std::chrono::steady_clock::now();
+  session = id; // the old session may be swapped out from here on
+  auto &next = sessions[id];
+  if (paged) {
+    pages.swap(cur.pages);
+    pages.swap(next.pages);
+    page_table_dirty = true;
+  } else if (next.swapped || next.pending.valid()) {
+    auto start = std::chrono::steady_clock::now();
+    bool ok = prefetch(id);
+    assert(ok);
+    wait_swap(next);
+    swap_wait_ms += std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+  }
+  swap_idle();
+  if (!paged) {
+    past_key = next.past_key;
+    past_value = next.past_value;
+  }
+  token_length = next.token_length;
+  history.swap(next.history);
+  bind_kv();
+  // the decode mask is shared, rewrite it for this session
+  decode_mask.reset(token_length);
+}
 
+// free the KV of session id, the current one goes back to session 0
+void sg_llm::close_session(int id) {
+  assert(id != 0 && sessions.count(id));
+  if (id == session) {
+    switch_session(0);
+  }
+  auto &kv = sessions[id];
+  bm_thread_sync(bm_handle);
+  wait_swap(kv);
+  if (!kv.swapped) {
+    free_kv(kv);
+  }
+  release_pages(kv.pages);
+  sessions.erase(id);
+}
+
+// empty session id but keep it open, paged its pages go back to the pool
+void sg_llm::clear_session(int id) {
+  assert(sessions.count(id));
+  if (id == session) {
+    if (paged) {
+      release_pages(pages);
+    }
+    token_length = 0;
+    history.clear();
+    return;
+  }
+  auto &kv = sessions[id];
+  release_pages(kv.pages);
+  kv.token_length = 0;
+  kv.history.clear();
+}
+
+LaunchPlan sg_llm::make_plan(const bm_net_info_t *net, int stage_idx) {
+  LaunchPlan plan;
+  plan.name = net->name;
+  plan.io_alone = net->addr_mode == 1;
+  plan.inputs.resize(net->input_num);
+  plan.outputs.resize(net->output_num);
   for (int i = 0; i < net->input_num; i++) {
     bmrt_tensor_with_device(
-        &in_tensors[i], net->stages[stage_idx].input_mems[i],
+        &plan.inputs[i], net->stages[stage_idx].input_mems[i],
         net->input_dtypes[i], net->stages[stage_idx].input_shapes[i]);
   }
   for (int i = 0; i < net->output_num; i++) {
     bmrt_tensor_with_device(
-        &out_tensors[i], net->stages[stage_idx].output_mems[i],
+        &plan.outputs[i], net->stages[stage_idx].output_mems[i],
         net->output_dtypes[i], net->stages[stage_idx].output_shapes[i]);
   }
-  auto ret = bmrt_launch_tensor_ex(p_bmrt, net->name, in_tensors.data(),
-                                   net->input_num, out_tensors.data(),
-                                   net->output_num, true, false);
+  return plan;
+}
+
+void sg_llm::net_launch(LaunchPlan &plan) {
+  auto ret = bmrt_launch_tensor_ex(p_bmrt, plan.name, plan.inputs.data(),
+                                   plan.inputs.size(), plan.outputs.data(),
+                                   plan.outputs.size(), true, false);
   assert(ret);
-  bm_thread_sync(bm_handle);
+  launches++;
+  debug_sync(plan.name);
+}
+
+// Launch plan on the hidden states in src and return the mem holding its
+// output. The net reads src in place and writes the other ping-pong buffer,
+// whatever its addr mode, as the KV outputs are bound. Only a net whose
+// hidden tensors differ in dtype or size from the bytes of src gets them
+// copied to its own input.
+bm_device_mem_t sg_llm::launch_hidden(LaunchPlan &plan, bm_device_mem_t src,
+                                      size_t bytes) {
+  auto &in = plan.inputs[0];
+  auto &out = plan.outputs[0];
+  if (in.dtype != hidden_dtype || out.dtype != hidden_dtype ||
+      bmrt_tensor_bytesize(&in) != bytes ||
+      bmrt_tensor_bytesize(&out) != bytes) {
+    d2d(in.device_mem, src, bytes);
+    hidden_bytes_copied += bytes;
+    net_launch(plan);
+    return out.device_mem;
+  }
+  auto dst = hidden_mems[0];
+  if (bm_mem_get_device_addr(src) == bm_mem_get_device_addr(dst)) {
+    dst = hidden_mems[1];
+  }
+  in.device_mem = src;
+  out.device_mem = dst;
+  hidden_bytes_saved += bytes;
+  net_launch(plan);
+  return dst;
+}
+
+// launches are queued in order on the device, so only the host read of the
+// token needs a sync; layer_sync restores the per-launch sync for debugging
+void sg_llm::debug_sync(const char *name) {
+  if (!layer_sync) {
+    return;
+  }
+  auto status = bm_thread_sync(bm_handle);
+  if (BM_SUCCESS != status) {
+    printf("Error: net[%s] failed, status %d\n", name, (int)status);
+  }
+  assert(BM_SUCCESS == status);
 }
 
 void sg_llm::d2d(bm_device_mem_t &dst, bm_device_mem_t &src) {
   bm_memcpy_d2d_byte(bm_handle, dst, 0, src, 0, bm_mem_get_device_size(src));
 }
 
+void sg_llm::d2d(bm_device_mem_t &dst, bm_device_mem_t &src, size_t size) {
+  bm_memcpy_d2d_byte(bm_handle, dst, 0, src, 0, size);
+}
+
+// smallest block_multi_K_i that holds rows tokens, -1 if none
+int sg_llm::multi_of(int rows) {
+  auto it = std::lower_bound(MULTI_LENGTHS.begin(), MULTI_LENGTHS.end(), rows);
+  return it == MULTI_LENGTHS.end() ? -1 : it - MULTI_LENGTHS.begin();
+}
+
+// smallest prefill stage that holds length tokens
+int sg_llm::prefill_seqlen(int length) {
+  for (auto seqlen : PREFILL_SEQLENS) {
+    if (length <= seqlen) {
+      return seqlen;
+    }
+  }
+  return MAX_SEQLEN;
+}
+
+// smallest embedding stage that holds rows tokens, -1 if none
+int sg_llm::embed_stage_of(int rows) {
+  int stage = -1;
+  for (int i = 0; i < net_embed->stage_num; i++) {
+    int seqlen = net_embed->stages[i].input_shapes[0].dims[1];
+    if (seqlen >= rows &&
+        (stage < 0 ||
+         seqlen < net_embed->stages[stage].input_shapes[0].dims[1])) {
+      stage = i;
+    }
+  }
+  return stage;
+}
+
+int sg_llm::stage_of(const bm_net_info_t *net, int seqlen) {
+  for (int i = 0; i < net->stage_num; i++) {
+    if (net->stages[i].input_shapes[0].dims[1] == seqlen) {
+      return i;
+    }
+  }
+  return -1;
+}
+
 int sg_llm::forward_first(std::vector<int> &tokens) {
-  std::vector<int> input_ids(MAX_SEQLEN, 0);
-  std::vector<int> position_id(MAX_SEQLEN, 0);
-  std::vector<uint16_t> attention_mask(MAX_SEQLEN * MAX_SEQLEN, ATTENTION_MASK);
-  std::copy(tokens.begin(), tokens.end(), input_ids.data());
+  // A cached prefix is copied to the head of the KV cache and only the rest
+  // is appended. Without chunk or multi nets the rest goes token by token,
+  // so the hit is only taken when the rest is shorter than the prefix.
+  // Paged KV is staged in past_key/past_value on the way to the pages.
+  int length = tokens.size();
+  int cached = prefix_cache.match(tokens, length - 1);
+  if (CHUNK_LENGTH <= 1 && MULTI_LENGTHS.empty() && length - cached >= cached) {
+    cached = 0;
+  }
+  if (paged) {
+    release_pages(pages);
+    if (!reserve_pages(length)) {
+      token_length = 0;
+      history.clear();
+      return -1;
+    }
+  }
+  prefix_cache.load(tokens, cached, past_key, past_value);
+  if (cached > 0) {
+    token_length = cached;
+    history.assign(tokens.begin(), tokens.begin() + cached);
+    decode_mask.reset(token_length);
+    if (paged) {
+      copy_pages(cached, true);
+    }
+    std::vector<int> rest(tokens.begin() + cached, tokens.end());
+    int token = forward_append(rest);
+    if (paged && prefix_cache.budget > 0) {
+      copy_pages(length, false);
+    }
+    prefix_cache.insert(tokens, length, past_key, past_value);
+    return token;
+  }
+
   token_length = tokens.size();
+  history = tokens;
+  int seqlen = prefill_seqlen(token_length);
+  std::vector<int> input_ids(seqlen, 0);
+  std::vector<int> position_id(seqlen, 0);
+  std::copy(tokens.begin(), tokens.end(), input_ids.data());
 
   for (int i = 0; i < token_length; i++) {
     position_id[i] = i;
   }
-  for (int i = 0; i < token_length; i++) {
-    for (int j = 0; j < MAX_SEQLEN; j++) {
-      if (j <= i) {
-        attention_mask[i * MAX_SEQLEN + j] = 0;
-      }
-    }
+
+  // position id & mask are shared by all blocks, only copy once; nets with
+  // the mask built in graph only need the valid length
+  auto &plan0 = plan_blocks[0][stage_of(net_blocks[0], seqlen)];
+  bm_memcpy_s2d_partial(bm_handle, plan0.inputs[1].device_mem,
+                        (void *)position_id.data(), seqlen * sizeof(int));
+  if (mask_in_graph) {
+    bm_memcpy_s2d_partial(bm_handle, plan0.inputs[2].device_mem,
+                          (void *)&token_length, sizeof(int));
+  } else {
+    // only rows changed since the last prefill are rebuilt, and only those
+    // are sent when the io_alone mask mem still holds the previous upload
+    prefill_mask.build(token_length, seqlen);
+    prefill_mask.upload(bm_handle, plan0.inputs[2].device_mem, seqlen,
+                        plan0.io_alone);
   }
 
   // forward embeding
-  auto &in_mem = net_embed->stages[0].input_mems[0];
-  auto &out_mem = net_embed->stages[0].output_mems[0];
-  bm_memcpy_s2d(bm_handle, in_mem, (void *)input_ids.data());
-  net_launch(net_embed); // prefil embedding
-
-  // forward blocks
-  for (int idx = 0; idx < NUM_LAYERS; idx++) {
-    auto &in0_mem = net_blocks[idx]->stages[0].input_mems[0];
-    auto &in1_mem = net_blocks[idx]->stages[0].input_mems[1];
-    auto &in2_mem = net_blocks[idx]->stages[0].input_mems[2];
-    d2d(in0_mem, out_mem);
-    if (idx == 0) {
-      // only first time need copy
-      bm_memcpy_s2d(bm_handle, in1_mem, (void *)position_id.data());
-      bm_memcpy_s2d(bm_handle, in2_mem, (void *)attention_mask.data());
-    }
-    net_launch(net_blocks[idx]);
-    out_mem = net_blocks[idx]->stages[0].output_mems[0];
-    d2d(past_key[idx], net_blocks[idx]->stages[0].output_mems[1]);
-    d2d(past_value[idx], net_blocks[idx]->stages[0].output_mems[2]);
-  }
-
-  int bytes = out_mem.size / MAX_SEQLEN;
-  auto &lm_in_mem = net_lm->stages[0].input_mems[0];
-  auto &lm_out_mem = net_lm->stages[0].output_mems[0];
+  auto &embed = plan_embed[stage_of(net_embed, seqlen)];
+  bm_device_mem_t out_mem = embed.outputs[0].device_mem;
+  bm_memcpy_s2d_partial(bm_handle, embed.inputs[0].device_mem,
+                        (void *)input_ids.data(), seqlen * sizeof(int));
+  net_launch(embed); // prefil embedding
+
+  // forward blocks, or groups of them
+  if (fused_prefill && !net_groups.empty()) {
+    for (int g = 0; g < (int)net_groups.size(); g++) {
+      auto &plan = plan_groups[g][stage_of(net_groups[g], seqlen)];
+      out_mem = launch_hidden(plan, out_mem, (size_t)seqlen * hidden_bytes);
+    }
+  } else {
+    for (int idx = 0; idx < NUM_LAYERS; idx++) {
+      auto &plan = plan_blocks[idx][stage_of(net_blocks[idx], seqlen)];
+      out_mem = launch_hidden(plan, out_mem, (size_t)seqlen * hidden_bytes);
+    }
+  }
+
+  if (paged) {
+    copy_pages(token_length, true);
+  }
+
+  auto &lm_in_mem = plan_lm.inputs[0].device_mem;
+  auto &lm_out_mem = plan_lm.outputs[0].device_mem;
   bm_memcpy_d2d_byte(bm_handle, lm_in_mem, 0, out_mem,
-                     (token_length - 1) * bytes, bytes);
-  net_launch(net_lm);
+                     (token_length - 1) * hidden_bytes, hidden_bytes);
+  net_launch(plan_lm);
+  bm_thread_sync(bm_handle);
+  decode_mask.reset(token_length);
+  prefix_cache.insert(tokens, token_length, past_key, past_value);
   int token = 0;
   bm_memcpy_d2s(bm_handle, (void *)&token, lm_out_mem);
   return token;
 }
 
+// Run block_cache_i on the hidden state of the token at token_length - 1.
+// Paged, block_paged_i read the pages in the page table and the new row is
+// written straight to its page.
+// Decode the row of token_length - 1 through blocks [0, end_layer), all of
+// them by default.
+bm_device_mem_t sg_llm::forward_blocks_cache(bm_device_mem_t out_mem,
+                                             int end_layer) {
+  if (end_layer < 0) {
+    end_layer = NUM_LAYERS;
+  }
+  int row = token_length - 1;
+  if (paged) {
+    // the callers reserved the pages
+    assert((int)pages.size() * PAGE_SIZE >= token_length);
+    if (page_table_dirty || !plan_blocks_cache[0].io_alone) {
+      upload_page_table();
+    }
+  }
+  update_decode_mask();
+  auto token_offset = (unsigned long long)row * kv_bytes;
+  if (paged) {
+    token_offset = ((unsigned long long)pages[row / PAGE_SIZE] * PAGE_SIZE +
+                    row % PAGE_SIZE) * kv_bytes;
+  }
+  auto &keys = paged ? pool_key : past_key;
+  auto &values = paged ? pool_value : past_value;
+  for (int idx = 0; idx < end_layer; idx++) {
+    auto &plan = plan_blocks_cache[idx];
+    bm_set_device_mem(&plan.outputs[1].device_mem, kv_bytes,
+                      bm_mem_get_device_addr(keys[idx]) + token_offset);
+    bm_set_device_mem(&plan.outputs[2].device_mem, kv_bytes,
+                      bm_mem_get_device_addr(values[idx]) + token_offset);
+    out_mem = launch_hidden(plan, out_mem, hidden_bytes);
+  }
+  return out_mem;
+}
+
+// position id & mask are shared by all blocks, io_alone keeps them resident
+// so only the newly visible row is patched
+void sg_llm::update_decode_mask() {
+  decode_mask.set_position(token_length - 1);
+  if (plan_blocks_cache[0].io_alone) {
+    decode_mask.update(token_length - 1);
+  } else {
+    decode_mask.reset(token_length - 1);
+  }
+}
+
 int sg_llm::forward_next(int cur_token) {
+  assert(token_length < MAX_SEQLEN);
+  if (paged && !reserve_pages(token_length + 1)) {
+    return -1;
+  }
   token_length++;
-  std::vector<uint16_t> attention_mask(MAX_SEQLEN + 1, 0);
-  for (int i = token_length - 1; i < MAX_SEQLEN; i++) {
-    attention_mask[i] = ATTENTION_MASK;
+  decode_steps++;
+  history.push_back(cur_token);
+  auto &lm_in_mem = plan_lm.inputs[0].device_mem;
+  auto &lm_out_mem = plan_lm.outputs[0].device_mem;
+  // cur_token is uploaded rather than taken from the lm_head output, which
+  // another session or a verify pass may have overwritten since
+  if (fused_decode && net_decode_step) {
+    // one launch, the KV rows go straight into the cache
+    auto &plan = plan_decode_step;
+    bm_memcpy_s2d_partial(bm_handle, plan.inputs[0].device_mem,
+                          (void *)&cur_token, sizeof(int));
+    update_decode_mask();
+    auto token_offset = (unsigned long long)(token_length - 1) * kv_bytes;
+    for (int i = 0; i < NUM_LAYERS; i++) {
+      bm_set_device_mem(&plan.outputs[1 + 2 * i].device_mem, kv_bytes,
+                        bm_mem_get_device_addr(past_key[i]) + token_offset);
+      bm_set_device_mem(&plan.outputs[2 + 2 * i].device_mem, kv_bytes,
+                        bm_mem_get_device_addr(past_value[i]) + token_offset);
+    }
+    net_launch(plan);
+    bm_thread_sync(bm_handle);
+    int token = 0;
+    bm_memcpy_d2s_partial(bm_handle, (void *)&token, plan.outputs[0].device_mem,
+                          sizeof(int));
+    return token;
   }
-  int position_id = token_length - 1;
   // embedding
-  auto &lm_in_mem = net_lm->stages[0].input_mems[0];
-  auto &lm_out_mem = net_lm->stages[0].output_mems[0];
-  auto &in_mem = net_embed_cache->stages[0].input_mems[0];
-  auto &out_mem = net_embed_cache->stages[0].output_mems[0];
-  d2d(in_mem, lm_out_mem);
-  net_launch(net_embed_cache);
+  bm_memcpy_s2d_partial(bm_handle, plan_embed_cache.inputs[0].device_mem,
+                        (void *)&cur_token, sizeof(int));
+  net_launch(plan_embed_cache);
   // blocks
-  int bytes =
-      bm_mem_get_device_size(net_blocks_cache[0]->stages[0].output_mems[1]);
-  int token_offset = (token_length - 1) * bytes;
-  for (int idx = 0; idx < NUM_LAYERS; idx++) {
-    auto &in0_mem = net_blocks_cache[idx]->stages[0].input_mems[0];
-    auto &in1_mem = net_blocks_cache[idx]->stages[0].input_mems[1];
-    auto &in2_mem = net_blocks_cache[idx]->stages[0].input_mems[2];
-    auto &in3_mem = net_blocks_cache[idx]->stages[0].input_mems[3];
-    auto &in4_mem = net_blocks_cache[idx]->stages[0].input_mems[4];
-    auto &out0_mem = net_blocks_cache[idx]->stages[0].output_mems[0];
-    auto &out1_mem = net_blocks_cache[idx]->stages[0].output_mems[1];
-    auto &out2_mem = net_blocks_cache[idx]->stages[0].output_mems[2];
-    d2d(in0_mem, out_mem);
-    if (io_alone) {
-      if (idx == 0) {
-        bm_memcpy_s2d(bm_handle, in1_mem, (void *)&position_id);
-        bm_memcpy_s2d(bm_handle, in2_mem, (void *)attention_mask.data());
-      } else {
-        d2d(in1_mem, net_blocks_cache[0]->stages[0].input_mems[1]);
-        d2d(in2_mem, net_blocks_cache[0]->stages[0].input_mems[2]);
+  auto out_mem = forward_blocks_cache(plan_embed_cache.outputs[0].device_mem);
+  d2d(lm_in_mem, out_mem, hidden_bytes);
+  net_launch(plan_lm);
+  bm_thread_sync(bm_handle);
+  int token = 0;
+  bm_memcpy_d2s(bm_handle, (void *)&token, lm_out_mem);
+  return token;
+}
+
+// Run num new tokens through plans (block_chunk_i or block_verify_i) at once.
+// The tokens are padded to the rows of the nets, the KV of all of them is
+// written after the cached rows, the padding ones stay masked until
+// overwritten.
+bm_device_mem_t sg_llm::forward_chunk(std::vector<LaunchPlan> &plans,
+                                      int embed_stage, const int *tokens,
+                                      int num) {
+  int seqlen = net_embed->stages[embed_stage].input_shapes[0].dims[1];
+  std::vector<int> input_ids(seqlen, 0);
+  std::copy(tokens, tokens + num, input_ids.data());
+  auto &embed = plan_embed[embed_stage];
+  bm_memcpy_s2d_partial(bm_handle, embed.inputs[0].device_mem,
+                        (void *)input_ids.data(), seqlen * sizeof(int));
+  net_launch(embed);
+  return forward_chunk_blocks(plans, embed.outputs[0].device_mem, num, 0);
+}
+
+// The blocks of forward_chunk from begin_layer on, out_mem holds the rows of
+// the tokens after block begin_layer - 1, or their embedding.
+bm_device_mem_t sg_llm::forward_chunk_blocks(std::vector<LaunchPlan> &plans,
+                                             bm_device_mem_t out_mem, int num,
+                                             int begin_layer) {
+  auto &plan0 = plans[0];
+  int chunk = plan0.inputs[0].shape.dims[1];
+  assert(num <= chunk);
+  std::vector<int> position_id(chunk);
+  for (int i = 0; i < chunk; i++) {
+    position_id[i] = std::min(token_length + i, MAX_SEQLEN - 1);
+  }
+  bm_memcpy_s2d_partial(bm_handle, plan0.inputs[1].device_mem,
+                        (void *)position_id.data(), chunk * sizeof(int));
+  if (mask_in_graph) {
+    bm_memcpy_s2d_partial(bm_handle, plan0.inputs[2].device_mem,
+                          (void *)&token_length, sizeof(int));
+  } else {
+    build_chunk_mask(chunk_mask, token_length, chunk, MAX_SEQLEN,
+                     ATTENTION_MASK);
+    bm_memcpy_s2d_partial(bm_handle, plan0.inputs[2].device_mem,
+                          (void *)chunk_mask.data(),
+                          chunk_mask.size() * sizeof(uint16_t));
+  }
+
+  auto token_offset = (unsigned long long)token_length * kv_bytes;
+  for (int idx = begin_layer; idx < NUM_LAYERS; idx++) {
+    auto &plan = plans[idx];
+    bm_set_device_mem(&plan.outputs[1].device_mem, chunk * kv_bytes,
+                      bm_mem_get_device_addr(past_key[idx]) + token_offset);
+    bm_set_device_mem(&plan.outputs[2].device_mem, chunk * kv_bytes,
+                      bm_mem_get_device_addr(past_value[idx]) + token_offset);
+    out_mem = launch_hidden(plan, out_mem, (size_t)chunk * hidden_bytes);
+  }
+  token_length += num;
+  return out_mem;
+}
+
+// Append tokens after the ones in the KV cache and return the next token, so
+// a new turn only computes its own tokens. Runs of CHUNK_LENGTH go through
+// block_chunk_i, without chunk nets through the block_multi_K_i that fit,
+// the rest one by one through block_cache_i.
+int sg_llm::forward_append(std::vector<int> &tokens) {
+  int num = tokens.size();
+  assert(num > 0 && token_length + num <= MAX_SEQLEN);
+  if (paged && !reserve_pages(token_length + num)) {
+    return -1;
+  }
+  history.insert(history.end(), tokens.begin(), tokens.end());
+  bm_device_mem_t out_mem;
+  int last_row = 0; // row of the last token in out_mem
+  for (int i = 0; i < num;) {
+    if (i > 0) {
+      // the next step rewrites position id & mask still read by this one
+      bm_thread_sync(bm_handle);
+    }
+    int left = num - i;
+    int multi = -1;
+    if (CHUNK_LENGTH <= 1 && left > 1 && !MULTI_LENGTHS.empty()) {
+      multi = multi_of(std::min(left, MULTI_LENGTHS.back()));
+      if (token_length + MULTI_LENGTHS[multi] > MAX_SEQLEN) {
+        multi = -1;
       }
+    }
+    if (CHUNK_LENGTH > 1 && left > 1 &&
+        token_length + CHUNK_LENGTH <= MAX_SEQLEN) {
+      int n = std::min(CHUNK_LENGTH, left);
+      out_mem = forward_chunk(plan_blocks_chunk, chunk_embed_stage, &tokens[i],
+                              n);
+      last_row = n - 1;
+      i += n;
+    } else if (multi >= 0) {
+      int n = std::min(MULTI_LENGTHS[multi], left);
+      out_mem = forward_chunk(plan_blocks_multi[multi],
+                              multi_embed_stages[multi], &tokens[i], n);
+      last_row = n - 1;
+      i += n;
     } else {
-      if (idx == 0) {
-        bm_memcpy_s2d(bm_handle, in1_mem, (void *)&position_id);
-        bm_memcpy_s2d(bm_handle, in2_mem, (void *)attention_mask.data());
-      }
-      d2d(in3_mem, past_key[idx]);
-      d2d(in4_mem, past_value[idx]);
-    }
-    net_launch(net_blocks_cache[idx]);
-    out_mem = out0_mem;
-    bm_memcpy_d2d_byte(bm_handle, past_key[idx], token_offset, out1_mem, 0,
-                       bytes);
-    bm_memcpy_d2d_byte(bm_handle, past_value[idx], token_offset, out2_mem, 0,
-                       bytes);
-  }
-  d2d(lm_in_mem, out_mem);
-  net_launch(net_lm);
+      token_length++;
+      bm_memcpy_s2d_partial(bm_handle, plan_embed_cache.inputs[0].device_mem,
+                            (void *)&tokens[i], sizeof(int));
+      net_launch(plan_embed_cache);
+      out_mem = forward_blocks_cache(plan_embed_cache.outputs[0].device_mem);
+      last_row = 0;
+      i++;
+    }
+  }
+
+  auto &lm_in_mem = plan_lm.inputs[0].device_mem;
+  auto &lm_out_mem = plan_lm.outputs[0].device_mem;
+  bm_memcpy_d2d_byte(bm_handle, lm_in_mem, 0, out_mem,
+                     (size_t)last_row * hidden_bytes, hidden_bytes);
+  net_launch(plan_lm);
+  bm_thread_sync(bm_handle);
   int token = 0;
   bm_memcpy_d2s(bm_handle, (void *)&token, lm_out_mem);
   return token;
 }
 
+// Append tokens (at most VERIFY_LENGTH) through block_verify_i and return the
+// token predicted after each of them, e.g. the last accepted token and the
+// draft after it. Wrong drafts are dropped with rollback().
+std::vector<int> sg_llm::forward_verify(std::vector<int> &tokens) {
+  int num = tokens.size();
+  assert(VERIFY_LENGTH > 0 && num > 0 && num <= VERIFY_LENGTH);
+  assert(token_length + VERIFY_LENGTH <= MAX_SEQLEN);
+  history.insert(history.end(), tokens.begin(), tokens.end());
+  auto out_mem = forward_chunk(plan_blocks_verify, verify_embed_stage,
+                               tokens.data(), num);
+  d2d(plan_lm_verify.inputs[0].device_mem, out_mem,
+      (size_t)VERIFY_LENGTH * hidden_bytes);
+  net_launch(plan_lm_verify);
+  bm_thread_sync(bm_handle);
+  std::vector<int> next(VERIFY_LENGTH);
+  bm_memcpy_d2s_partial(bm_handle, next.data(),
+                        plan_lm_verify.outputs[0].device_mem,
+                        VERIFY_LENGTH * sizeof(int));
+  next.resize(num);
+  return next;
+}
+
+// Append tokens through the smallest block_multi_K_i that holds them and
+// return the token predicted after each of them. Unlike forward_append, all
+// the positions are scored, e.g. for parallel sampling or checking drafts;
+// rows past the tokens are padding and dropped.
+std::vector<int> sg_llm::forward_multi(std::vector<int> &tokens) {
+  int num = tokens.size();
+  int j = multi_of(num);
+  assert(num > 0 && j >= 0);
+  int k = MULTI_LENGTHS[j];
+  assert(token_length + k <= MAX_SEQLEN);
+  history.insert(history.end(), tokens.begin(), tokens.end());
+  auto out_mem = forward_chunk(plan_blocks_multi[j], multi_embed_stages[j],
+                               tokens.data(), num);
+  auto &lm = plan_lm_multi[j];
+  d2d(lm.inputs[0].device_mem, out_mem, (size_t)k * hidden_bytes);
+  net_launch(lm);
+  bm_thread_sync(bm_handle);
+  std::vector<int> next(k);
+  bm_memcpy_d2s_partial(bm_handle, next.data(), lm.outputs[0].device_mem,
+                        k * sizeof(int));
+  next.resize(num);
+  return next;
+}
+
+// Self-speculative decoding, no draft model: the first exit_layer blocks and
+// lm_head draft draft_length tokens after cur_token one by one, then
+// block_verify_i of the deeper blocks score cur_token and the drafts in one
+// pass. The shallow blocks of a token only see the shallow KV of the tokens
+// before it, so the rows the drafts wrote are the ones the full stack would
+// and stay in the cache for the accepted ones. Returns the accepted drafts
+// and the full stack's token after them, stops at eos.
+std::vector<int> sg_llm::forward_early_exit(int cur_token, int eos) {
+  assert(VERIFY_LENGTH > 1 && !paged);
+  assert(exit_layer > 0 && exit_layer < NUM_LAYERS);
+  int base = token_length;
+  std::vector<int> input = {cur_token};
+  if (base + VERIFY_LENGTH > MAX_SEQLEN) {
+    // no room for a verify pass
+    return {forward_append(input)};
+  }
+  int k = VERIFY_LENGTH;
+  if (draft_length > 0) {
+    k = std::min(draft_length + 1, VERIFY_LENGTH);
+  }
+  // the shallow blocks, one token at a time
+  auto &lm_in_mem = plan_lm.inputs[0].device_mem;
+  auto &lm_out_mem = plan_lm.outputs[0].device_mem;
+  for (int i = 0; i < k; i++) {
+    token_length = base + i + 1;
+    bm_memcpy_s2d_partial(bm_handle, plan_embed_cache.inputs[0].device_mem,
+                          (void *)&input[i], sizeof(int));
+    net_launch(plan_embed_cache);
+    auto out_mem = forward_blocks_cache(plan_embed_cache.outputs[0].device_mem,
+                                        exit_layer);
+    bm_memcpy_d2d_byte(bm_handle, exit_hidden, (size_t)i * hidden_bytes,
+                       out_mem, 0, hidden_bytes);
+    if (i == k - 1) {
+      break;
+    }
+    d2d(lm_in_mem, out_mem, hidden_bytes);
+    net_launch(plan_lm);
+    bm_thread_sync(bm_handle);
+    int token = 0;
+    bm_memcpy_d2s(bm_handle, (void *)&token, lm_out_mem);
+    input.push_back(token);
+  }
+  // the deep blocks, all tokens at once
+  token_length = base;
+  history.insert(history.end(), input.begin(), input.end());
+  auto out_mem =
+      forward_chunk_blocks(plan_blocks_verify, exit_hidden, k, exit_layer);
+  d2d(plan_lm_verify.inputs[0].device_mem, out_mem,
+      (size_t)VERIFY_LENGTH * hidden_bytes);
+  net_launch(plan_lm_verify);
+  bm_thread_sync(bm_handle);
+  std::vector<int> next(VERIFY_LENGTH);
+  bm_memcpy_d2s_partial(bm_handle, next.data(),
+                        plan_lm_verify.outputs[0].device_mem,
+                        VERIFY_LENGTH * sizeof(int));
+
+  int accepted = 0;
+  while (accepted < k - 1 && input[accepted + 1] == next[accepted] &&
+         input[accepted + 1] != eos) {
+    accepted++;
+  }
+  rollback(base + 1 + accepted);
+  exit_proposed += k - 1;
+  exit_accepted += accepted;
+  exit_steps++;
+  std::vector<int> out(input.begin() + 1, input.begin() + 1 + accepted);
+  out.push_back(next[accepted]);
+  return out;
+}
+
+// Keep only the first length tokens of the KV cache. The rows after them stay
+// on the device but are masked, the next tokens overwrite them.
+void sg_llm::rollback(int length) {
+  assert(length >= 0 && length <= token_length && !paged);
+  token_length = length;
+  history.resize(length);
+}
+
+SessionHeader sg_llm::session_header() {
+  SessionHeader header = {};
+  header.model_hash = model_hash;
+  header.dtype = net_blocks_cache[0]->input_dtypes[3];
+  header.seqlen = MAX_SEQLEN;
+  header.num_layers = NUM_LAYERS;
+  header.token_length = token_length;
+  return header;
+}
+
+std::vector<SessionTensor> sg_llm::session_tensors() {
+  std::vector<SessionTensor> tensors;
+  for (int i = 0; i < NUM_LAYERS; i++) {
+    tensors.push_back({bm_handle, past_key[i]});
+    tensors.push_back({bm_handle, past_value[i]});
+  }
+  return tensors;
+}
+
+// Save the KV cache of the current conversation, tokens are the ids it holds
+// and come back in session_tokens on load.
+bool sg_llm::save_session(const std::string &path, std::vector<int> &tokens) {
+  if (paged) {
+    copy_pages(token_length, false);
+  }
+  bm_thread_sync(bm_handle);
+  return save_session_file(path, session_header(), tokens, session_tensors());
+}
+
+// Restore a saved conversation, or a prefilled system prompt; continue with
+// forward_append. Its tokens also go to the prefix cache.
+bool sg_llm::load_session(const std::string &path) {
+  auto header = session_header();
+  if (!load_session_file(path, header, session_tokens, session_tensors())) {
+    return false;
+  }
+  if (paged) {
+    release_pages(pages);
+    if (!reserve_pages(header.token_length)) {
+      printf("Error: out of KV pages for session %s\n", path.c_str());
+      token_length = 0;
+      history.clear();
+      return false;
+    }
+    copy_pages(header.token_length, true);
+  }
+  token_length = header.token_length;
+  history = session_tokens;
+  decode_mask.reset(token_length);
+  if ((int)session_tokens.size() == token_length) {
+    prefix_cache.insert(session_tokens, token_length, past_key, past_value);
+  }
+  return true;
+}
+
 PYBIND11_MODULE(sg_llm, m) {
   pybind11::class_<sg_llm>(m, "sg_llm", "Sophgo LLM interface")
-      .def(pybind11::init<const std::string &>(), pybind11::arg("model_path"))
+      .def(pybind11::init<const std::string &, uint64_t>(),
+           pybind11::arg("model_path"), pybind11::arg("session_budget") = 0)
       .def("forward_first", &sg_llm::forward_first)
       .def("forward_next", &sg_llm::forward_next)
+      .def("forward_append", &sg_llm::forward_append)
+      .def("forward_verify", &sg_llm::forward_verify)
+      .def("forward_early_exit", &sg_llm::forward_early_exit,
+           pybind11::arg("cur_token"), pybind11::arg("eos") = -1)
+      .def("forward_multi", &sg_llm::forward_multi)
+      .def("rollback", &sg_llm::rollback)
+      .def("save_session", &sg_llm::save_session, pybind11::arg("path"),
+           pybind11::arg("tokens") = std::vector<int>())
+      .def("load_session", &sg_llm::load_session)
+      .def_readonly("session_tokens", &sg_llm::session_tokens)
+      .def("create_session", &sg_llm::create_session)
+      .def("switch_session", &sg_llm::switch_session)
+      .def("close_session", &sg_llm::close_session)
+      .def("clear_session", &sg_llm::clear_session)
+      .def("swap_out", &sg_llm::swap_out)
+      .def("prefetch", &sg_llm::prefetch)
+      .def_readwrite("max_swapped", &sg_llm::max_swapped)
+      .def_readwrite("swap_idle_ms", &sg_llm::swap_idle_ms)
+      .def_readonly("swaps_out", &sg_llm::swaps_out)
+      .def_readonly("swaps_in", &sg_llm::swaps_in)
+      .def_readonly("swap_wait_ms", &sg_llm::swap_wait_ms)
+      .def_readonly("PAGE_SIZE", &sg_llm::PAGE_SIZE)
+      .def_readonly("NUM_PAGES", &sg_llm::NUM_PAGES)
+      .def_readonly("KV_INT8", &sg_llm::KV_INT8)
+      .def_property_readonly("free_pages", &sg_llm::free_pages)
+      .def_property_readonly(
+          "swap_out_bytes",
+          [](sg_llm &self) { return self.swap_out_bytes.load(); })
+      .def_property_readonly(
+          "swap_in_bytes",
+          [](sg_llm &self) { return self.swap_in_bytes.load(); })
+      .def_property_readonly(
+          "swap_out_ms", [](sg_llm &self) { return self.swap_out_us / 1000.0; })
+      .def_property_readonly(
+          "swap_in_ms", [](sg_llm &self) { return self.swap_in_us / 1000.0; })
+      .def_readonly("session", &sg_llm::session)
+      .def_readonly("MAX_SESSIONS", &sg_llm::MAX_SESSIONS)
+      .def_readonly("history", &sg_llm::history)
       .def_readonly("MAX_SEQLEN", &sg_llm::MAX_SEQLEN)
-      .def_readonly("NUM_LAYERS", &sg_llm::NUM_LAYERS);
+      .def_readonly("NUM_LAYERS", &sg_llm::NUM_LAYERS)
+      .def_readonly("PREFILL_SEQLENS", &sg_llm::PREFILL_SEQLENS)
+      .def_readonly("CHUNK_LENGTH", &sg_llm::CHUNK_LENGTH)
+      .def_readonly("VERIFY_LENGTH", &sg_llm::VERIFY_LENGTH)
+      .def_readonly("MULTI_LENGTHS", &sg_llm::MULTI_LENGTHS)
+      .def_readonly("token_length", &sg_llm::token_length)
+      .def_readwrite("exit_layer", &sg_llm::exit_layer)
+      .def_readwrite("draft_length", &sg_llm::draft_length)
+      .def_readonly("exit_proposed", &sg_llm::exit_proposed)
+      .def_readonly("exit_accepted", &sg_llm::exit_accepted)
+      .def_readonly("exit_steps", &sg_llm::exit_steps)
+      .def_property_readonly("exit_acceptance_rate",
+                             [](sg_llm &self) {
+                               return self.exit_proposed
+                                          ? (double)self.exit_accepted /
+                                                self.exit_proposed
+                                          : 0.0;
+                             })
+      .def_readonly("launches", &sg_llm::launches)
+      .def_readwrite("fused_decode", &sg_llm::fused_decode)
+      .def_readwrite("fused_prefill", &sg_llm::fused_prefill)
+      .def_readonly("GROUP_LAYERS", &sg_llm::GROUP_LAYERS)
+      .def_readonly("decode_steps", &sg_llm::decode_steps)
+      .def_readwrite("layer_sync", &sg_llm::layer_sync)
+      .def_readonly("hidden_bytes_saved", &sg_llm::hidden_bytes_saved)
+      .def_readonly("hidden_bytes_copied", &sg_llm::hidden_bytes_copied)
+      .def_property_readonly("mask_bytes_uploaded",
+                             &sg_llm::mask_bytes_uploaded)
+      .def_property(
+          "prefix_cache_budget",
+          [](sg_llm &self) { return self.prefix_cache.budget; },
+          [](sg_llm &self, uint64_t budget) {
+            self.prefix_cache.set_budget(budget);
+          })
+      .def_property_readonly(
+          "prefix_cache_bytes",
+          [](sg_llm &self) { return self.prefix_cache.bytes; })
+      .def_property_readonly(
+          "prefix_hits", [](sg_llm &self) { return self.prefix_cache.hits; })
+      .def_property_readonly(
+          "prefix_misses",
+          [](sg_llm &self) { return self.prefix_cache.misses; })
+      .def_property_readonly(
+          "prefix_hit_tokens",
+          [](sg_llm &self) { return self.prefix_cache.hit_tokens; })
+      .def_property_readonly(
+          "prefix_evictions",
+          [](sg_llm &self) { return self.prefix_cache.evictions; });
+
+  using LLMScheduler = Scheduler<sg_llm>;
+  pybind11::class_<LLMScheduler::Result>(m, "Result")
+      .def_readonly("tokens", &LLMScheduler::Result::tokens)
+      .def_readonly("done", &LLMScheduler::Result::done)
+      .def_readonly("expired", &LLMScheduler::Result::expired)
+      .def_readonly("queue_ms", &LLMScheduler::Result::queue_ms)
+      .def_readonly("compute_ms", &LLMScheduler::Result::compute_ms)
+      .def_readonly("first_token_ms", &LLMScheduler::Result::first_token_ms);
+  pybind11::class_<LLMScheduler::Metrics>(m, "Metrics")
+      .def_readonly("finished", &LLMScheduler::Metrics::finished)
+      .def_readonly("expired", &LLMScheduler::Metrics::expired)
+      .def_readonly("tokens", &LLMScheduler::Metrics::tokens)
+      .def_readonly("rounds", &LLMScheduler::Metrics::rounds)
+      .def_readonly("preempted", &LLMScheduler::Metrics::preempted)
+      .def_readonly("queue_ms", &LLMScheduler::Metrics::queue_ms)
+      .def_readonly("compute_ms", &LLMScheduler::Metrics::compute_ms)
+      .def_readonly("first_token_ms", &LLMScheduler::Metrics::first_token_ms);
+  // the scheduler thread owns the model until stop(), don't call it meanwhile
+  pybind11::class_<LLMScheduler>(m, "Scheduler")
+      .def(pybind11::init<sg_llm &, int>(), pybind11::arg("model"),
+           pybind11::arg("prefill_chunk") = 256, pybind11::keep_alive<1, 2>())
+      .def("submit", &LLMScheduler::submit, pybind11::arg("tokens"),
+           pybind11::arg("max_new_tokens"), pybind11::arg("priority") = 1,
+           pybind11::arg("deadline_ms") = 0, pybind11::arg("eos") = -1,
+           pybind11::arg("conversation") = -1)
+      .def("poll", &LLMScheduler::poll)
+      .def("end_conversation", &LLMScheduler::end_conversation)
+      .def("metrics", &LLMScheduler::metrics)
+      .def("stop", &LLMScheduler::stop,
+           pybind11::call_guard<pybind11::gil_scoped_release>());
+
+  using LLMSpeculative = Speculative<sg_llm, sg_llm>;
+  pybind11::class_<LLMSpeculative>(m, "Speculative")
+      .def(pybind11::init<sg_llm &, sg_llm &, int>(), pybind11::arg("target"),
+           pybind11::arg("draft"), pybind11::arg("eos") = -1,
+           pybind11::keep_alive<1, 2>(), pybind11::keep_alive<1, 3>())
+      .def("forward_first", &LLMSpeculative::forward_first)
+      .def("forward_append", &LLMSpeculative::forward_append)
+      .def("resume", &LLMSpeculative::resume)
+      .def("forward_next", &LLMSpeculative::forward_next)
+      .def_property_readonly("acceptance_rate",
+                             &LLMSpeculative::acceptance_rate)
+      .def_property_readonly("tokens_per_second",
+                             &LLMSpeculative::tokens_per_second)
+      .def_readonly("proposed", &LLMSpeculative::proposed)
+      .def_readonly("accepted", &LLMSpeculative::accepted)
+      .def_readonly("steps", &LLMSpeculative::steps)
+      .def_readonly("tokens", &LLMSpeculative::tokens)
+      .def_readonly("decode_ms", &LLMSpeculative::decode_ms);
+
+  using LLMPromptLookup = PromptLookup<sg_llm>;
+  pybind11::class_<LLMPromptLookup>(m, "PromptLookup")
+      .def(pybind11::init<sg_llm &, int, int, int>(), pybind11::arg("target"),
+           pybind11::arg("eos") = -1, pybind11::arg("min_ngram") = 1,
+           pybind11::arg("max_ngram") = 3, pybind11::keep_alive<1, 2>())
+      .def("forward_first", &LLMPromptLookup::forward_first)
+      .def("forward_append", &LLMPromptLookup::forward_append)
+      .def("resume", &LLMPromptLookup::resume)
+      .def("forward_next", &LLMPromptLookup::forward_next)
+      .def_property_readonly("acceptance_rate",
+                             &LLMPromptLookup::acceptance_rate)
+      .def_property_readonly("tokens_per_second",
+                             &LLMPromptLookup::tokens_per_second)
+      .def_readonly("proposed", &LLMPromptLookup::proposed)
+      .def_readonly("accepted", &LLMPromptLookup::accepted)
+      .def_readonly("verified", &LLMPromptLookup::verified)
+      .def_readonly("steps", &LLMPromptLookup::steps)
+      .def_readonly("tokens", &LLMPromptLookup::tokens)
+      .def_readonly("decode_ms", &LLMPromptLookup::decode_ms);
 }
\ No newline at end of file
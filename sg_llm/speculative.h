@@ -0,0 +1,118 @@
+//===----------------------------------------------------------------------===//
+//
+// Copyright (C) 2023 Sophgo Technologies Inc.  All rights reserved.
+//
+// TPU-MLIR is licensed under the 2-Clause BSD License except for the
+// third-party components.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <assert.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// Greedy speculative decoding. Decode streams all the weights for one row,
+// so the target scores VERIFY_LENGTH rows in about the time of one: a small
+// draft model proposes VERIFY_LENGTH - 1 tokens after the current one, the
+// target's block_verify_i runs the current token and the drafts in one pass,
+// the drafts it agrees with are kept and its own prediction after the last of
+// them comes for free. The tokens are the ones the target alone would pick.
+// Target is sg_llm with verify nets, Draft an sg_llm on the same tokenizer;
+// host stand-ins with forward_first, forward_append, forward_next,
+// forward_verify (target), rollback, token_length, MAX_SEQLEN &
+// VERIFY_LENGTH do for testing.
+template <typename Target, typename Draft> class Speculative {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  Speculative(Target &target, Draft &draft, int eos = -1)
+      : target(target), draft(draft), eos(eos) {
+    assert(target.VERIFY_LENGTH > 1);
+  }
+
+  int forward_first(std::vector<int> &tokens) {
+    lag.clear();
+    draft.forward_first(tokens);
+    return target.forward_first(tokens);
+  }
+
+  int forward_append(std::vector<int> &tokens) {
+    lag.insert(lag.end(), tokens.begin(), tokens.end());
+    return target.forward_append(tokens);
+  }
+
+  // tokens are already in the target KV, e.g. of a restored session: only
+  // the draft prefills them
+  void resume(std::vector<int> &tokens) {
+    lag.clear();
+    draft.forward_first(tokens);
+  }
+
+  // Tokens after cur_token, the last returned one: the accepted drafts and
+  // the target's next token, which is the next cur_token. Stops at eos.
+  std::vector<int> forward_next(int cur_token) {
+    auto start = Clock::now();
+    int k = target.VERIFY_LENGTH;
+    int base = target.token_length;
+    std::vector<int> out;
+    lag.push_back(cur_token);
+    if (base + k > target.MAX_SEQLEN ||
+        draft.token_length + (int)lag.size() + k > draft.MAX_SEQLEN) {
+      // no room for a verify pass
+      std::vector<int> feed = {cur_token};
+      out.push_back(target.forward_append(feed));
+    } else {
+      // the draft catches up on the tokens it missed, then runs ahead
+      int draft_base = draft.token_length + lag.size();
+      std::vector<int> input = {cur_token, draft.forward_append(lag)};
+      lag.clear();
+      while ((int)input.size() < k) {
+        input.push_back(draft.forward_next(input.back()));
+      }
+      auto next = target.forward_verify(input);
+      int accepted = 0;
+      while (accepted < k - 1 && input[accepted + 1] == next[accepted] &&
+             input[accepted + 1] != eos) {
+        accepted++;
+      }
+      out.assign(input.begin() + 1, input.begin() + 1 + accepted);
+      out.push_back(next[accepted]);
+      proposed += k - 1;
+      this->accepted += accepted;
+      // keep cur_token & the accepted drafts; the draft KV holds at most the
+      // first k - 2 drafts, the last one is fed next time
+      target.rollback(base + 1 + accepted);
+      draft.rollback(draft_base + std::min(accepted, k - 2));
+      if (accepted == k - 1) {
+        lag.push_back(input[k - 1]);
+      }
+    }
+    steps++;
+    tokens += out.size();
+    decode_ms += std::chrono::duration<double, std::milli>(Clock::now() - start)
+                     .count();
+    return out;
+  }
+
+  double acceptance_rate() const {
+    return proposed ? (double)accepted / proposed : 0;
+  }
+  double tokens_per_second() const {
+    return decode_ms > 0 ? tokens * 1000.0 / decode_ms : 0;
+  }
+
+  uint64_t proposed = 0; // draft tokens scored by the target
+  uint64_t accepted = 0; // of them agreed with
+  uint64_t steps = 0;    // target passes of forward_next
+  uint64_t tokens = 0;   // returned by forward_next
+  double decode_ms = 0;  // in forward_next
+
+private:
+  Target &target;
+  Draft &draft;
+  int eos;
+  std::vector<int> lag; // in the target KV, not yet in the draft's
+};